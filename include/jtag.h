@@ -2,6 +2,7 @@
 #define __JTAG_H__
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "config.h"
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
@@ -22,7 +23,29 @@
 #define JTAG_MODE_HW	0
 #define JTAG_MODE_SW	1
 
+/* highest SCHED_FIFO priority of JTAG_rt_enter(), below threaded IRQs */
+#define JTAG_RT_MAX_PRIO	49
+
+#define JTAG_CHAIN_MAX_DEVICES	32
+
+/* devices of a scan chain, see JTAG_chain_discover(); device 0 is nearest TDO */
+struct jtag_chain {
+	int num_devices;
+	int ir_len;					/* all devices */
+	uint32_t idcode[JTAG_CHAIN_MAX_DEVICES];	/* 0: BYPASS after reset */
+	int dev_ir_len[JTAG_CHAIN_MAX_DEVICES];		/* -1: unknown */
+};
+
+/* SVF HIR/TIR/HDR/TDR lengths reaching one device, the others in BYPASS */
+struct jtag_padding {
+	int hir;	/* IR bits of the devices nearer TDO */
+	int tir;	/* IR bits of the devices nearer TDI */
+	int hdr;
+	int tdr;
+};
+
 struct jtag_ops;
+struct jtag_link_stats;
 
 typedef enum {
 	ARG_MODE,
@@ -30,6 +53,8 @@ typedef enum {
 	ARG_LOG_LEVEL,
 	ARG_EID,
 	ARG_NET,
+	ARG_MCTP_WINDOW,
+	ARG_MCTP_MAX_MSG,
 } JTAG_ARG_ID;
 #define JTAG_MAX_ARGS	8
 struct jtag_arg {
@@ -51,8 +76,34 @@ typedef struct JTAG_Handler {
 	int loglevel;
 	bool single_step;
 	int type;
+	size_t svf_mem_limit;	/* SVF working memory budget, 0: unbounded */
+	const char *svf_journal;	/* SVF checkpoint journal, NULL: none */
+	bool svf_resume;	/* continue from the journal's checkpoint */
+	int svf_freq_policy;	/* enum svf_freq_policy */
+	int svf_max_freq;	/* highest validated TCK rate in Hz, 0: unknown */
+	bool svf_adaptive;	/* lower the TCK rate on TDO mismatches */
+	bool svf_padded;	/* svf_padding replaces the files' HIR/HDR/TIR/TDR */
+	struct jtag_padding svf_padding;
+	bool defer_tdo;		/* scans may leave their TDO to JTAG_flush() */
+	bool pure_reads;	/* scans only read, an interface may repeat them */
+	bool nonblock;		/* ops hold back what they would wait to send */
 } JTAG_Handler;
 
+/*
+ * How the SVF player sets the TCK rate:
+ * SVF_FREQ_FIXED: the rate given at open, else the file's first FREQUENCY,
+ *	for the whole file.
+ * SVF_FREQ_FOLLOW: every FREQUENCY command as written.
+ * SVF_FREQ_DYNAMIC: scans at the highest validated rate, RUNTEST waits at
+ *	the FREQUENCY rate.
+ * No rate exceeds svf_max_freq when it is set.
+ */
+enum svf_freq_policy {
+	SVF_FREQ_FIXED,
+	SVF_FREQ_FOLLOW,
+	SVF_FREQ_DYNAMIC,
+};
+
 struct jtag_ops {
 	int (*open)(JTAG_Handler *handler, char *intf, struct jtag_args *args);
 	void (*close)(JTAG_Handler *handler);
@@ -63,6 +114,39 @@ struct jtag_ops {
 	int (*load_svf)(JTAG_Handler *handler, char *svf_path, bool step);
 	int (*shift_ir)(JTAG_Handler *handler, int bits, const uint8_t *out, uint8_t *in, int state);
 	int (*shift_dr)(JTAG_Handler *handler, int bits, const uint8_t *out, uint8_t *in, int state);
+	/*
+	 * Clock bits TCKs driving tms and tdi (first in bit 0, tdi NULL: low)
+	 * and sampling TDO into tdo (optional), ending in end_state.  Returns
+	 * -EOPNOTSUPP, without clocking, if the interface cannot; the caller
+	 * then uses set_state and the shift ops.
+	 */
+	int (*shift_raw)(JTAG_Handler *handler, const uint8_t *tms, const uint8_t *tdi,
+		uint8_t *tdo, int bits, int end_state);
+	/*
+	 * Split-phase shift (optional): shift_submit sends a shift_ir
+	 * (type JTAG_SIR_XFER) or shift_dr (JTAG_SDR_XFER) and returns
+	 * without waiting; shift_complete sends what the interface holds back
+	 * and takes the responses that have come without waiting either, and
+	 * once everything before it is done stores the TDO of the shift in the
+	 * in buffer given to shift_submit.  It returns -EAGAIN until then, and
+	 * past the response timeout sends again or fails.  One shift may be
+	 * outstanding at a time; handler->handle becomes readable when a
+	 * response is coming in.  With handler->nonblock set, the other ops
+	 * hold back the messages the interface has no room for instead of
+	 * waiting for responses; shift_complete with backlog set returns once
+	 * none are held back any more.
+	 */
+	int (*shift_submit)(JTAG_Handler *handler, int type, int bits, const uint8_t *out,
+		uint8_t *in, int state);
+	int (*shift_complete)(JTAG_Handler *handler, bool backlog);
+	/*
+	 * Send what the interface holds back and wait for the operations it
+	 * did not wait for (optional), storing the TDO of scans made with
+	 * defer_tdo set; returns -1 if any of them failed.
+	 */
+	int (*flush)(JTAG_Handler *handler);
+	/* fill in the counters of a message transport (optional) */
+	int (*get_link_stats)(JTAG_Handler *handler, struct jtag_link_stats *stats);
 };
 
 typedef enum {
@@ -141,6 +225,17 @@ struct jtag_tap_state {
 	uint8_t	tck;
 };
 
+struct tck_bitbang {
+	uint8_t tms;
+	uint8_t tdi;
+	uint8_t tdo;
+}__attribute__((packed));
+
+struct bitbang_packet {
+	struct tck_bitbang *data;
+	uint32_t length;
+}__attribute__((packed));
+
 enum jtag_xfer_type {
 	JTAG_SIR_XFER = 0,
 	JTAG_SDR_XFER = 1,
@@ -151,6 +246,17 @@ enum jtag_xfer_direction {
 	JTAG_WRITE_XFER = 2,
 	JTAG_READ_WRITE_XFER = 3,
 };
+
+/*
+ * Transfer direction of a shift: TDO is only captured when the caller gave
+ * a buffer for it.  Without TDI data zeros are shifted in.
+ */
+static inline int jtag_xfer_direction(const uint8_t *out, const uint8_t *in)
+{
+	if (!in)
+		return JTAG_WRITE_XFER;
+	return out ? JTAG_READ_WRITE_XFER : JTAG_READ_XFER;
+}
 struct scan_field {
     /** The number of bits this field specifies */
     int num_bits;
@@ -179,13 +285,76 @@ struct scan_field {
 #define JTAG_SIOCTRST   _IOW(__JTAG_IOCTL_MAGIC, 7, unsigned int)
 #endif
 
+/* of the requests an interface sent to its endpoint, see JTAG_get_link_stats() */
+struct jtag_link_stats {
+	unsigned long requests;		/* messages sent */
+	unsigned long timeouts;		/* responses not in time */
+	unsigned long retries;		/* requests sent again */
+	unsigned long failures;		/* requests given up on */
+	unsigned long srtt_usec;	/* smoothed round trip time */
+	unsigned long rttvar_usec;	/* its mean deviation */
+	unsigned long rto_msec;		/* current response timeout */
+};
+
+struct svf_stats {
+	unsigned long scans;			/* SIR and SDR commands shifted */
+	unsigned long zero_copy_scans;		/* shifted straight from the parsed TDI */
+	unsigned long raw_scans;		/* clocked as one raw TMS/TDI vector */
+	unsigned long scan_bytes;		/* bytes shifted */
+	unsigned long copy_bytes;		/* bytes copied to assemble scans */
+	unsigned long legacy_copy_bytes;	/* bytes a full per-scan assembly would copy */
+	unsigned long freq_switches;		/* TCK rate changes */
+	unsigned long freq_fallbacks;		/* rate lowered after a TDO mismatch */
+	unsigned long waits;			/* timed RUNTEST waits */
+	unsigned long wait_overshoot_usec;	/* time waited beyond the minimum */
+	unsigned long max_wait_overshoot_usec;
+	unsigned long merged_scans;		/* chain scans serving several devices */
+};
+
+/* reusable SVF player state, see JTAG_svf_session_create() */
+struct svf_session;
+
+/* an SVF file parsed once to be played on several targets, see JTAG_svf_image_load() */
+struct svf_image;
+
+/* outcome of playing an SVF image on one target */
+struct svf_image_result {
+	int status;			/* 0: passed */
+	int line;			/* line of the failing command */
+	unsigned long scans;
+	unsigned long scan_bytes;	/* bytes shifted */
+	unsigned long usec;		/* playing time */
+};
+
+/* one target of svf_image_play_all() */
+struct svf_image_target {
+	JTAG_Handler *handler;
+	const struct svf_image *image;
+	const char *name;
+	struct svf_image_result result;
+};
+
 const char *tap_state_name(tap_state_t state);
 tap_state_t tap_state_by_name(const char *name);
 int JTAG_set_tap_state(JTAG_Handler *jtag, int tap_state);
 int JTAG_get_tap_state(JTAG_Handler *jtag);
 int JTAG_run_test(JTAG_Handler *jtag, int tap_state, int tcks);
+int JTAG_flush(JTAG_Handler *jtag);
+int JTAG_get_link_stats(JTAG_Handler *jtag, struct jtag_link_stats *stats);
+int JTAG_shift_raw(JTAG_Handler *jtag, const uint8_t *tms, const uint8_t *tdi, uint8_t *tdo,
+	int bits, int end_state);
 int JTAG_set_clock_frequency(JTAG_Handler *jtag, int frequency);
 int JTAG_get_clock_frequency(JTAG_Handler *jtag);
+int JTAG_autotune_frequency(JTAG_Handler *jtag, const char *intf, const char *cache_path);
+int JTAG_freq_step_down(int frequency);
+int JTAG_chain_discover(JTAG_Handler *jtag, struct jtag_chain *chain);
+void JTAG_chain_key(const char *intf, char *key, size_t len);
+int JTAG_chain_lookup(JTAG_Handler *jtag, const char *cache_path, const char *key,
+	struct jtag_chain *chain);
+int JTAG_chain_store(const char *cache_path, const char *key, const struct jtag_chain *chain);
+int JTAG_chain_padding(const struct jtag_chain *chain, int index, struct jtag_padding *pad);
+int JTAG_rt_enter(int cpu, int priority);
+void JTAG_rt_exit(void);
 int JTAG_set_mode(JTAG_Handler *jtag, unsigned int Mode);
 int JTAG_set_jtag_trst(JTAG_Handler *jtag, unsigned int active);
 int JTAG_ir_scan(JTAG_Handler *jtag, int num_bits, const uint8_t *out_bits, uint8_t *in_bits,
@@ -193,6 +362,17 @@ int JTAG_ir_scan(JTAG_Handler *jtag, int num_bits, const uint8_t *out_bits, uint
 int JTAG_dr_scan(JTAG_Handler *jtag, int num_bits, const uint8_t *out_bits, uint8_t *in_bits,
 	tap_state_t state);
 int handle_svf_command(JTAG_Handler* jtag, char *filename);
+struct svf_session *svf_session_create(JTAG_Handler *jtag);
+int svf_session_run(struct svf_session *session, char *filename, bool single_step);
+void svf_session_destroy(struct svf_session *session);
+int svf_session_is_current(struct svf_session *session, char *filename, unsigned long *est_ms);
+int svf_session_run_chain(struct svf_session *session, char **files, int num);
+struct svf_image *svf_image_load(char *filename);
+int svf_image_play(const struct svf_image *image, JTAG_Handler *jtag, const char *target,
+	struct svf_image_result *result);
+int svf_image_play_all(struct svf_image_target *targets, int num);
+void svf_image_free(struct svf_image *image);
+void JTAG_get_svf_stats(struct svf_stats *stats);
 void DBG_log(unsigned int level, const char *format, ...);
 int jtag_args_add(struct jtag_args *args, JTAG_ARG_ID id, int val);
 
@@ -200,6 +380,21 @@ JTAG_Handler *JTAG_open(char *jtag_dev, struct jtag_args *args);
 void JTAG_close(JTAG_Handler *handler);
 void JTAG_reset_state(JTAG_Handler *handler);
 int JTAG_load_svf(JTAG_Handler *handler, char *svf_path, bool single_step);
+void JTAG_set_svf_mem_limit(JTAG_Handler *handler, size_t bytes);
+void JTAG_set_svf_journal(JTAG_Handler *handler, const char *path, bool resume);
+void JTAG_set_svf_freq_policy(JTAG_Handler *handler, enum svf_freq_policy policy, int max_freq);
+void JTAG_set_svf_adaptive(JTAG_Handler *handler, bool adaptive);
+void JTAG_set_svf_padding(JTAG_Handler *handler, const struct jtag_padding *pad);
+struct svf_session *JTAG_svf_session_create(JTAG_Handler *handler);
+int JTAG_svf_session_run(struct svf_session *session, char *svf_path, bool single_step);
+int JTAG_svf_session_run_chain(struct svf_session *session, char **svf_paths, int num);
+void JTAG_svf_session_destroy(struct svf_session *session);
+struct svf_image *JTAG_svf_image_load(char *svf_path);
+int JTAG_svf_image_play(const struct svf_image *image, JTAG_Handler *handler, const char *target,
+	struct svf_image_result *result);
+int JTAG_svf_image_play_all(struct svf_image_target *targets, int num);
+void JTAG_svf_image_free(struct svf_image *image);
+int JTAG_svf_is_current(JTAG_Handler *handler, char *svf_path, unsigned long *est_ms);
 int JTAG_send_command(JTAG_Handler *handler, uint8_t *command, uint32_t bit_len);
 int JTAG_transfer_data(JTAG_Handler *handler, uint8_t *out, uint8_t *in, uint32_t bit_len);
 void JTAG_runtest_idle(JTAG_Handler *handler, uint32_t tcks);
@@ -19,6 +19,7 @@
 #endif
 #include <linux/if_link.h>
 #include <linux/rtnetlink.h>
+#include <linux/sockios.h>
 
 #ifndef AF_MCTP
 #define AF_MCTP 45
@@ -55,6 +56,25 @@ struct sockaddr_mctp {
 
 #endif /* MCTP_NET_ANY */
 
+#ifndef MCTP_TAG_MASK
+#define MCTP_TAG_MASK 0x07
+#endif
+
+/* Added in v6.1 */
+#ifndef SIOCMCTPALLOCTAG
+
+#define MCTP_TAG_PREALLOC	0x10
+#define SIOCMCTPALLOCTAG	(SIOCPROTOPRIVATE + 0)
+#define SIOCMCTPDROPTAG		(SIOCPROTOPRIVATE + 1)
+
+struct mctp_ioc_tag_ctl {
+	mctp_eid_t		peer_addr;
+	uint8_t			tag;
+	uint16_t		flags;
+};
+
+#endif /* SIOCMCTPALLOCTAG */
+
 #ifndef MAX_ADDR_LEN
 #define MAX_ADDR_LEN 32
 #endif
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/ioctl.h>
 #include "../include/jtag.h"
 
@@ -99,22 +100,30 @@ int jtag_args_add(struct jtag_args *args, JTAG_ARG_ID id, int val)
 	return 0;
 }
 
+/* each call returns a new handler, released by JTAG_close() */
 JTAG_Handler *JTAG_open(char *intf, struct jtag_args *args)
 {
-	JTAG_Handler *handler;
+	JTAG_Handler *driver, *handler;
 	int rc;
 
 	if (!strcmp(intf, "mctp"))
-		handler = get_handler(JTAG_INTF_MCTP);
+		driver = get_handler(JTAG_INTF_MCTP);
 	else if (!strncmp(intf, "/dev/", 4))
-		handler = get_handler(JTAG_INTF_DEV);
+		driver = get_handler(JTAG_INTF_DEV);
 	else
 		return NULL;
 
+	handler = malloc(sizeof(*handler));
+	if (!handler)
+		return NULL;
+	*handler = *driver;
+
 	printf("%s: handler %s\n", __func__, handler->name);
 	rc = handler->ops->open(handler, intf, args);
-	if (rc < 0)
+	if (rc < 0) {
+		free(handler);
 		return NULL;
+	}
 
 	loglevel = handler->loglevel;
 
@@ -124,6 +133,7 @@ JTAG_Handler *JTAG_open(char *intf, struct jtag_args *args)
 void JTAG_close(JTAG_Handler *handler)
 {
 	handler->ops->close(handler);
+	free(handler);
 }
 
 int JTAG_set_tap_state(JTAG_Handler *handler, int state)
@@ -143,6 +153,146 @@ int JTAG_load_svf(JTAG_Handler *handler, char *svf_path, bool single)
 	return handle_svf_command(handler, svf_path);
 }
 
+void JTAG_set_svf_mem_limit(JTAG_Handler *handler, size_t bytes)
+{
+	handler->svf_mem_limit = bytes;
+}
+
+/*
+ * Checkpoint SVF runs to path at the start of each erase/program/verify
+ * phase.  With resume a run whose file matches the journal continues
+ * from the last checkpoint.  The journal is removed when a file completes.
+ */
+void JTAG_set_svf_journal(JTAG_Handler *handler, const char *path, bool resume)
+{
+	handler->svf_journal = path;
+	handler->svf_resume = resume;
+}
+
+/*
+ * Select how SVF files set the TCK rate.  max_freq is the highest rate
+ * known to work on the board (0: unknown), SVF_FREQ_DYNAMIC shifts at it.
+ */
+void JTAG_set_svf_freq_policy(JTAG_Handler *handler, enum svf_freq_policy policy, int max_freq)
+{
+	handler->svf_freq_policy = policy;
+	handler->svf_max_freq = max_freq;
+}
+
+/*
+ * On a TDO mismatch lower the TCK rate one step and replay the SVF file
+ * from the start of the current erase/program/verify phase instead of
+ * failing, down to the lowest rate.
+ */
+void JTAG_set_svf_adaptive(JTAG_Handler *handler, bool adaptive)
+{
+	handler->svf_adaptive = adaptive;
+}
+
+/*
+ * Address one device of a chain: the SVF player pads every scan with pad,
+ * see JTAG_chain_padding(), and ignores the HIR/HDR/TIR/TDR of the files.
+ * NULL goes back to the files' own padding.
+ */
+void JTAG_set_svf_padding(JTAG_Handler *handler, const struct jtag_padding *pad)
+{
+	handler->svf_padded = pad != NULL;
+	if (pad)
+		handler->svf_padding = *pad;
+}
+
+/*
+ * Load several SVF files on one handler without reallocating the player
+ * buffers or resetting the TAP in between:
+ *	session = JTAG_svf_session_create(handler);
+ *	JTAG_svf_session_run(session, "erase.svf", false);
+ *	JTAG_svf_session_run(session, "program.svf", false);
+ *	JTAG_svf_session_destroy(session);
+ * The memory budget is taken from the handler when the session is created.
+ */
+struct svf_session *JTAG_svf_session_create(JTAG_Handler *handler)
+{
+	return svf_session_create(handler);
+}
+
+int JTAG_svf_session_run(struct svf_session *session, char *svf_path, bool single)
+{
+	return svf_session_run(session, svf_path, single);
+}
+
+/*
+ * Program the devices of a daisy chain together, one SVF file each,
+ * svf_paths[0] for the device nearest TDO.  The scans of the files are
+ * merged into chain scans with the idle devices in BYPASS, and the RUNTEST
+ * waits of one device overlap with the scans of the others.  The files
+ * carry no HIR/HDR/TIR/TDR of their own and run RUNTEST in IDLE only.
+ */
+int JTAG_svf_session_run_chain(struct svf_session *session, char **svf_paths, int num)
+{
+	return svf_session_run_chain(session, svf_paths, num);
+}
+
+void JTAG_svf_session_destroy(struct svf_session *session)
+{
+	svf_session_destroy(session);
+}
+
+/*
+ * Program one SVF file onto several identical targets: the file is parsed
+ * once, then each target plays the image from its own thread:
+ *	image = JTAG_svf_image_load("cpld.svf");
+ *	JTAG_svf_image_play(image, handler, "/dev/jtag0", &result);	(per thread)
+ *	JTAG_svf_image_free(image);
+ * Each target checks its own TDO, result tells how it went.  Loading is
+ * not reentrant, playing is.  LOOP and PIO are not supported.
+ */
+struct svf_image *JTAG_svf_image_load(char *svf_path)
+{
+	return svf_image_load(svf_path);
+}
+
+int JTAG_svf_image_play(const struct svf_image *image, JTAG_Handler *handler, const char *target,
+	struct svf_image_result *result)
+{
+	return svf_image_play(image, handler, target, result);
+}
+
+/*
+ * Play images on several targets from the calling thread: fill in handler,
+ * image and name of each target, the result comes back in it.  RUNTEST
+ * waits of all targets overlap, so one thread keeps many targets busy.
+ * Returns 0 if every target passed.
+ */
+int JTAG_svf_image_play_all(struct svf_image_target *targets, int num)
+{
+	return svf_image_play_all(targets, num);
+}
+
+void JTAG_svf_image_free(struct svf_image *image)
+{
+	svf_image_free(image);
+}
+
+/*
+ * Check whether the device already runs the image of an SVF file by
+ * reading back its IDCODE and USERCODE the way the file verifies them.
+ * Returns 1 if so, 0 if not and < 0 on error; est_ms (optional) gets an
+ * estimate of the time the file takes to play.
+ */
+int JTAG_svf_is_current(JTAG_Handler *handler, char *svf_path, unsigned long *est_ms)
+{
+	struct svf_session *session;
+	int ret;
+
+	session = svf_session_create(handler);
+	if (!session)
+		return -1;
+	ret = svf_session_is_current(session, svf_path, est_ms);
+	svf_session_destroy(session);
+
+	return ret;
+}
+
 int JTAG_set_clock_frequency(JTAG_Handler *handler, int frequency)
 {
 	int ret = 0;
@@ -173,6 +323,41 @@ int JTAG_run_test(JTAG_Handler *handler, int state, int tcks)
 	return ret;
 }
 
+/*
+ * Wait until the operations sent so far are done: an interface may return
+ * from an operation without TDO before the target has answered it, and
+ * report its failure here.
+ */
+int JTAG_flush(JTAG_Handler *handler)
+{
+	int ret = 0;
+
+	if (handler->ops->flush)
+		ret = handler->ops->flush(handler);
+
+	return ret;
+}
+
+/* -EOPNOTSUPP if the interface does not talk to its target in messages */
+int JTAG_get_link_stats(JTAG_Handler *handler, struct jtag_link_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	if (!handler->ops->get_link_stats)
+		return -EOPNOTSUPP;
+
+	return handler->ops->get_link_stats(handler, stats);
+}
+
+/* -EOPNOTSUPP if the interface cannot clock raw TMS/TDI vectors */
+int JTAG_shift_raw(JTAG_Handler *handler, const uint8_t *tms, const uint8_t *tdi, uint8_t *tdo,
+	int bits, int end_state)
+{
+	if (!handler->ops->shift_raw)
+		return -EOPNOTSUPP;
+
+	return handler->ops->shift_raw(handler, tms, tdi, tdo, bits, end_state);
+}
+
 int JTAG_dr_scan(JTAG_Handler *handler, int bits, const uint8_t *out, uint8_t *in, int state)
 {
 	return handler->ops->shift_dr(handler, bits, out, in, state);
@@ -190,24 +375,8 @@ int JTAG_send_command(JTAG_Handler *handler, uint8_t *command, uint32_t len)
 
 int JTAG_transfer_data(JTAG_Handler *handler, uint8_t *out, uint8_t *in, uint32_t bit_len)
 {
-	int byte_len = (bit_len + 7) / 8;
-	uint8_t *tdi = NULL;
-	int ret;
-
-	if (!out) {
-		tdi = malloc(byte_len);
-		memset(tdi, 0, byte_len);
-		if (!tdi) {
-			printf("%s: malloc error\n", __func__);
-			return -1;
-		}
-	}
-	ret = JTAG_dr_scan(handler, bit_len, (const uint8_t *)out ? out : tdi, (uint8_t *)in, JtagRTI);
-
-	if (tdi)
-		free(tdi);
-
-	return ret;
+	/* without out data the backend shifts zeros */
+	return JTAG_dr_scan(handler, bit_len, (const uint8_t *)out, in, JtagRTI);
 }
 
 void JTAG_runtest_idle(JTAG_Handler *handler, uint32_t tcks)
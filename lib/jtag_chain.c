@@ -0,0 +1,349 @@
+/* Copyright (c) 2025, Nuvoton Corporation */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include "../include/jtag.h"
+
+/*
+ * Scan chain discovery.  After a TAP reset every device selects IDCODE
+ * (32 bits, LSB 1) or BYPASS (1 bit, 0), so ones shifted through the DR
+ * return the IDCODEs until the ones come back.  The IR is then flushed
+ * with zeros followed by ones: the last zero comes out delayed by the
+ * total IR length, and the ones leave every device in BYPASS, where the
+ * same flush through the DR counts the devices.  The IR capture value,
+ * ...01 per device, splits the total IR length between the devices.
+ */
+#define CHAIN_FLUSH_BITS	1024	/* more than the IR of any chain */
+#define CHAIN_ID_BITS		(JTAG_CHAIN_MAX_DEVICES * 32 + 32)
+#define CHAIN_LINE_LEN		1024
+#define CHAIN_ID_LEN		128
+
+static uint8_t chain_ones[CHAIN_ID_BITS / 8];
+static uint8_t chain_flush[2 * CHAIN_FLUSH_BITS / 8];
+static uint8_t chain_flush_in[2 * CHAIN_FLUSH_BITS / 8];
+static uint8_t chain_in[CHAIN_ID_BITS / 8];
+
+static int chain_bit(const uint8_t *buf, int bit)
+{
+	return (buf[bit / 8] >> (bit % 8)) & 1;
+}
+
+/* the IDCODEs a TAP reset selects, 0 for devices in BYPASS; -1 on error */
+static int chain_read_idcodes(JTAG_Handler *handler, uint32_t *idcode)
+{
+	int bit = 0, num = 0, i, rc;
+	uint32_t id;
+
+	memset(chain_ones, 0xff, sizeof(chain_ones));
+	JTAG_reset_state(handler);
+	/* IDCODE and BYPASS only read, the scan may run again */
+	handler->pure_reads = true;
+	rc = JTAG_dr_scan(handler, CHAIN_ID_BITS, chain_ones, chain_in, TAP_IDLE);
+	handler->pure_reads = false;
+	if (rc < 0)
+		return -1;
+
+	while (bit + 32 <= CHAIN_ID_BITS) {
+		if (!chain_bit(chain_in, bit)) {
+			bit++;
+			id = 0;
+		} else {
+			id = 0;
+			for (i = 0; i < 32; i++)
+				id |= (uint32_t)chain_bit(chain_in, bit + i) << i;
+			if (id == 0xffffffff)
+				return num;
+			bit += 32;
+		}
+		if (num == JTAG_CHAIN_MAX_DEVICES)
+			break;
+		idcode[num++] = id;
+	}
+	LOG_ERROR("chain: more than %d devices or TDO stuck at 0", JTAG_CHAIN_MAX_DEVICES);
+
+	return -1;
+}
+
+/* length of the IR or DR path, flushing it with zeros and then ones */
+static int chain_flush_length(JTAG_Handler *handler, bool ir)
+{
+	int bit, rc;
+
+	memset(chain_flush, 0, CHAIN_FLUSH_BITS / 8);
+	memset(chain_flush + CHAIN_FLUSH_BITS / 8, 0xff, CHAIN_FLUSH_BITS / 8);
+	/* either leaves every device in BYPASS, however often it runs */
+	handler->pure_reads = true;
+	rc = (ir ? JTAG_ir_scan : JTAG_dr_scan)(handler, 2 * CHAIN_FLUSH_BITS, chain_flush,
+			chain_flush_in, TAP_IDLE);
+	handler->pure_reads = false;
+	if (rc < 0)
+		return -1;
+
+	for (bit = 2 * CHAIN_FLUSH_BITS - 1; bit >= CHAIN_FLUSH_BITS; bit--) {
+		if (!chain_bit(chain_flush_in, bit))
+			break;
+	}
+	if (bit < CHAIN_FLUSH_BITS || bit == 2 * CHAIN_FLUSH_BITS - 1) {
+		LOG_ERROR("chain: no %s path, TDO stuck at %d", ir ? "IR" : "DR",
+			bit < CHAIN_FLUSH_BITS);
+		return -1;
+	}
+
+	return bit - CHAIN_FLUSH_BITS + 1;
+}
+
+/* split the IR capture value into devices, each starting with bits 1, 0 */
+static void chain_split_ir(struct jtag_chain *chain, const uint8_t *capture)
+{
+	int start[JTAG_CHAIN_MAX_DEVICES];
+	int num = 0, bit, i;
+
+	for (i = 0; i < chain->num_devices; i++)
+		chain->dev_ir_len[i] = -1;
+	if (chain->num_devices == 1) {
+		chain->dev_ir_len[0] = chain->ir_len;
+		return;
+	}
+	for (bit = 0; bit + 1 < chain->ir_len; bit++) {
+		if (chain_bit(capture, bit) && !chain_bit(capture, bit + 1)) {
+			if (num == chain->num_devices)
+				return;
+			start[num++] = bit;
+		}
+	}
+	if (num != chain->num_devices || start[0])
+		return;
+	for (i = 0; i < num; i++)
+		chain->dev_ir_len[i] = (i + 1 < num ? start[i + 1] : chain->ir_len) - start[i];
+}
+
+/*
+ * Discover the devices of the chain behind handler: their number, IDCODEs
+ * and IR lengths.  The chain is left reset; < 0 on error.
+ */
+int JTAG_chain_discover(JTAG_Handler *handler, struct jtag_chain *chain)
+{
+	uint8_t capture[CHAIN_FLUSH_BITS / 8];
+	uint32_t idcode[JTAG_CHAIN_MAX_DEVICES];
+	int num_ids, i;
+
+	memset(chain, 0, sizeof(*chain));
+	num_ids = chain_read_idcodes(handler, idcode);
+	if (num_ids < 0)
+		return -1;
+
+	chain->ir_len = chain_flush_length(handler, true);
+	if (chain->ir_len < 0)
+		return -1;
+	memcpy(capture, chain_flush_in, sizeof(capture));
+	chain->num_devices = chain_flush_length(handler, false);
+	JTAG_reset_state(handler);
+	if (chain->num_devices <= 0 || chain->num_devices > JTAG_CHAIN_MAX_DEVICES) {
+		LOG_ERROR("chain: %d devices in BYPASS", chain->num_devices);
+		return -1;
+	}
+
+	if (num_ids == chain->num_devices)
+		memcpy(chain->idcode, idcode, num_ids * sizeof(idcode[0]));
+	else
+		LOG_INFO("chain: %d IDCODEs for %d devices, IDCODEs ignored",
+			num_ids, chain->num_devices);
+	chain_split_ir(chain, capture);
+	for (i = 0; i < chain->num_devices; i++)
+		LOG_DEBUG("chain: device %d IDCODE %08x IR %d", i, chain->idcode[i],
+			chain->dev_ir_len[i]);
+
+	return 0;
+}
+
+/* the board the chains are on, from the device tree or DMI */
+static void chain_board_id(char *buf, size_t len)
+{
+	static const char * const files[][2] = {
+		{ "/proc/device-tree/model", "/proc/device-tree/serial-number" },
+		{ "/sys/class/dmi/id/board_name", "/sys/class/dmi/id/board_serial" },
+	};
+	char part[2][CHAIN_ID_LEN];
+	unsigned i, j;
+	size_t n;
+	FILE *fp;
+
+	for (i = 0; i < ARRAY_SIZE(files); i++) {
+		for (j = 0; j < 2; j++) {
+			part[j][0] = '\0';
+			fp = fopen(files[i][j], "r");
+			if (!fp)
+				continue;
+			n = fread(part[j], 1, sizeof(part[j]) - 1, fp);
+			part[j][n] = '\0';
+			fclose(fp);
+		}
+		if (part[0][0])
+			break;
+	}
+	if (!part[0][0])
+		strcpy(part[0], "unknown");
+	if (part[1][0])
+		snprintf(buf, len, "%s/%s", part[0], part[1]);
+	else
+		snprintf(buf, len, "%s", part[0]);
+
+	/* one word: device tree strings end in NUL, DMI ones in a newline */
+	for (n = 0; buf[n]; n++) {
+		if (isspace((unsigned char)buf[n]) || !isprint((unsigned char)buf[n]))
+			buf[n] = '_';
+	}
+	while (n && buf[n - 1] == '_')
+		buf[--n] = '\0';
+}
+
+/* cache key of the chain behind intf: the interface and the board */
+void JTAG_chain_key(const char *intf, char *key, size_t len)
+{
+	char board[2 * CHAIN_ID_LEN];
+
+	chain_board_id(board, sizeof(board));
+	snprintf(key, len, "%s@%s", intf, board);
+}
+
+static int chain_cache_parse(char *line, const char *key, struct jtag_chain *chain)
+{
+	char *tok, *save;
+	unsigned int id;
+	int i, ir;
+
+	tok = strtok_r(line, " \n", &save);
+	if (!tok || strcmp(tok, key))
+		return -1;
+	memset(chain, 0, sizeof(*chain));
+	tok = strtok_r(NULL, " \n", &save);
+	if (!tok || sscanf(tok, "%d", &chain->num_devices) != 1 ||
+			chain->num_devices <= 0 || chain->num_devices > JTAG_CHAIN_MAX_DEVICES)
+		return -1;
+	tok = strtok_r(NULL, " \n", &save);
+	if (!tok || sscanf(tok, "%d", &chain->ir_len) != 1)
+		return -1;
+	for (i = 0; i < chain->num_devices; i++) {
+		tok = strtok_r(NULL, " \n", &save);
+		if (!tok || sscanf(tok, "%x/%d", &id, &ir) != 2)
+			return -1;
+		chain->idcode[i] = id;
+		chain->dev_ir_len[i] = ir;
+	}
+
+	return 0;
+}
+
+/*
+ * The chain behind handler, from the cache at cache_path (optional) when
+ * the IDCODEs still match, else discovered.  Returns 1 if it came from the
+ * cache, 0 if it was discovered and < 0 on error.
+ */
+int JTAG_chain_lookup(JTAG_Handler *handler, const char *cache_path, const char *key,
+	struct jtag_chain *chain)
+{
+	char line[CHAIN_LINE_LEN];
+	uint32_t idcode[JTAG_CHAIN_MAX_DEVICES];
+	struct jtag_chain entry;
+	bool found = false;
+	int num_ids;
+	FILE *fp;
+
+	fp = cache_path ? fopen(cache_path, "r") : NULL;
+	while (fp && fgets(line, sizeof(line), fp)) {
+		if (!chain_cache_parse(line, key, &entry)) {
+			memcpy(chain, &entry, sizeof(*chain));
+			found = true;
+		}
+	}
+	if (fp)
+		fclose(fp);
+
+	if (found) {
+		/* one DR scan tells whether the board still has these devices */
+		num_ids = chain_read_idcodes(handler, idcode);
+		JTAG_reset_state(handler);
+		if (num_ids == chain->num_devices &&
+				!memcmp(idcode, chain->idcode, num_ids * sizeof(idcode[0])))
+			return 1;
+		LOG_INFO("chain: %s changed, discovering it again", key);
+	}
+
+	return JTAG_chain_discover(handler, chain);
+}
+
+/* rewrite the cache with the entry for key replaced */
+int JTAG_chain_store(const char *cache_path, const char *key, const struct jtag_chain *chain)
+{
+	char line[CHAIN_LINE_LEN];
+	char *tmp;
+	size_t len;
+	FILE *in, *out;
+	int i;
+
+	tmp = malloc(strlen(cache_path) + 5);
+	if (!tmp)
+		return -1;
+	sprintf(tmp, "%s.tmp", cache_path);
+	out = fopen(tmp, "w");
+	if (!out) {
+		LOG_INFO("chain: cannot write %s", tmp);
+		free(tmp);
+		return -1;
+	}
+	len = strlen(key);
+	in = fopen(cache_path, "r");
+	while (in && fgets(line, sizeof(line), in)) {
+		if (!strncmp(line, key, len) && line[len] == ' ')
+			continue;
+		fputs(line, out);
+	}
+	if (in)
+		fclose(in);
+	fprintf(out, "%s %d %d", key, chain->num_devices, chain->ir_len);
+	for (i = 0; i < chain->num_devices; i++)
+		fprintf(out, " %08x/%d", chain->idcode[i], chain->dev_ir_len[i]);
+	fprintf(out, "\n");
+	if (fclose(out) || rename(tmp, cache_path)) {
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+
+	return 0;
+}
+
+/*
+ * SVF padding to reach device index of the chain alone, with all other
+ * devices in BYPASS.  Fails if an IR length it needs is unknown.
+ */
+int JTAG_chain_padding(const struct jtag_chain *chain, int index, struct jtag_padding *pad)
+{
+	int i;
+
+	if (index < 0 || index >= chain->num_devices) {
+		LOG_ERROR("chain: no device %d, the chain has %d", index, chain->num_devices);
+		return -1;
+	}
+	memset(pad, 0, sizeof(*pad));
+	for (i = 0; i < chain->num_devices; i++) {
+		if (i == index)
+			continue;
+		if (chain->dev_ir_len[i] < 0) {
+			LOG_ERROR("chain: IR length of device %d unknown", i);
+			return -1;
+		}
+		if (i < index)
+			pad->hir += chain->dev_ir_len[i];
+		else
+			pad->tir += chain->dev_ir_len[i];
+	}
+	pad->hdr = index;
+	pad->tdr = chain->num_devices - index - 1;
+
+	return 0;
+}
@@ -9,34 +9,69 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <errno.h>
 
 #include "../include/jtag.h"
 
+/*
+ * The jtag core rejects transfers of JTAG_MAX_XFER_DATA_LEN bits or more.
+ * Older drivers bounce data through a TDI_DATA_SIZE buffer and fail larger
+ * transfers with EINVAL before clocking anything.
+ */
+#define JTAGDEV_MAX_XFER_BITS		((JTAG_MAX_XFER_DATA_LEN - 1) & ~7)
+#define JTAGDEV_LEGACY_XFER_BITS	(TDI_DATA_SIZE * 8)
+
+/* longest vector clocked by one JTAG_IOCBITBANG */
+#define JTAGDEV_MAX_RAW_BITS		256
+
 struct jtagdev_priv {
 	int frequency;
 	int mode;
 	int loglevel;
+	int max_xfer_bits;
+	bool no_bitbang;	/* driver lacks JTAG_IOCBITBANG */
+	bool resync;		/* driver state is stale after a bitbang */
+	/* TDI of write-only transfers: the kernel writes TDO back over it */
+	uint8_t bounce[JTAGDEV_MAX_XFER_BITS / 8];
 };
 
-static struct jtagdev_priv jtag_priv = {
+/* every open gets its own copy, so several masters can be driven at once */
+static const struct jtagdev_priv jtagdev_defaults = {
 	.frequency = 0,
 	.mode = JTAG_MODE_HW,
-	.loglevel = LEV_INFO
+	.loglevel = LEV_INFO,
+	.max_xfer_bits = JTAGDEV_MAX_XFER_BITS,
 };
 
+/*
+ * JTAG_IOCBITBANG clocks TCKs without updating the state the driver tracks,
+ * so the first state move or transfer after it tells the driver where the
+ * TAP really is.
+ */
+static int jtagdev_from_state(JTAG_Handler *jtag)
+{
+	struct jtagdev_priv *priv = jtag->priv;
+
+	if (!priv->resync)
+		return JTAG_STATE_CURRENT;
+	priv->resync = false;
+	return jtag->tap_state;
+}
+
 static void jtagdev_process_args(JTAG_Handler *handler, struct jtag_args *args)
 {
+	struct jtagdev_priv *priv = handler->priv;
 	int i;
 
 	for (i = 0; i < args->num_args; i++) {
 		if (i >= JTAG_MAX_ARGS)
 			return;
 		if (args->arg[i].id == ARG_FREQ)
-			jtag_priv.frequency = args->arg[i].val;
+			priv->frequency = args->arg[i].val;
 		else if (args->arg[i].id == ARG_LOG_LEVEL)
-			jtag_priv.loglevel = args->arg[i].val;
+			priv->loglevel = args->arg[i].val;
 		else if (args->arg[i].id == ARG_MODE)
-			jtag_priv.mode = args->arg[i].val;
+			priv->mode = args->arg[i].val;
 	}
 }
 
@@ -88,15 +123,21 @@ static int jtagdev_run_tck(JTAG_Handler *jtag, int tap_state, int tcks)
 
 	if (jtag == NULL)
 		return ST_ERR;
-	tapstate.reset = 0;
-	tapstate.tck = tcks;
-	tapstate.from = JTAG_STATE_CURRENT;
-	tapstate.endstate = tap_state;
-	if (ioctl(jtag->handle, JTAG_SIOCSTATE, &tapstate) < 0) {
-		perror("run test");
-		return ST_ERR;
-	}
+	/* tck is 8 bits wide, clock longer waits in several calls */
+	do {
+		tapstate.reset = 0;
+		tapstate.tck = tcks > UINT8_MAX ? UINT8_MAX : tcks;
+		tapstate.from = jtagdev_from_state(jtag);
+		tapstate.endstate = tap_state;
+		if (ioctl(jtag->handle, JTAG_SIOCSTATE, &tapstate) < 0) {
+			perror("run test");
+			return ST_ERR;
+		}
+		tcks -= tapstate.tck;
+	} while (tcks > 0);
 #endif
+	if (tap_state != JTAG_STATE_CURRENT)
+		jtag->tap_state = tap_state;
 	return ST_OK;
 }
 
@@ -107,7 +148,7 @@ static int jtagdev_set_tap_state(JTAG_Handler *jtag, int tap_state)
 
 	tapstate.reset = 0;
 	tapstate.tck = 0;
-	tapstate.from = JTAG_STATE_CURRENT;
+	tapstate.from = jtagdev_from_state(jtag);
 	tapstate.endstate = tap_state;
 
 	if (ioctl(jtag->handle, req, &tapstate) < 0) {
@@ -145,29 +186,84 @@ static int jtagdev_get_tap_state(JTAG_Handler *jtag)
 	return ST_OK;
 }
 
-static int jtagdev_shift(JTAG_Handler *jtag, struct scan_xfer *scan_xfer, unsigned int type)
+/*
+ * Issue one JTAG_IOCXFER.  The kernel shifts tdio in place and copies it
+ * back whatever the direction, so it never points at the caller's out:
+ * transfers that capture TDO shift in, preloaded with out, and write-only
+ * transfers the handler's bounce buffer.
+ */
+static int jtagdev_xfer(JTAG_Handler *jtag, unsigned int type, int bits,
+	const uint8_t *out, uint8_t *in, int end_state)
 {
+	struct jtagdev_priv *priv = jtag->priv;
 	struct jtag_xfer xfer;
-	unsigned char tdio[TDI_DATA_SIZE];
-#if UINTPTR_MAX == 0xffffffff
-	uint64_t ptr = (uint32_t)tdio;
-#else
-	uint64_t ptr = (uint64_t)tdio;
-#endif
+	int direction = jtag_xfer_direction(out, in);
+	int bytes = (bits + 7) / 8;
+	uint8_t *tdio;
+
+	if (direction == JTAG_WRITE_XFER) {
+		tdio = priv->bounce;
+		if (!out)
+			memset(tdio, 0, bytes);
+		else
+			memcpy(tdio, out, bytes);
+	} else {
+		tdio = in;
+		if (!out)
+			memset(in, 0, bytes);
+		else if (in != out)
+			memcpy(in, out, bytes);
+	}
+
 	memset(&xfer, 0, sizeof(xfer));
-	xfer.from = JTAG_STATE_CURRENT;
-	xfer.endstate = scan_xfer->end_tap_state;
-	xfer.length = scan_xfer->length;
+	xfer.from = jtagdev_from_state(jtag);
+	xfer.endstate = end_state;
+	xfer.length = bits;
 	xfer.type = type;
-	xfer.direction = JTAG_READ_WRITE_XFER;
-	xfer.tdio = ptr;
-	memcpy(tdio, scan_xfer->tdi, scan_xfer->tdi_bytes);
-	if (ioctl(jtag->handle, JTAG_IOCXFER, &xfer) < 0) {
-		perror("jtag shift");
+	xfer.direction = direction;
+	xfer.tdio = (uintptr_t)tdio;
+	if (ioctl(jtag->handle, JTAG_IOCXFER, &xfer) < 0)
 		return ST_ERR;
+
+	return ST_OK;
+}
+
+static int jtagdev_shift_raw(JTAG_Handler *jtag, const uint8_t *tms, const uint8_t *tdi,
+	uint8_t *tdo, int bits, int end_state)
+{
+	struct jtagdev_priv *priv = jtag->priv;
+	struct tck_bitbang tck[JTAGDEV_MAX_RAW_BITS];
+	struct bitbang_packet packet;
+	int i;
+
+	if (priv->no_bitbang || bits > JTAGDEV_MAX_RAW_BITS)
+		return -EOPNOTSUPP;
+
+	for (i = 0; i < bits; i++) {
+		tck[i].tms = (tms[i / 8] >> (i % 8)) & 1;
+		tck[i].tdi = tdi ? (tdi[i / 8] >> (i % 8)) & 1 : 0;
+		tck[i].tdo = 0;
 	}
-	memcpy(scan_xfer->tdo, tdio, scan_xfer->tdo_bytes);
+	packet.data = tck;
+	packet.length = bits;
+	if (ioctl(jtag->handle, JTAG_IOCBITBANG, &packet) < 0) {
+		if (errno == ENOTTY || errno == EINVAL) {
+			DBG_log(LEV_INFO, "jtagdev: no bitbang support, moving by state");
+			priv->no_bitbang = true;
+			return -EOPNOTSUPP;
+		}
+		perror("jtag bitbang");
+		return ST_ERR;
+	}
+	if (tdo) {
+		memset(tdo, 0, (bits + 7) / 8);
+		for (i = 0; i < bits; i++)
+			tdo[i / 8] |= (tck[i].tdo & 1) << (i % 8);
+	}
+	jtag->tap_state = end_state;
+	priv->resync = true;
 
+	DBG_log(LEV_DEBUG, "TapState: %d", jtag->tap_state);
 	return ST_OK;
 }
 
@@ -184,35 +280,49 @@ static int jtagdev_set_trst(JTAG_Handler* jtag, unsigned int active)
 }
 #endif
 
-static int jtagdev_shift_dr(JTAG_Handler *jtag, int num_bits, const uint8_t *out_bits, uint8_t *in_bits,
-	tap_state_t state)
+/*
+ * Shift num_bits through IR or DR in as few transfers as the driver takes,
+ * staying in the shift state between them.
+ */
+static int jtagdev_shift(JTAG_Handler *jtag, unsigned int type, int num_bits,
+	const uint8_t *out_bits, uint8_t *in_bits, tap_state_t state)
 {
-	struct scan_xfer scan_xfer = {0};
+	struct jtagdev_priv *priv = jtag->priv;
+	int shift_state = (type == JTAG_SIR_XFER) ? JtagShfIR : JtagShfDR;
 	int remaining_bits = num_bits;
-	int n, bits, index = 0;
+	int bits, index = 0;
 
-	memset(scan_xfer.tdi, 0, sizeof(scan_xfer.tdi));
-	JTAG_set_tap_state(jtag, JtagShfDR);
+	JTAG_set_tap_state(jtag, shift_state);
 	while (remaining_bits > 0) {
-		n = (remaining_bits / 8) > TDI_DATA_SIZE ? TDI_DATA_SIZE : (remaining_bits + 7) / 8;
-		memcpy(scan_xfer.tdi, out_bits + index, n);
-
-		bits = ((n * 8) > remaining_bits)? remaining_bits: (n * 8);
-		remaining_bits -= bits;
-		scan_xfer.length = bits;
-		scan_xfer.tdi_bytes = n;
-		scan_xfer.tdo_bytes = n;
-		if (remaining_bits > 0)
-			scan_xfer.end_tap_state = JtagShfDR;
-		else
-			scan_xfer.end_tap_state = state;
-		if (jtagdev_shift(jtag, &scan_xfer, JTAG_SDR_XFER) != ST_OK) {
-			DBG_log(LEV_ERROR, "ShftDR error");
+		bits = remaining_bits > priv->max_xfer_bits ?
+			priv->max_xfer_bits : remaining_bits;
+		if (jtagdev_xfer(jtag, type, bits,
+				out_bits ? out_bits + index : NULL,
+				in_bits ? in_bits + index : NULL,
+				bits < remaining_bits ? shift_state : state) != ST_OK) {
+			if (errno == EINVAL && bits > JTAGDEV_LEGACY_XFER_BITS) {
+				DBG_log(LEV_INFO, "jtagdev: %d-bit transfer rejected, using %d-bit transfers",
+					bits, JTAGDEV_LEGACY_XFER_BITS);
+				priv->max_xfer_bits = JTAGDEV_LEGACY_XFER_BITS;
+				continue;
+			}
+			perror("jtag shift");
 			return -1;
 		}
-		if (in_bits)
-			memcpy(in_bits+index, scan_xfer.tdo, scan_xfer.tdo_bytes);
-		index += n;
+		remaining_bits -= bits;
+		index += bits / 8;
+	}
+	jtag->tap_state = state;
+
+	return 0;
+}
+
+static int jtagdev_shift_dr(JTAG_Handler *jtag, int num_bits, const uint8_t *out_bits, uint8_t *in_bits,
+	tap_state_t state)
+{
+	if (jtagdev_shift(jtag, JTAG_SDR_XFER, num_bits, out_bits, in_bits, state) < 0) {
+		DBG_log(LEV_ERROR, "ShftDR error");
+		return -1;
 	}
 	return 0;
 }
@@ -220,41 +330,36 @@ static int jtagdev_shift_dr(JTAG_Handler *jtag, int num_bits, const uint8_t *out
 static int jtagdev_shift_ir(JTAG_Handler *jtag, int num_bits, const uint8_t *out_bits, uint8_t *in_bits,
 	tap_state_t state)
 {
-	struct scan_xfer scan_xfer = {0};
 	if (num_bits == 0)
 		return -1;
-	if ((num_bits + 7) / 8 > TDO_DATA_SIZE) {
-		DBG_log(LEV_ERROR, "ir data len too long: %d bits", num_bits);
-		return -1;
-	}
-	JTAG_set_tap_state(jtag, JtagShfIR);
-	scan_xfer.length = num_bits;
-	scan_xfer.tdi_bytes = (num_bits + 7) / 8;
-	memcpy(scan_xfer.tdi, out_bits, scan_xfer.tdi_bytes);
-	scan_xfer.tdo_bytes = scan_xfer.tdi_bytes;
-	scan_xfer.end_tap_state = state;
-	if (jtagdev_shift(jtag, &scan_xfer, JTAG_SIR_XFER) != ST_OK) {
+	if (jtagdev_shift(jtag, JTAG_SIR_XFER, num_bits, out_bits, in_bits, state) < 0) {
 		DBG_log(LEV_ERROR, "ShftIR error");
 		return -1;
 	}
-	if (in_bits)
-		memcpy(in_bits, scan_xfer.tdo, scan_xfer.tdo_bytes);
-
 	return 0;
 }
 
 static int jtagdev_open(JTAG_Handler *handler, char *jtag_dev, struct jtag_args *args)
 {
+	struct jtagdev_priv *priv;
 	int frequency;
 
+	priv = malloc(sizeof(*priv));
+	if (!priv)
+		return -1;
+	*priv = jtagdev_defaults;
+	handler->priv = priv;
+
 	handler->handle = open(jtag_dev, O_RDWR);
 	if (handler->handle < 0) {
 		perror("Can't open jtag device");
+		free(priv);
+		handler->priv = NULL;
 		return -1;
 	}
 
 	jtagdev_process_args(handler, args);
-	frequency = jtag_priv.frequency;
+	frequency = priv->frequency;
 
 	/* Set frequency */
 	if (frequency > 0) {
@@ -264,10 +369,10 @@ static int jtagdev_open(JTAG_Handler *handler, char *jtag_dev, struct jtag_args
 	}
 
 	/* Set transfer mode */
-	if (jtagdev_set_mode(handler, jtag_priv.mode) != ST_OK) {
-		fprintf(stderr, "Failed to set JTAG mode: %d\n", jtag_priv.mode);
+	if (jtagdev_set_mode(handler, priv->mode) != ST_OK) {
+		fprintf(stderr, "Failed to set JTAG mode: %d\n", priv->mode);
 	}
-	handler->loglevel = jtag_priv.loglevel;
+	handler->loglevel = priv->loglevel;
 
 	jtagdev_get_tap_state(handler);
 
@@ -277,6 +382,8 @@ static int jtagdev_open(JTAG_Handler *handler, char *jtag_dev, struct jtag_args
 static void jtagdev_close(JTAG_Handler *handler)
 {
 	close(handler->handle);
+	free(handler->priv);
+	handler->priv = NULL;
 }
 
 static int jtagdev_load_svf(JTAG_Handler *handler, char *svf_path, bool step)
@@ -295,11 +402,11 @@ static const struct jtag_ops jtag_dev_ops = {
 	.shift_dr = jtagdev_shift_dr,
 	.shift_ir = jtagdev_shift_ir,
 	.load_svf = jtagdev_load_svf,
+	.shift_raw = jtagdev_shift_raw,
 };
 
 JTAG_Handler jtag_dev_handler = {
 	.name = "jtag_dev",
 	.type = JTAG_INTF_DEV,
-	.priv = &jtag_priv,
 	.ops = &jtag_dev_ops,
 };
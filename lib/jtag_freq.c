@@ -0,0 +1,259 @@
+/* Copyright (c) 2025, Nuvoton Corporation */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../include/jtag.h"
+
+/*
+ * TCK rate autotune.  Starting at the lowest rate, which serves as the
+ * reference, every rate of the ladder shifts two pseudo-random patterns
+ * through the chain: one through the data registers selected by a TAP
+ * reset (IDCODE or BYPASS) and one with every device in BYPASS.  A rate
+ * passes if both readbacks match the reference bit for bit.  The sweep
+ * stops at the first failing rate and backs off one step from the highest
+ * passing one.  Results are cached per interface and IDCODE.
+ */
+#define AUTOTUNE_PATTERN_BITS	4096
+#define AUTOTUNE_IR_BITS	256	/* more than the IR of any chain */
+#define AUTOTUNE_MAX_DEVICES	64
+#define AUTOTUNE_LINE_LEN	256
+
+static const int autotune_ladder[] = {
+	1000000, 2000000, 4000000, 6000000, 8000000, 10000000, 12000000,
+	16000000, 20000000, 25000000, 33000000, 40000000, 50000000,
+};
+
+struct autotune_capture {
+	uint8_t idcode[AUTOTUNE_PATTERN_BITS / 8];
+	uint8_t bypass[AUTOTUNE_PATTERN_BITS / 8];
+};
+
+static uint8_t autotune_ones[AUTOTUNE_IR_BITS / 8];
+static uint8_t autotune_pattern[2][AUTOTUNE_PATTERN_BITS / 8];
+
+static void autotune_fill(uint8_t *buf, int bytes, uint32_t seed)
+{
+	int i;
+
+	/* xorshift32 */
+	for (i = 0; i < bytes; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		buf[i] = seed;
+	}
+}
+
+static int autotune_capture(JTAG_Handler *handler, struct autotune_capture *cap)
+{
+	int rc = -1;
+
+	JTAG_reset_state(handler);
+	/* IDCODE, then BYPASS: the scans only read and may run again */
+	handler->pure_reads = true;
+	if (JTAG_dr_scan(handler, AUTOTUNE_PATTERN_BITS, autotune_pattern[0],
+			cap->idcode, TAP_IDLE) < 0)
+		goto out;
+	if (JTAG_ir_scan(handler, AUTOTUNE_IR_BITS, autotune_ones, NULL, TAP_IDLE) < 0)
+		goto out;
+	if (JTAG_dr_scan(handler, AUTOTUNE_PATTERN_BITS, autotune_pattern[1],
+			cap->bypass, TAP_IDLE) < 0)
+		goto out;
+	rc = 0;
+out:
+	handler->pure_reads = false;
+	if (!rc)
+		JTAG_reset_state(handler);
+
+	return rc;
+}
+
+static int autotune_bit(const uint8_t *buf, int bit)
+{
+	return (buf[bit / 8] >> (bit % 8)) & 1;
+}
+
+/* a working chain returns the bypass pattern delayed by one bit per device */
+static int autotune_chain_length(const struct autotune_capture *cap)
+{
+	int devices, i;
+
+	for (devices = 1; devices <= AUTOTUNE_MAX_DEVICES; devices++) {
+		for (i = devices; i < AUTOTUNE_PATTERN_BITS; i++) {
+			if (autotune_bit(cap->bypass, i) !=
+					autotune_bit(autotune_pattern[1], i - devices))
+				break;
+		}
+		if (i == AUTOTUNE_PATTERN_BITS)
+			return devices;
+	}
+
+	return -1;
+}
+
+static int autotune_errors(const struct autotune_capture *ref,
+		const struct autotune_capture *cap)
+{
+	int errors = 0;
+	int i;
+
+	for (i = 0; i < AUTOTUNE_PATTERN_BITS; i++) {
+		errors += autotune_bit(ref->idcode, i) != autotune_bit(cap->idcode, i);
+		errors += autotune_bit(ref->bypass, i) != autotune_bit(cap->bypass, i);
+	}
+
+	return errors;
+}
+
+static int autotune_test(JTAG_Handler *handler, int frequency,
+		const struct autotune_capture *ref)
+{
+	struct autotune_capture cap;
+	int errors;
+
+	if (JTAG_set_clock_frequency(handler, frequency))
+		return -1;
+	if (autotune_capture(handler, &cap) < 0)
+		return -1;
+	errors = autotune_errors(ref, &cap);
+	LOG_DEBUG("autotune: %d Hz, %d bit errors", frequency, errors);
+
+	return errors ? -1 : 0;
+}
+
+static int autotune_cache_lookup(const char *path, const char *intf, uint32_t idcode)
+{
+	char line[AUTOTUNE_LINE_LEN], name[AUTOTUNE_LINE_LEN];
+	unsigned int id;
+	int frequency = 0, f;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%255s %x %d", name, &id, &f) == 3 &&
+				!strcmp(name, intf) && id == idcode)
+			frequency = f;
+	}
+	fclose(fp);
+
+	return frequency;
+}
+
+/* rewrite the cache with the entry for intf/idcode replaced */
+static void autotune_cache_store(const char *path, const char *intf, uint32_t idcode,
+		int frequency)
+{
+	char line[AUTOTUNE_LINE_LEN], name[AUTOTUNE_LINE_LEN];
+	char *tmp;
+	unsigned int id;
+	FILE *in, *out;
+
+	tmp = malloc(strlen(path) + 5);
+	if (!tmp)
+		return;
+	sprintf(tmp, "%s.tmp", path);
+	out = fopen(tmp, "w");
+	if (!out) {
+		LOG_INFO("autotune: cannot write %s", tmp);
+		free(tmp);
+		return;
+	}
+	in = fopen(path, "r");
+	while (in && fgets(line, sizeof(line), in)) {
+		if (sscanf(line, "%255s %x", name, &id) == 2 &&
+				!strcmp(name, intf) && id == idcode)
+			continue;
+		fputs(line, out);
+	}
+	if (in)
+		fclose(in);
+	fprintf(out, "%s %08x %d\n", intf, idcode, frequency);
+	if (fclose(out) || rename(tmp, path))
+		unlink(tmp);
+	free(tmp);
+}
+
+/* the ladder rate below frequency, 0 if there is none */
+int JTAG_freq_step_down(int frequency)
+{
+	int i;
+
+	for (i = ARRAY_SIZE(autotune_ladder) - 1; i >= 0; i--) {
+		if (autotune_ladder[i] < frequency)
+			return autotune_ladder[i];
+	}
+
+	return 0;
+}
+
+/*
+ * Find the highest TCK rate the board shifts without errors, from the
+ * cache at cache_path (optional) or by sweeping the rates up to MAX_FREQ.
+ * The clock is left at the returned rate in Hz; < 0 on error.
+ */
+int JTAG_autotune_frequency(JTAG_Handler *handler, const char *intf, const char *cache_path)
+{
+	struct autotune_capture ref;
+	uint32_t idcode;
+	int frequency, devices, i, best = -1;
+	bool failed = false;
+
+	if (!handler->ops->set_freq) {
+		LOG_ERROR("autotune: %s cannot set the TCK rate", handler->name);
+		return -1;
+	}
+	memset(autotune_ones, 0xff, sizeof(autotune_ones));
+	autotune_fill(autotune_pattern[0], sizeof(autotune_pattern[0]), 0x4a544147);
+	autotune_fill(autotune_pattern[1], sizeof(autotune_pattern[1]), 0x42595053);
+
+	/* reference readback at the lowest rate */
+	if (JTAG_set_clock_frequency(handler, autotune_ladder[0]) ||
+			autotune_capture(handler, &ref) < 0)
+		return -1;
+	devices = autotune_chain_length(&ref);
+	if (devices < 0) {
+		LOG_ERROR("autotune: no working chain at %d Hz", autotune_ladder[0]);
+		return -1;
+	}
+	idcode = ref.idcode[0] | ref.idcode[1] << 8 | ref.idcode[2] << 16 |
+		(uint32_t)ref.idcode[3] << 24;
+	LOG_DEBUG("autotune: %d device(s), IDCODE %08x", devices, idcode);
+
+	if (cache_path) {
+		frequency = autotune_cache_lookup(cache_path, intf, idcode);
+		if (frequency > 0 && !autotune_test(handler, frequency, &ref)) {
+			LOG_INFO("autotune: %d Hz from %s", frequency, cache_path);
+			return frequency;
+		}
+	}
+
+	for (i = 0; i < (int)ARRAY_SIZE(autotune_ladder); i++) {
+		if (autotune_ladder[i] > MAX_FREQ * 1000000)
+			break;
+		if (autotune_test(handler, autotune_ladder[i], &ref)) {
+			failed = true;
+			break;
+		}
+		best = i;
+	}
+	if (best < 0) {
+		LOG_ERROR("autotune: readback unstable at %d Hz", autotune_ladder[0]);
+		return -1;
+	}
+	/* safety margin below the first failing rate */
+	if (failed && best > 0)
+		best--;
+	frequency = autotune_ladder[best];
+	if (JTAG_set_clock_frequency(handler, frequency))
+		return -1;
+	LOG_INFO("autotune: %d Hz", frequency);
+
+	if (cache_path)
+		autotune_cache_store(cache_path, intf, idcode, frequency);
+
+	return frequency;
+}
@@ -11,7 +11,9 @@
 #include <sys/ioctl.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <errno.h>
+#include <time.h>
 
 #include "../include/jtag.h"
 #include "../include/mctp.h"
@@ -20,6 +22,37 @@
 
 #define CMD_JTAG_SET_STATE      1
 #define CMD_JTAG_TRANSFER       2
+#define CMD_JTAG_BITBANG        3
+#define CMD_JTAG_BATCH          4
+
+#define JTAG_MCTP_TIMEOUT_MS	3000	/* before a round trip is measured, and at most */
+#define JTAG_MCTP_RTO_MIN_MS	20
+#define JTAG_MCTP_RETRIES	3	/* timeouts of a request before it fails */
+/* TCK rates assumed when none is set: the slowest for timeouts, the fastest for round trips */
+#define JTAG_MCTP_MIN_FREQ	100000
+#define JTAG_MCTP_MAX_FREQ	25000000
+#define JTAG_MCTP_WINDOW	4	/* requests in flight by default */
+#define JTAG_MCTP_WINDOW_MAX	7	/* of the 8 tags, one is left to others */
+#define MCTP_DEFAULT_NET	1
+#define JTAG_MCTP_MTU		63	/* message bytes in one baseline packet */
+#define JTAG_MCTP_MAX_MSG	1024	/* longest transfer message by default */
+#define JTAG_MCTP_MIN_MSG	64
+#define JTAG_MCTP_IOV_MAX	16	/* pieces a response is received into */
+
+/*
+ * Status of a request the endpoint will not take whole, followed by the
+ * longest message it takes (uint32_t); nothing was clocked.
+ */
+#define JTAG_STATUS_TOO_BIG	0x02
+
+/*
+ * CMD_JTAG_TRANSFER: the request always carries length bits of TDI.  The
+ * response carries the captured TDO only if the direction includes
+ * JTAG_READ_XFER, a write-only transfer is answered with the status byte.
+ * A scan longer than a message is sent as several transfers, all but the
+ * last ending in Shift-IR/DR, so each continues where the previous one
+ * stopped.
+ */
 struct jtag_xfer2 {
 	uint8_t type;
 	uint8_t direction;
@@ -30,6 +63,18 @@ struct jtag_xfer2 {
 	uint8_t	tdio[];
 }__attribute__((packed));
 
+/*
+ * CMD_JTAG_BITBANG: length TCKs, data holds the TMS bits followed by the
+ * TDI bits, (length + 7) / 8 bytes each.  The response is the status byte
+ * followed by the sampled TDO bits; a non-zero status without TDO means
+ * the endpoint does not implement the command and clocked nothing.  The
+ * endpoint follows the TAP state through the TMS bits.
+ */
+struct jtag_bitbang2 {
+	uint32_t length;
+	uint8_t data[];
+}__attribute__((packed));
+
 struct jtag_tap_state2 {
 	uint8_t	reset;
 	uint8_t	from;
@@ -37,25 +82,264 @@ struct jtag_tap_state2 {
 	uint32_t tck;
 }__attribute__((packed));
 
+/*
+ * CMD_JTAG_BATCH: operations run in order, each a jtag_batch_op followed
+ * by the request data of its cmd (CMD_JTAG_SET_STATE, CMD_JTAG_TRANSFER
+ * or CMD_JTAG_BITBANG).  The response is the status byte followed by the
+ * TDO of the operations flagged JTAG_BATCH_TDO, each in whole bytes.  An
+ * endpoint that does not implement the command answers the status byte
+ * alone and clocks nothing.
+ */
+#define JTAG_BATCH_TDO		0x01
+
+struct jtag_batch_op {
+	uint8_t cmd;
+	uint8_t flags;
+}__attribute__((packed));
+
 struct mctp_jtag_msg {
 	uint8_t cmd;
 	uint8_t data[];
 }__attribute__((packed));
 
+/* where bytes of TDO in a response go, in NULL: nowhere */
+struct jtag_mctp_tdo {
+	uint8_t *in;
+	int bytes;
+};
+
+/*
+ * A tag of the socket.  A request sent more than once, or failed while in
+ * flight, may still be answered after it is retired; its tag is not used
+ * again until those answers have come or quiet_usec has passed, so they
+ * cannot be taken for the response to a later request.
+ */
+struct jtag_mctp_tag {
+	uint8_t tag;
+	bool busy;		/* a request in flight has it */
+	int dups;		/* answers still to come besides the request's own */
+	uint64_t quiet_usec;	/* none will come after this */
+};
+
+/* a request in flight, matched to its response by tag, or held back */
+struct jtag_mctp_req {
+	struct jtag_mctp_tag *tag;	/* sent with this tag */
+	uint8_t cmd;
+	bool done;		/* answered, or failed */
+	int rc;
+	uint8_t status;		/* first byte of the response */
+	struct jtag_mctp_tdo *tdo;	/* where its TDO goes, in order */
+	int num_tdo;
+	int tdo_size;
+	int in_bytes;		/* TDO bytes in all */
+	int echo_bytes;		/* TDO sent anyway by an endpoint ignoring the direction */
+	bool idempotent;	/* may run again, see jtag_mctp_op() */
+	int tries;		/* timeouts so far */
+	uint64_t sent_usec;
+	uint64_t tcks;		/* the endpoint clocks for it */
+	uint8_t *msg;		/* copy of an idempotent or held request, to send (again) */
+	size_t msg_size;
+	int msg_len;
+};
+
 struct jtag_mctp_priv {
 	int frequency;
 	int loglevel;
 	int eid;
 	int net;
+	int window;		/* requests in flight at most */
+	bool no_bitbang;	/* endpoint rejected CMD_JTAG_BITBANG */
+	bool bitbang_ok;	/* endpoint answered CMD_JTAG_BITBANG */
+	bool prealloc;		/* tags are reserved for this socket */
+	bool stale;		/* responses of failed requests may still come */
+	bool no_batch;		/* endpoint rejected CMD_JTAG_BATCH */
+	bool batch_ok;		/* endpoint answered CMD_JTAG_BATCH */
+	int mtu;		/* batches are kept to this many bytes */
+	int max_msg;		/* longer transfers are split */
+	int max_ok;		/* longest message the endpoint has taken */
+	uint8_t *zeros;		/* TDI of scans that have none */
+	size_t zeros_size;
+	uint8_t *rx_buf;	/* the rest of a response, kept between messages */
+	size_t rx_buf_size;
+	uint8_t *batch;		/* CMD_JTAG_BATCH being filled */
+	size_t batch_size;
+	int batch_len;
+	int batch_ops;
+	bool batch_idempotent;	/* all its operations may run again */
+	struct jtag_mctp_tdo *batch_tdo;	/* TDO of its operations */
+	int batch_num_tdo;
+	int batch_tdo_size;
+	struct jtag_mctp_tag tags[JTAG_MCTP_WINDOW_MAX];
+	int num_tags;		/* the window and spares */
+	struct jtag_mctp_req reqs[JTAG_MCTP_WINDOW_MAX];
+	int head;		/* oldest request in flight */
+	int count;		/* requests in flight */
+	struct jtag_mctp_req *held;	/* not sent yet, see jtag_mctp_hold() */
+	int first_held;
+	int num_held;
+	int held_size;
+	bool rtt_valid;		/* a round trip has been measured */
+	long srtt_usec;
+	long rttvar_usec;
+	int rto_ms;		/* response timeout */
+	struct jtag_link_stats stats;
 };
 
-static struct jtag_mctp_priv jtag_priv = {
+/* every open gets its own copy, so several endpoints can be driven at once */
+static const struct jtag_mctp_priv jtag_mctp_defaults = {
 	.frequency = 0,
 	.loglevel = LEV_INFO,
 	.eid = 0,
 	.net = 1,
+	.window = JTAG_MCTP_WINDOW,
+	.mtu = JTAG_MCTP_MTU,
+	.max_msg = JTAG_MCTP_MAX_MSG,
+	.rto_ms = JTAG_MCTP_TIMEOUT_MS,
 };
 
+/*
+ * Return a buffer of at least len bytes.  It is grown on demand and
+ * released on close, so that steady-state transfers do not allocate.
+ */
+static uint8_t *jtag_mctp_grow(uint8_t **buf, size_t *buf_size, size_t len)
+{
+	size_t size = *buf_size ? *buf_size : 64;
+	uint8_t *p;
+
+	if (len <= *buf_size)
+		return *buf;
+	while (size < len)
+		size <<= 1;
+	p = realloc(*buf, size);
+	if (!p)
+		return NULL;
+	*buf = p;
+	*buf_size = size;
+
+	return p;
+}
+
+static const uint8_t *jtag_mctp_zeros(struct jtag_mctp_priv *priv, size_t len)
+{
+	size_t size = priv->zeros_size;
+
+	if (!jtag_mctp_grow(&priv->zeros, &priv->zeros_size, len))
+		return NULL;
+	if (priv->zeros_size != size)
+		memset(priv->zeros, 0, priv->zeros_size);
+
+	return priv->zeros;
+}
+
+/* copy len bytes at offset off of the message held in the pieces of iov */
+static void jtag_mctp_iov_copy(const struct iovec *iov, int iovcnt, size_t off, void *dst,
+		size_t len)
+{
+	uint8_t *p = dst;
+	size_t n;
+	int i;
+
+	for (i = 0; i < iovcnt && len; i++) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+		n = iov[i].iov_len - off;
+		if (n > len)
+			n = len;
+		memcpy(p, (uint8_t *)iov[i].iov_base + off, n);
+		p += n;
+		len -= n;
+		off = 0;
+	}
+}
+
+/* make room for num TDO destinations in *tdo */
+static int jtag_mctp_grow_tdo(struct jtag_mctp_tdo **tdo, int *size, int num)
+{
+	size_t bytes = *size * sizeof(**tdo);
+
+	if (num <= *size)
+		return 0;
+	if (!jtag_mctp_grow((uint8_t **)tdo, &bytes, num * sizeof(**tdo)))
+		return -1;
+	*size = bytes / sizeof(**tdo);
+
+	return 0;
+}
+
+/* TDO bytes a bitbang answers on its own, whether wanted or not */
+static int jtag_mctp_bitbang_tdo(uint8_t cmd, const uint8_t *data)
+{
+	const struct jtag_bitbang2 *bitbang = (const struct jtag_bitbang2 *)data;
+
+	return cmd == CMD_JTAG_BITBANG ? (bitbang->length + 7) / 8 : 0;
+}
+
+/* length of the request data of cmd */
+static int jtag_mctp_data_len(uint8_t cmd, const uint8_t *data)
+{
+	const struct jtag_xfer2 *xfer = (const struct jtag_xfer2 *)data;
+	const struct jtag_bitbang2 *bitbang = (const struct jtag_bitbang2 *)data;
+
+	if (cmd == CMD_JTAG_TRANSFER)
+		return sizeof(*xfer) + (xfer->length + 7) / 8;
+	if (cmd == CMD_JTAG_BITBANG)
+		return sizeof(*bitbang) + 2 * ((bitbang->length + 7) / 8);
+	return sizeof(struct jtag_tap_state2);
+}
+
+/* bytes in the pieces of iov */
+static int jtag_mctp_iov_len(const struct iovec *iov, int iovcnt)
+{
+	int i, len = 0;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	return len;
+}
+
+/* TCKs the operation cmd with request data clocks */
+static uint64_t jtag_mctp_op_tcks(uint8_t cmd, const uint8_t *data)
+{
+	const struct jtag_xfer2 *xfer = (const struct jtag_xfer2 *)data;
+	const struct jtag_bitbang2 *bitbang = (const struct jtag_bitbang2 *)data;
+	const struct jtag_tap_state2 *set_state = (const struct jtag_tap_state2 *)data;
+
+	if (cmd == CMD_JTAG_SET_STATE)
+		return set_state->tck;
+	if (cmd == CMD_JTAG_TRANSFER)
+		return xfer->length;
+	return bitbang->length;
+}
+
+/* the same for the request in the pieces of iov, all its operations */
+static uint64_t jtag_mctp_tcks(const struct iovec *iov, int iovcnt)
+{
+	const uint8_t *msg = iov[0].iov_base;
+	const uint8_t *p, *end = msg + iov[0].iov_len;
+	const struct jtag_batch_op *op;
+	uint64_t tcks = 0;
+
+	if (msg[0] != CMD_JTAG_BATCH) {
+		if (iov[0].iov_len > sizeof(struct mctp_jtag_msg) || iovcnt < 2)
+			p = msg + sizeof(struct mctp_jtag_msg);
+		else
+			p = iov[1].iov_base;
+		return jtag_mctp_op_tcks(msg[0], p);
+	}
+	p = msg + sizeof(struct mctp_jtag_msg);
+	while (p < end) {
+		op = (const struct jtag_batch_op *)p;
+		p += sizeof(*op);
+		tcks += jtag_mctp_op_tcks(op->cmd, p);
+		p += jtag_mctp_data_len(op->cmd, p);
+	}
+
+	return tcks;
+}
+
 static int poll_file(int fd, int timeout)
 {
 	struct pollfd fds[1];
@@ -81,17 +365,19 @@ static int poll_file(int fd, int timeout)
 		return -1;
 	} else if (rc == 0) {
 		//printf("Poll timeout\n");
-		return -1;
+		return 0;
 	}
 
 	return 0;
 }
-static int mctp_send(int sd, int net, int eid, uint8_t *data, int len)
+/* send the pieces of iov as one message */
+static int mctp_send(int sd, int net, int eid, uint8_t tag, const struct iovec *iov, int iovcnt)
 {
 	struct sockaddr_mctp_ext addr;
 	socklen_t addrlen;
-	int rc, val;
-	size_t i;
+	struct msghdr msg;
+	ssize_t rc, len = 0;
+	int i;
 
 	if (eid == 0) {
 		printf("invalid eid\n");
@@ -103,119 +389,906 @@ static int mctp_send(int sd, int net, int eid, uint8_t *data, int len)
 	addr.smctp_base.smctp_network = net;
 	addr.smctp_base.smctp_addr.s_addr = eid;
 	addr.smctp_base.smctp_type = MCTP_MESSAGE_TYPE_OEM_JTAG;
-	addr.smctp_base.smctp_tag = MCTP_TAG_OWNER;
+	addr.smctp_base.smctp_tag = tag;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &addr;
+	msg.msg_namelen = addrlen;
+	msg.msg_iov = (struct iovec *)iov;
+	msg.msg_iovlen = iovcnt;
 
-	rc = sendto(sd, data, len, 0, (struct sockaddr *)&addr, addrlen);
+	rc = sendmsg(sd, &msg, 0);
 	if (rc != len) {
-		perror("sendto");
+		rc = rc < 0 ? -errno : -EIO;
+		if (rc != -EMSGSIZE)
+			perror("sendmsg");
+		return rc;
+	}
+
+	return 0;
+}
+
+/*
+ * Receive one message into the pieces of iov, returning its full length
+ * and the eid and tag it came with.  A length over what iov holds means
+ * the message was truncated.  -ETIMEDOUT if none comes within timeout ms
+ * (0: none waiting).
+ */
+static int mctp_recv(int sd, struct iovec *iov, int iovcnt, int timeout, int *eid,
+		uint8_t *tag)
+{
+	struct sockaddr_mctp_ext addr;
+	struct msghdr msg;
+	int rc;
+
+	if (timeout) {
+		rc = poll_file(sd, timeout);
+		if (rc < 0) {
+			perror("poll error");
+			return -1;
+		}
+		if (rc == 0)
+			return -ETIMEDOUT;
+	}
+
+	memset(&addr, 0x0, sizeof(addr));
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &addr;
+	msg.msg_namelen = sizeof(addr);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	rc = recvmsg(sd, &msg, MSG_TRUNC | (timeout ? 0 : MSG_DONTWAIT));
+	if (rc < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return -ETIMEDOUT;
+		perror("recv error");
 		return -1;
 	}
+	*eid = addr.smctp_base.smctp_addr.s_addr;
+	*tag = addr.smctp_base.smctp_tag;
 
+	return rc;
+}
+
+static uint64_t jtag_mctp_now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Reserve the tags of the request window.  Preallocated tags let several
+ * requests be in flight and their responses be told apart; without them
+ * (kernels before 6.1, or a network other than the default one the
+ * reservation applies to) the kernel picks the tag and one request is in
+ * flight at a time.
+ */
+static void jtag_mctp_alloc_tags(JTAG_Handler *handler)
+{
+	struct jtag_mctp_priv *priv = handler->priv;
+	struct mctp_ioc_tag_ctl ctl;
+	int i = 0;
+
+	if (priv->window > JTAG_MCTP_WINDOW_MAX)
+		priv->window = JTAG_MCTP_WINDOW_MAX;
+	if (priv->window > 1 && priv->eid && priv->net == MCTP_DEFAULT_NET) {
+		/* tags beyond the window keep it full while others wait for late answers */
+		for (i = 0; i < JTAG_MCTP_WINDOW_MAX; i++) {
+			memset(&ctl, 0, sizeof(ctl));
+			ctl.peer_addr = priv->eid;
+			if (ioctl(handler->handle, SIOCMCTPALLOCTAG, &ctl) < 0)
+				break;
+			priv->tags[i].tag = ctl.tag;
+		}
+	}
+	if (i == 0) {
+		if (priv->window > 1)
+			DBG_log(LEV_DEBUG, "jtag_mctp: no preallocated tags, one request at a time\n");
+		priv->tags[0].tag = MCTP_TAG_OWNER;
+		priv->num_tags = 1;
+		priv->window = 1;
+		return;
+	}
+	priv->num_tags = i;
+	if (priv->window > i)
+		priv->window = i;
+	DBG_log(LEV_DEBUG, "jtag_mctp: %d requests in flight\n", priv->window);
+	priv->prealloc = true;
+}
+
+static void jtag_mctp_drop_tags(JTAG_Handler *handler)
+{
+	struct jtag_mctp_priv *priv = handler->priv;
+	struct mctp_ioc_tag_ctl ctl;
+	int i;
+
+	for (i = 0; priv->prealloc && i < priv->num_tags; i++) {
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.peer_addr = priv->eid;
+		ctl.tag = priv->tags[i].tag;
+		ioctl(handler->handle, SIOCMCTPDROPTAG, &ctl);
+	}
+}
+
+/* how long to wait for the response to req after sending it */
+static uint64_t jtag_mctp_timeout_usec(const struct jtag_mctp_priv *priv,
+		const struct jtag_mctp_req *req)
+{
+	int freq = priv->frequency > 0 ? priv->frequency : JTAG_MCTP_MIN_FREQ;
+	uint64_t ms = (uint64_t)priv->rto_ms << req->tries;
+
+	if (ms > JTAG_MCTP_TIMEOUT_MS)
+		ms = JTAG_MCTP_TIMEOUT_MS;
+	return ms * 1000 + req->tcks * 1000000 / freq;
+}
+
+/* one more answer may come on tag, up to usec from now */
+static void jtag_mctp_expect_dup(struct jtag_mctp_tag *tag, uint64_t usec)
+{
+	uint64_t quiet = jtag_mctp_now_usec() + usec;
+
+	if (!tag->dups || quiet > tag->quiet_usec)
+		tag->quiet_usec = quiet;
+	tag->dups++;
+}
+
+/* the requests in flight will not be answered any more */
+static void jtag_mctp_fail_all(struct jtag_mctp_priv *priv)
+{
+	struct jtag_mctp_req *req;
+	int i;
+
+	for (i = 0; i < priv->count; i++) {
+		req = &priv->reqs[(priv->head + i) % priv->window];
+		if (!req->done) {
+			req->done = true;
+			req->rc = -1;
+			if (priv->prealloc)
+				jtag_mctp_expect_dup(req->tag, jtag_mctp_timeout_usec(priv, req));
+		}
+	}
+	if (!priv->prealloc)
+		priv->stale = true;
+}
+
+/*
+ * Drop the late responses of failed requests before the next request:
+ * without preallocated tags they cannot be told from its response.
+ */
+static void jtag_mctp_drop_stale(JTAG_Handler *handler)
+{
+	struct jtag_mctp_priv *priv = handler->priv;
+	struct iovec iov = { priv->rx_buf, priv->rx_buf_size };
+	uint8_t tag;
+	int eid;
+
+	while (mctp_recv(handler->handle, &iov, 1, 0, &eid, &tag) >= 0)
+		DBG_log(LEV_DEBUG, "jtag_mctp: dropped a late response, tag %d\n", tag);
+	priv->stale = false;
+}
+
+/*
+ * Fold the round trip of an answered request into the smoothed round trip
+ * time and its mean deviation, and set the timeout from them (RFC 6298).
+ * The TCKs it clocked do not count, and a request sent more than once
+ * tells nothing (Karn).  The time to clock TCKs is added to the timeout
+ * of each request.
+ */
+static void jtag_mctp_rtt_sample(struct jtag_mctp_priv *priv, const struct jtag_mctp_req *req)
+{
+	int freq = priv->frequency > 0 ? priv->frequency : JTAG_MCTP_MAX_FREQ;
+	long rtt = jtag_mctp_now_usec() - req->sent_usec - req->tcks * 1000000 / freq;
+	long rto;
+
+	if (req->tries)
+		return;
+	if (rtt < 0)
+		rtt = 0;
+	if (!priv->rtt_valid) {
+		priv->srtt_usec = rtt;
+		priv->rttvar_usec = rtt / 2;
+		priv->rtt_valid = true;
+	} else {
+		priv->rttvar_usec += (labs(priv->srtt_usec - rtt) - priv->rttvar_usec) / 4;
+		priv->srtt_usec += (rtt - priv->srtt_usec) / 8;
+	}
+	rto = (priv->srtt_usec + 4 * priv->rttvar_usec + 999) / 1000;
+	if (rto < JTAG_MCTP_RTO_MIN_MS)
+		rto = JTAG_MCTP_RTO_MIN_MS;
+	if (rto > JTAG_MCTP_TIMEOUT_MS)
+		rto = JTAG_MCTP_TIMEOUT_MS;
+	priv->rto_ms = rto;
+}
+
+/*
+ * Receive one response and hand it to its request.  The endpoint answers
+ * in order, so the TDO is received straight into the destinations of the
+ * oldest unanswered request; a response to another one is copied on from
+ * there (they are overwritten by their own response anyway), and rx_buf
+ * takes what does not fit.
+ */
+static int jtag_mctp_receive(JTAG_Handler *handler, int timeout)
+{
+	struct jtag_mctp_priv *priv = handler->priv;
+	struct jtag_mctp_req *req, *next = NULL;
+	struct iovec iov[JTAG_MCTP_IOV_MAX];
+	uint8_t status = 0;
+	uint32_t max;
+	size_t size = 0, off;
+	bool direct;
+	uint8_t tag;
+	int i, j, n = 0, eid, len, data_len;
+
+	for (i = 0; i < priv->count && !next; i++) {
+		req = &priv->reqs[(priv->head + i) % priv->window];
+		if (!req->done)
+			next = req;
+	}
+	direct = next && next->num_tdo <= JTAG_MCTP_IOV_MAX - 2;
+	iov[n].iov_base = &status;
+	iov[n++].iov_len = sizeof(status);
+	for (j = 0; direct && j < next->num_tdo; j++) {
+		iov[n].iov_base = next->tdo[j].in ? next->tdo[j].in : priv->rx_buf;
+		iov[n++].iov_len = next->tdo[j].bytes;
+	}
+	iov[n].iov_base = priv->rx_buf;
+	iov[n++].iov_len = priv->rx_buf_size;
+	for (i = 0; i < n; i++)
+		size += iov[i].iov_len;
+
+	len = mctp_recv(handler->handle, iov, n, timeout, &eid, &tag);
+	if (len < 0)
+		return len;
+	if (eid != priv->eid || (tag & MCTP_TAG_OWNER))
+		return 0;
+
+	for (i = 0; i < priv->count; i++) {
+		req = &priv->reqs[(priv->head + i) % priv->window];
+		if (req->done)
+			continue;
+		if (priv->prealloc && (req->tag->tag & MCTP_TAG_MASK) != (tag & MCTP_TAG_MASK))
+			continue;
+		req->done = true;
+		req->rc = 0;
+		req->status = status;
+		jtag_mctp_rtt_sample(priv, req);
+		data_len = len - sizeof(struct mctp_jtag_msg);
+		if (len < (int)sizeof(struct mctp_jtag_msg) || (size_t)len > size) {
+			DBG_log(LEV_DEBUG, "jtag_mctp: response of %d bytes cut to %zu\n", len, size);
+			req->rc = -1;
+		} else if (status == JTAG_STATUS_TOO_BIG && data_len == sizeof(max)) {
+			jtag_mctp_iov_copy(iov, n, sizeof(struct mctp_jtag_msg), &max, sizeof(max));
+			if (max >= JTAG_MCTP_MIN_MSG && max < (uint32_t)priv->max_msg)
+				priv->max_msg = max;
+		} else if (req->cmd == CMD_JTAG_BATCH && status && priv->batch_ok) {
+			req->rc = -1;
+		} else if (data_len == req->in_bytes ||
+				(req->echo_bytes && data_len == req->echo_bytes && !status)) {
+			off = sizeof(struct mctp_jtag_msg);
+			for (j = 0; (req != next || !direct) && j < req->num_tdo; j++) {
+				if (req->tdo[j].in)
+					jtag_mctp_iov_copy(iov, n, off, req->tdo[j].in, req->tdo[j].bytes);
+				off += req->tdo[j].bytes;
+			}
+		} else if (data_len || !status) {
+			/* TDO of the wrong length, or short without an error status */
+			req->rc = -1;
+		}
+		return 0;
+	}
+	for (i = 0; priv->prealloc && i < priv->num_tags; i++) {
+		if ((priv->tags[i].tag & MCTP_TAG_MASK) == (tag & MCTP_TAG_MASK) &&
+				priv->tags[i].dups) {
+			priv->tags[i].dups--;
+			DBG_log(LEV_DEBUG, "jtag_mctp: dropped a late response, tag %d\n", tag);
+			return 0;
+		}
+	}
+	DBG_log(LEV_DEBUG, "jtag_mctp: response with unknown tag %d\n", tag);
 
 	return 0;
 }
 
-static int mctp_recv(int sd, int net, int eid, uint8_t *data, int len)
+/*
+ * The oldest request in flight, req, got no response in time.  If all the
+ * requests in flight are idempotent, they are sent again in order, each
+ * waited for twice as long as before: a lost request or response costs a
+ * timeout of a few round trips, not JTAG_MCTP_TIMEOUT_MS.  Those already
+ * answered ran after a request that may never have run, so their answers
+ * are dropped and they run again too.  Otherwise requests may have run on
+ * the target and are not sent again; their response is waited for longer,
+ * still taken if it comes late.  So is any response before the endpoint
+ * has answered once, or without preallocated tags, which would not tell
+ * the answers to the first send from those of a later request.  -1 after
+ * JTAG_MCTP_RETRIES.
+ */
+static int jtag_mctp_timeout(JTAG_Handler *handler, struct jtag_mctp_req *req)
 {
-	struct sockaddr_mctp_ext addr;
-	socklen_t addrlen;
+	struct jtag_mctp_priv *priv = handler->priv;
+	struct jtag_mctp_req *r;
+	struct iovec iov;
+	int i;
+
+	priv->stats.timeouts++;
+	if (req->tries >= JTAG_MCTP_RETRIES) {
+		priv->stats.failures++;
+		DBG_log(LEV_ERROR, "jtag_mctp: eid %d: no response in %d tries\n", priv->eid,
+			req->tries + 1);
+		return -1;
+	}
+	for (i = 0; i < priv->count; i++) {
+		r = &priv->reqs[(priv->head + i) % priv->window];
+		if (!r->idempotent)
+			break;
+	}
+	if (i < priv->count || !priv->rtt_valid || !priv->prealloc) {
+		req->tries++;
+		return 0;
+	}
+
+	for (i = 0; i < priv->count; i++) {
+		r = &priv->reqs[(priv->head + i) % priv->window];
+		iov.iov_base = r->msg;
+		iov.iov_len = r->msg_len;
+		if (mctp_send(handler->handle, priv->net, priv->eid, r->tag->tag, &iov, 1) < 0)
+			return -1;
+		priv->stats.retries++;
+		r->sent_usec = jtag_mctp_now_usec();
+		if (r->done) {
+			r->done = false;
+			r->rc = 0;
+			r->status = 0;
+			continue;
+		}
+		/* the first answer is taken, one more may come until the new timeout */
+		r->tries++;
+		jtag_mctp_expect_dup(r->tag, jtag_mctp_timeout_usec(priv, r));
+	}
+	DBG_log(LEV_DEBUG, "jtag_mctp: eid %d: sent %d request(s) again\n", priv->eid, i);
+
+	return 0;
+}
+
+/* wait for the oldest request in flight and take it out of the window */
+static int jtag_mctp_retire(JTAG_Handler *handler, uint8_t *status)
+{
+	struct jtag_mctp_priv *priv = handler->priv;
+	struct jtag_mctp_req *req = &priv->reqs[priv->head];
+
+	int64_t left;
 	int rc;
 
-	if (eid == 0) {
-		printf("invalid eid\n");
+	while (!req->done) {
+		left = req->sent_usec + jtag_mctp_timeout_usec(priv, req) - jtag_mctp_now_usec();
+		rc = jtag_mctp_receive(handler, left > 0 ? (left + 999) / 1000 : 0);
+		if (rc == -ETIMEDOUT)
+			rc = jtag_mctp_timeout(handler, req);
+		if (rc < 0)
+			jtag_mctp_fail_all(priv);
+	}
+	priv->head = (priv->head + 1) % priv->window;
+	priv->count--;
+	req->tag->busy = false;
+	if (status)
+		*status = req->status;
+	if (req->rc < 0) {
+		DBG_log(LEV_ERROR, "jtag_mctp: eid %d: command %d got no valid response\n",
+			priv->eid, req->cmd);
+		/* it fails what is held behind it, as it would the request waiting for room */
+		priv->first_held = priv->num_held = 0;
+	}
+
+	return req->rc;
+}
+
+/* a tag for the next request if one is free now, else in *first the one quiet first */
+static struct jtag_mctp_tag *jtag_mctp_free_tag(struct jtag_mctp_priv *priv,
+		struct jtag_mctp_tag **first)
+{
+	uint64_t now = jtag_mctp_now_usec();
+	struct jtag_mctp_tag *tag;
+	int i;
+
+	*first = NULL;
+	for (i = 0; i < priv->num_tags; i++) {
+		tag = &priv->tags[i];
+		if (tag->busy)
+			continue;
+		if (tag->dups && now >= tag->quiet_usec)
+			tag->dups = 0;
+		if (!tag->dups)
+			return tag;
+		if (!*first || tag->quiet_usec < (*first)->quiet_usec)
+			*first = tag;
+	}
+
+	return NULL;
+}
+
+/* a tag for the next request, waiting out the late answers due on the others if need be */
+static struct jtag_mctp_tag *jtag_mctp_get_tag(JTAG_Handler *handler)
+{
+	struct jtag_mctp_priv *priv = handler->priv;
+	struct jtag_mctp_tag *tag, *first;
+	int64_t left;
+	int rc;
+
+	while (1) {
+		tag = jtag_mctp_free_tag(priv, &first);
+		if (tag || !first)
+			return tag;
+		left = first->quiet_usec - jtag_mctp_now_usec();
+		rc = jtag_mctp_receive(handler, left > 0 ? (left + 999) / 1000 : 0);
+		if (rc < 0 && rc != -ETIMEDOUT)
+			return NULL;
+	}
+}
+
+/*
+ * Set req up for the request in the pieces of iov ([cmd][data]), its TDO
+ * going to the num_tdo destinations of tdo.  It keeps a copy of the request
+ * to send again if idempotent, or to send at all if held.
+ */
+static int jtag_mctp_req_init(struct jtag_mctp_priv *priv, struct jtag_mctp_req *req,
+		const struct iovec *iov, int iovcnt, const struct jtag_mctp_tdo *tdo, int num_tdo,
+		bool idempotent, bool held)
+{
+	int i;
+
+	if (jtag_mctp_grow_tdo(&req->tdo, &req->tdo_size, num_tdo))
+		return -1;
+	req->cmd = *(uint8_t *)iov[0].iov_base;
+	req->tcks = jtag_mctp_tcks(iov, iovcnt);
+	req->in_bytes = 0;
+	for (i = 0; i < num_tdo; i++)
+		req->in_bytes += tdo[i].bytes;
+	/* an endpoint ignoring the direction echoes a write-only transfer, into rx_buf */
+	req->echo_bytes = 0;
+	if (req->cmd == CMD_JTAG_TRANSFER && !req->in_bytes)
+		req->echo_bytes = (req->tcks + 7) / 8;
+	if (!jtag_mctp_grow(&priv->rx_buf, &priv->rx_buf_size,
+				sizeof(struct mctp_jtag_msg) + req->in_bytes + req->echo_bytes))
 		return -1;
+	memcpy(req->tdo, tdo, num_tdo * sizeof(*tdo));
+	req->num_tdo = num_tdo;
+	req->idempotent = idempotent;
+	req->msg_len = 0;
+	if (idempotent || held) {
+		req->msg_len = jtag_mctp_iov_len(iov, iovcnt);
+		if (!jtag_mctp_grow(&req->msg, &req->msg_size, req->msg_len))
+			return -1;
+		jtag_mctp_iov_copy(iov, iovcnt, 0, req->msg, req->msg_len);
+	}
+
+	return 0;
+}
+
+/* send req, set up in the next slot of the window, with tag */
+static int jtag_mctp_send_req(JTAG_Handler *handler, struct jtag_mctp_req *req,
+		struct jtag_mctp_tag *tag, const struct iovec *iov, int iovcnt)
+{
+	struct jtag_mctp_priv *priv = handler->priv;
+	int rc;
+
+	req->sent_usec = jtag_mctp_now_usec();
+	rc = mctp_send(handler->handle, priv->net, priv->eid, tag->tag, iov, iovcnt);
+	if (rc < 0)
+		return rc;
+	priv->stats.requests++;
+	tag->busy = true;
+	req->tag = tag;
+	req->tries = 0;
+	req->done = false;
+	req->rc = 0;
+	req->status = 0;
+	priv->count++;
+
+	return 0;
+}
+
+/*
+ * Keep a request for jtag_mctp_send_held(): with handler->nonblock set, one
+ * the window or the tags have no room for is held back rather than waited
+ * for, and so is every request after it.
+ */
+static int jtag_mctp_hold(JTAG_Handler *handler, const struct iovec *iov, int iovcnt,
+		const struct jtag_mctp_tdo *tdo, int num_tdo, bool idempotent)
+{
+	struct jtag_mctp_priv *priv = handler->priv;
+	struct jtag_mctp_req *held;
+	int size;
+
+	if (priv->num_held == priv->held_size) {
+		size = priv->held_size ? 2 * priv->held_size : priv->window;
+		held = realloc(priv->held, size * sizeof(*held));
+		if (!held)
+			return -1;
+		memset(held + priv->held_size, 0, (size - priv->held_size) * sizeof(*held));
+		priv->held = held;
+		priv->held_size = size;
 	}
-	if (poll_file(sd, 3000) < 0) {
-		perror("poll error");
+	if (jtag_mctp_req_init(priv, &priv->held[priv->num_held], iov, iovcnt, tdo, num_tdo,
+				idempotent, true))
 		return -1;
+	priv->num_held++;
+
+	return 0;
+}
+
+/*
+ * Send the held requests in order while the window has room and a tag is
+ * free, with wait waiting out the late answers due on the tags.  If one
+ * cannot be sent, those after it are dropped too.
+ */
+static int jtag_mctp_send_held(JTAG_Handler *handler, bool wait)
+{
+	struct jtag_mctp_priv *priv = handler->priv;
+	struct jtag_mctp_req *req, *held, swap;
+	struct jtag_mctp_tag *tag, *first;
+	struct iovec iov;
+
+	while (priv->first_held < priv->num_held && priv->count < priv->window) {
+		if (priv->stale)
+			jtag_mctp_drop_stale(handler);
+		tag = wait ? jtag_mctp_get_tag(handler) : jtag_mctp_free_tag(priv, &first);
+		if (!tag && !wait)
+			return 0;
+		/* the slot takes the held request's buffers, and the held one the slot's */
+		req = &priv->reqs[(priv->head + priv->count) % priv->window];
+		held = &priv->held[priv->first_held++];
+		swap = *req;
+		*req = *held;
+		*held = swap;
+		iov.iov_base = req->msg;
+		iov.iov_len = req->msg_len;
+		if (!tag || jtag_mctp_send_req(handler, req, tag, &iov, 1) < 0) {
+			priv->first_held = priv->num_held = 0;
+			return -1;
+		}
 	}
+	if (priv->first_held == priv->num_held)
+		priv->first_held = priv->num_held = 0;
 
-	addrlen = sizeof(addr);
-	rc = recvfrom(sd, data, len, MSG_TRUNC,
-			(struct sockaddr *)&addr, &addrlen);
-	if (rc < 0) {
-		perror("recv error");
+	return 0;
+}
+
+/*
+ * Wait until no request is in flight or held back.  Returns -1 if any of
+ * them failed, and in status the status byte of the last one.
+ */
+static int jtag_mctp_drain(JTAG_Handler *handler, uint8_t *status)
+{
+	struct jtag_mctp_priv *priv = handler->priv;
+	int rc = 0;
+
+	while (priv->count || priv->num_held) {
+		if (priv->num_held && priv->count < priv->window) {
+			if (jtag_mctp_send_held(handler, true) < 0)
+				rc = -1;
+			continue;
+		}
+		if (jtag_mctp_retire(handler, status) < 0)
+			rc = -1;
+	}
+
+	return rc;
+}
+
+/*
+ * Send the request in the pieces of iov ([cmd][data]) without waiting for
+ * its response; its TDO will go to the num_tdo destinations of tdo.  With
+ * the window full, the oldest request is waited for first, and its failure
+ * fails this one; with handler->nonblock set the request is held back
+ * instead.  An idempotent request keeps a copy to send again.
+ */
+static int jtag_mctp_queue(JTAG_Handler *handler, const struct iovec *iov, int iovcnt,
+		const struct jtag_mctp_tdo *tdo, int num_tdo, bool idempotent)
+{
+	struct jtag_mctp_priv *priv = handler->priv;
+	struct jtag_mctp_tag *tag, *first;
+	struct jtag_mctp_req *req;
+	int rc;
+
+	if (priv->num_held || (handler->nonblock && (priv->count == priv->window ||
+				!jtag_mctp_free_tag(priv, &first))))
+		return jtag_mctp_hold(handler, iov, iovcnt, tdo, num_tdo, idempotent);
+	if (priv->count == priv->window) {
+		rc = jtag_mctp_retire(handler, NULL);
+		if (rc < 0)
+			return rc;
+	}
+	req = &priv->reqs[(priv->head + priv->count) % priv->window];
+	if (jtag_mctp_req_init(priv, req, iov, iovcnt, tdo, num_tdo, idempotent, false))
+		return -1;
+	if (priv->stale)
+		jtag_mctp_drop_stale(handler);
+	tag = jtag_mctp_get_tag(handler);
+	if (!tag)
+		return -1;
+
+	return jtag_mctp_send_req(handler, req, tag, iov, iovcnt);
+}
+
+/* send the operations of a batch the endpoint refused one by one */
+static int jtag_mctp_unbatch(JTAG_Handler *handler, int len)
+{
+	struct jtag_mctp_priv *priv = handler->priv;
+	struct jtag_batch_op *op;
+	uint8_t *p = priv->batch + sizeof(struct mctp_jtag_msg);
+	uint8_t *end = priv->batch + len;
+	struct jtag_mctp_tdo tdo;
+	struct iovec iov[2];
+	int i = 0, rc;
+
+	while (p < end) {
+		op = (struct jtag_batch_op *)p;
+		iov[0].iov_base = &op->cmd;
+		iov[0].iov_len = sizeof(op->cmd);
+		iov[1].iov_base = op + 1;
+		iov[1].iov_len = jtag_mctp_data_len(op->cmd, p + sizeof(*op));
+		if (op->flags & JTAG_BATCH_TDO)
+			tdo = priv->batch_tdo[i++];
+		else
+			tdo = (struct jtag_mctp_tdo){ NULL, jtag_mctp_bitbang_tdo(op->cmd, p + sizeof(*op)) };
+		rc = jtag_mctp_queue(handler, iov, 2, &tdo, tdo.bytes ? 1 : 0,
+				priv->batch_idempotent);
+		if (rc < 0)
+			return rc;
+		p += sizeof(*op) + iov[1].iov_len;
+	}
+
+	return 0;
+}
+
+/*
+ * Send the batch being filled; one operation goes as a plain message.
+ * The first batch waits to see if the endpoint knows the command.
+ */
+static int jtag_mctp_send_batch(JTAG_Handler *handler)
+{
+	struct jtag_mctp_priv *priv = handler->priv;
+	struct jtag_batch_op *op;
+	int len = priv->batch_len;
+	struct jtag_mctp_tdo tdo;
+	struct iovec iov[2];
+	uint8_t status = 0;
+	int rc;
+
+	if (!priv->batch_ops)
+		return 0;
+	if (priv->batch_ops == 1) {
+		/* [BATCH][cmd][flags][data] -> [cmd][data] */
+		op = (struct jtag_batch_op *)(priv->batch + sizeof(struct mctp_jtag_msg));
+		iov[0].iov_base = &op->cmd;
+		iov[0].iov_len = sizeof(op->cmd);
+		iov[1].iov_base = op + 1;
+		iov[1].iov_len = len - sizeof(struct mctp_jtag_msg) - sizeof(*op);
+		if (priv->batch_num_tdo)
+			tdo = priv->batch_tdo[0];
+		else
+			tdo = (struct jtag_mctp_tdo){ NULL, jtag_mctp_bitbang_tdo(op->cmd, iov[1].iov_base) };
+		rc = jtag_mctp_queue(handler, iov, 2, &tdo, tdo.bytes ? 1 : 0,
+				priv->batch_idempotent);
+		goto out;
+	}
+
+	iov[0].iov_base = priv->batch;
+	iov[0].iov_len = len;
+	rc = jtag_mctp_queue(handler, iov, 1, priv->batch_tdo, priv->batch_num_tdo,
+			priv->batch_idempotent);
+	if (rc < 0 || priv->batch_ok)
+		goto out;
+	rc = jtag_mctp_drain(handler, &status);
+	if (rc < 0)
+		goto out;
+	if (!status) {
+		priv->batch_ok = true;
+		goto out;
+	}
+	DBG_log(LEV_INFO, "jtag_mctp: no batch support, one operation per message");
+	priv->no_batch = true;
+	rc = jtag_mctp_unbatch(handler, len);
+out:
+	priv->batch_len = 0;
+	priv->batch_ops = 0;
+	priv->batch_num_tdo = 0;
+	return rc;
+}
+
+/*
+ * Add the request in the pieces of iov ([cmd][data], the command byte
+ * first in iov[0]) to the batch, its TDO of in_bytes going to in.  With
+ * in NULL, in_bytes is what the request answers on its own regardless.  A
+ * full batch is sent first; without batches, or too long for one, the
+ * request goes on its own, sent from where its pieces are.
+ *
+ * An idempotent request may run on the target again without harm, should
+ * its response be lost: moves (RUNTEST counts are minimums) and complete
+ * scans the caller flagged as pure reads (handler->pure_reads).  Other
+ * scans pass Update-IR/DR or continue one another, bitbangs may do
+ * anything.
+ */
+static int jtag_mctp_op(JTAG_Handler *handler, const struct iovec *iov, int iovcnt,
+		uint8_t *in, int in_bytes, bool idempotent)
+{
+	struct jtag_mctp_priv *priv = handler->priv;
+	struct jtag_mctp_tdo tdo = { in, in_bytes };
+	int len = jtag_mctp_iov_len(iov, iovcnt);
+	int need = len - sizeof(struct mctp_jtag_msg) + sizeof(struct jtag_batch_op);
+	struct jtag_batch_op *op;
+	uint8_t *p;
+	int i, rc;
+
+	if (priv->no_batch || sizeof(struct mctp_jtag_msg) + need > (size_t)priv->mtu) {
+		rc = jtag_mctp_send_batch(handler);
+		if (rc < 0)
+			return rc;
+		return jtag_mctp_queue(handler, iov, iovcnt, &tdo, in_bytes ? 1 : 0, idempotent);
+	}
+	if (priv->batch_len + need > priv->mtu) {
+		rc = jtag_mctp_send_batch(handler);
+		if (rc < 0)
+			return rc;
+	}
+	if (!jtag_mctp_grow(&priv->batch, &priv->batch_size, priv->mtu) ||
+			jtag_mctp_grow_tdo(&priv->batch_tdo, &priv->batch_tdo_size,
+				priv->batch_num_tdo + 1))
 		return -1;
+	if (!priv->batch_len) {
+		priv->batch[0] = CMD_JTAG_BATCH;
+		priv->batch_len = sizeof(struct mctp_jtag_msg);
+		priv->batch_idempotent = true;
+	}
+	op = (struct jtag_batch_op *)(priv->batch + priv->batch_len);
+	op->cmd = *(uint8_t *)iov[0].iov_base;
+	op->flags = in ? JTAG_BATCH_TDO : 0;
+	p = (uint8_t *)(op + 1);
+	memcpy(p, (uint8_t *)iov[0].iov_base + sizeof(struct mctp_jtag_msg),
+			iov[0].iov_len - sizeof(struct mctp_jtag_msg));
+	p += iov[0].iov_len - sizeof(struct mctp_jtag_msg);
+	for (i = 1; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
 	}
+	priv->batch_len += need;
+	priv->batch_ops++;
+	priv->batch_idempotent = priv->batch_idempotent && idempotent;
+	if (in)
+		priv->batch_tdo[priv->batch_num_tdo++] = tdo;
 
 	return 0;
 }
 
 static void jtag_mctp_process_args(JTAG_Handler *handler, struct jtag_args *args)
 {
+	struct jtag_mctp_priv *priv = handler->priv;
 	int i;
 
 	for (i = 0; i < args->num_args; i++) {
 		if (i >= JTAG_MAX_ARGS)
 			return;
 		if (args->arg[i].id == ARG_FREQ)
-			jtag_priv.frequency = args->arg[i].val;
+			priv->frequency = args->arg[i].val;
 		else if (args->arg[i].id == ARG_LOG_LEVEL)
-			jtag_priv.loglevel = args->arg[i].val;
+			priv->loglevel = args->arg[i].val;
 		else if (args->arg[i].id == ARG_EID)
-			jtag_priv.eid = args->arg[i].val;
+			priv->eid = args->arg[i].val;
 		else if (args->arg[i].id == ARG_NET)
-			jtag_priv.net = args->arg[i].val;
+			priv->net = args->arg[i].val;
+		else if (args->arg[i].id == ARG_MCTP_WINDOW && args->arg[i].val > 0)
+			priv->window = args->arg[i].val;
+		else if (args->arg[i].id == ARG_MCTP_MAX_MSG &&
+				args->arg[i].val >= JTAG_MCTP_MIN_MSG)
+			priv->max_msg = args->arg[i].val;
 	}
 }
 
 static int jtag_mctp_open(JTAG_Handler *handler, char *jtag_dev, struct jtag_args *args)
 {
+	struct jtag_mctp_priv *priv;
 	int sd;
 
+	priv = malloc(sizeof(*priv));
+	if (!priv)
+		return -1;
+	*priv = jtag_mctp_defaults;
+	handler->priv = priv;
+
 	sd = socket(AF_MCTP, SOCK_DGRAM, 0);
 	if (sd < 0) {
 		perror("Can't open AF_MCTP socket");
+		free(priv);
+		handler->priv = NULL;
 		return -1;
 	}
 
 	jtag_mctp_process_args(handler, args);
 	handler->handle = sd;
-	handler->loglevel = jtag_priv.loglevel;
+	handler->loglevel = priv->loglevel;
+	jtag_mctp_alloc_tags(handler);
+
+	return 0;
+}
+
+static int jtag_mctp_flush(JTAG_Handler *handler)
+{
+	int rc;
+
+	rc = jtag_mctp_send_batch(handler);
+	if (jtag_mctp_drain(handler, NULL) < 0)
+		rc = -1;
+
+	return rc;
+}
+
+static int jtag_mctp_get_link_stats(JTAG_Handler *handler, struct jtag_link_stats *stats)
+{
+	struct jtag_mctp_priv *priv = handler->priv;
+
+	*stats = priv->stats;
+	stats->srtt_usec = priv->srtt_usec;
+	stats->rttvar_usec = priv->rttvar_usec;
+	stats->rto_msec = priv->rto_ms;
 
 	return 0;
 }
 
 static void jtag_mctp_close(JTAG_Handler *handler)
 {
+	struct jtag_mctp_priv *priv = handler->priv;
+	int i;
+
+	jtag_mctp_flush(handler);
+	jtag_mctp_drop_tags(handler);
 	close(handler->handle);
+	for (i = 0; i < JTAG_MCTP_WINDOW_MAX; i++) {
+		free(priv->reqs[i].tdo);
+		free(priv->reqs[i].msg);
+	}
+	for (i = 0; i < priv->held_size; i++) {
+		free(priv->held[i].tdo);
+		free(priv->held[i].msg);
+	}
+	free(priv->held);
+	free(priv->batch);
+	free(priv->batch_tdo);
+	free(priv->zeros);
+	free(priv->rx_buf);
+	free(priv);
+	handler->priv = NULL;
 }
 
+/*
+ * Moves are batched.  Clocking TCKs sends the batch and waits for the
+ * response: the minimum time of a RUNTEST counts from when they ran.  With
+ * handler->nonblock set the caller times the wait, the batch is only sent.
+ */
 int jtag_mctp_run_tck(JTAG_Handler *handler, int tap_state, int tcks)
 {
-	struct mctp_jtag_msg *req;
-	struct jtag_tap_state2 *set_state;
-	uint8_t *buf;
-	int msg_len = sizeof(struct mctp_jtag_msg) + sizeof(struct jtag_tap_state2);
-	int net = jtag_priv.net;
-	int eid = jtag_priv.eid;
+	uint8_t buf[sizeof(struct mctp_jtag_msg) + sizeof(struct jtag_tap_state2)];
+	struct mctp_jtag_msg *req = (struct mctp_jtag_msg *)buf;
+	struct jtag_tap_state2 *set_state = (struct jtag_tap_state2 *)&req->data[0];
+	struct iovec iov = { buf, sizeof(buf) };
 	int rc;
 
-	buf = malloc(msg_len);
-	if (!buf)
-		return -1;
-	req = (struct mctp_jtag_msg *)buf;
-	set_state = (struct jtag_tap_state2 *)&req->data[0];
-
 	req->cmd = CMD_JTAG_SET_STATE;
 	set_state->reset = 0;
 	set_state->from = JTAG_STATE_CURRENT;
 	set_state->endstate = tap_state;
 	set_state->tck = tcks;
-	/* send request */
-	rc = mctp_send(handler->handle, net, eid, buf, msg_len);
-	if (rc < 0)
-		goto err_ret;
-	/* recv response */
-	rc = mctp_recv(handler->handle, net, eid, buf, sizeof(struct mctp_jtag_msg));
+	rc = jtag_mctp_op(handler, &iov, 1, NULL, 0, true);
 	if (rc < 0)
-		goto err_ret;
+		return rc;
+	if (tcks > 0)
+		rc = handler->nonblock ? jtag_mctp_send_batch(handler) : jtag_mctp_flush(handler);
 
-	handler->tap_state = tap_state;
-err_ret:
-	free(buf);
+	if (tap_state != JTAG_STATE_CURRENT)
+		handler->tap_state = tap_state;
 	return rc;
-
 }
 
 static int jtag_mctp_set_tap_state(JTAG_Handler *handler, int tap_state)
@@ -223,44 +1296,252 @@ static int jtag_mctp_set_tap_state(JTAG_Handler *handler, int tap_state)
 	return jtag_mctp_run_tck(handler, tap_state, 0);
 }
 
-static int jtag_mctp_shift(JTAG_Handler *handler, int type, int bits,
-		const uint8_t *out, uint8_t *in, int state)
+/* after a message of len bytes was refused, -EMSGSIZE if a shorter one may do */
+static int jtag_mctp_shrink(struct jtag_mctp_priv *priv, int len)
 {
-	struct mctp_jtag_msg *req;
-	struct jtag_xfer2 *xfer;
-	int data_bytes = (bits + 7) / 8;
-	int msg_len = sizeof(struct mctp_jtag_msg) + sizeof(struct jtag_xfer2) + data_bytes;
-	uint8_t *buf;
-	int net = jtag_priv.net;
-	int eid = jtag_priv.eid;
+	if (len <= JTAG_MCTP_MIN_MSG) {
+		DBG_log(LEV_ERROR, "jtag_mctp: eid %d refused a %d byte message\n", priv->eid, len);
+		return -1;
+	}
+	if (priv->max_msg >= len)
+		priv->max_msg = len / 2 > JTAG_MCTP_MIN_MSG ? len / 2 : JTAG_MCTP_MIN_MSG;
+	DBG_log(LEV_DEBUG, "jtag_mctp: messages of %d bytes at most\n", priv->max_msg);
+
+	return -EMSGSIZE;
+}
+
+/*
+ * A message longer than any the endpoint has taken waits for its answer:
+ * refused with JTAG_STATUS_TOO_BIG or by the kernel, it shrinks max_msg
+ * and returns -EMSGSIZE for the caller to split it, nothing clocked.
+ */
+static int jtag_mctp_probe(JTAG_Handler *handler, const struct iovec *iov, int iovcnt,
+		uint8_t *in, int in_bytes, bool idempotent)
+{
+	struct jtag_mctp_priv *priv = handler->priv;
+	struct jtag_mctp_tdo tdo = { in, in_bytes };
+	int len = jtag_mctp_iov_len(iov, iovcnt);
+	uint8_t status = 0;
 	int rc;
 
-	buf = malloc(msg_len);
-	if (!buf)
+	rc = jtag_mctp_send_batch(handler);
+	if (rc < 0)
+		return rc;
+	/* sent at once, so that a refusal by the kernel comes back here */
+	if (priv->num_held && jtag_mctp_drain(handler, NULL) < 0)
 		return -1;
-	req = (struct mctp_jtag_msg *)buf;
-	xfer = (struct jtag_xfer2 *)&req->data[0];
+	rc = jtag_mctp_queue(handler, iov, iovcnt, &tdo, in_bytes ? 1 : 0, idempotent);
+	if (rc == -EMSGSIZE)
+		return jtag_mctp_shrink(priv, len);
+	if (rc < 0)
+		return rc;
+	rc = jtag_mctp_drain(handler, &status);
+	if (rc < 0)
+		return rc;
+	if (status == JTAG_STATUS_TOO_BIG)
+		return jtag_mctp_shrink(priv, len);
+	priv->max_ok = len;
+
+	return 0;
+}
+
+/* add one transfer message to the batch, its TDO going to in once it is answered */
+static int jtag_mctp_transfer_msg(JTAG_Handler *handler, int type, int bits,
+		const uint8_t *out, uint8_t *in, int state, bool idempotent)
+{
+	uint8_t buf[sizeof(struct mctp_jtag_msg) + sizeof(struct jtag_xfer2)];
+	struct mctp_jtag_msg *req = (struct mctp_jtag_msg *)buf;
+	struct jtag_xfer2 *xfer = (struct jtag_xfer2 *)&req->data[0];
+	int data_bytes = (bits + 7) / 8;
+	int msg_len = sizeof(buf) + data_bytes;
+	int direction = jtag_xfer_direction(out, in);
+	struct jtag_mctp_priv *priv = handler->priv;
+	struct iovec iov[2];
+	int rc;
+
 	req->cmd = CMD_JTAG_TRANSFER;
 	xfer->type = type;
-	xfer->direction = 0;
+	xfer->direction = direction;
 	xfer->from = JTAG_STATE_CURRENT;
 	xfer->endstate = state;
 	xfer->padding = 0;
 	xfer->length = bits;
-	memcpy(xfer->tdio, out, data_bytes);
-	/* send request */
-	rc = mctp_send(handler->handle, net, eid, buf, msg_len);
+	iov[0].iov_base = buf;
+	iov[0].iov_len = sizeof(buf);
+	iov[1].iov_base = (void *)(out ? out : jtag_mctp_zeros(priv, data_bytes));
+	iov[1].iov_len = data_bytes;
+	if (!iov[1].iov_base)
+		return -1;
+	if (msg_len > priv->max_ok && msg_len > priv->mtu)
+		rc = jtag_mctp_probe(handler, iov, 2, in, in ? data_bytes : 0, idempotent);
+	else
+		rc = jtag_mctp_op(handler, iov, 2, in, in ? data_bytes : 0, idempotent);
 	if (rc < 0)
 		return rc;
-	/* recv response */
-	rc = mctp_recv(handler->handle, net, eid, buf, sizeof(struct mctp_jtag_msg) + data_bytes);
+
+	handler->tap_state = state;
+	return rc;
+}
+
+/*
+ * Add a transfer to the batch.  A scan longer than max_msg goes in whole
+ * bytes per message, staying in the shift state between them; the
+ * messages are pipelined and each one's TDO lands in place in in.
+ */
+static int jtag_mctp_transfer(JTAG_Handler *handler, int type, int bits,
+		const uint8_t *out, uint8_t *in, int state)
+{
+	struct jtag_mctp_priv *priv = handler->priv;
+	int shift_state = type == JTAG_SIR_XFER ? JtagShfIR : JtagShfDR;
+	int first, n, max_bits, rc;
+
+	for (first = 0; first < bits; first += n) {
+		max_bits = 8 * (priv->max_msg - sizeof(struct mctp_jtag_msg) -
+				sizeof(struct jtag_xfer2));
+		n = bits - first > max_bits ? max_bits : bits - first;
+		/* the parts of a split scan follow on from one another */
+		rc = jtag_mctp_transfer_msg(handler, type, n, out ? out + first / 8 : NULL,
+				in ? in + first / 8 : NULL, first + n < bits ? shift_state : state,
+				handler->pure_reads && n == bits);
+		if (rc == -EMSGSIZE) {
+			/* max_msg shrank, send this part again */
+			n = 0;
+			continue;
+		}
+		if (rc < 0)
+			return rc;
+	}
+
+	return 0;
+}
+
+/* send the batch up to this transfer, jtag_mctp_shift_complete() takes its response */
+static int jtag_mctp_shift_submit(JTAG_Handler *handler, int type, int bits,
+		const uint8_t *out, uint8_t *in, int state)
+{
+	int rc;
+
+	rc = jtag_mctp_transfer(handler, type, bits, out, in, state);
 	if (rc < 0)
 		return rc;
+	return jtag_mctp_send_batch(handler);
+}
 
-	if (in)
-		memcpy(in, buf + sizeof(struct mctp_jtag_msg), data_bytes);
-err_ret:
-	free(buf);
+/*
+ * Send the held requests as the window makes room and take the responses
+ * that have arrived, without waiting.  -EAGAIN while requests are still
+ * held, or unless backlog, in flight, the batch being filled sent first;
+ * the oldest, past its timeout, is sent again or failed first.
+ */
+static int jtag_mctp_shift_complete(JTAG_Handler *handler, bool backlog)
+{
+	struct jtag_mctp_priv *priv = handler->priv;
+	struct jtag_mctp_req *req;
+	int rc;
+
+	if (!backlog && jtag_mctp_send_batch(handler) < 0)
+		return -1;
+	while (priv->count || priv->num_held) {
+		if (priv->num_held && priv->count < priv->window &&
+				jtag_mctp_send_held(handler, false) < 0)
+			return -1;
+		if (backlog && !priv->num_held)
+			break;
+		/* held for a tag with late answers still due */
+		if (!priv->count)
+			return -EAGAIN;
+		req = &priv->reqs[priv->head];
+		if (req->done) {
+			if (jtag_mctp_retire(handler, NULL) < 0)
+				return -1;
+			continue;
+		}
+		rc = jtag_mctp_receive(handler, 0);
+		if (rc == 0)
+			continue;
+		if (rc == -ETIMEDOUT) {
+			if (jtag_mctp_now_usec() < req->sent_usec + jtag_mctp_timeout_usec(priv, req))
+				return -EAGAIN;
+			rc = jtag_mctp_timeout(handler, req);
+			if (rc == 0)
+				return -EAGAIN;
+		}
+		jtag_mctp_fail_all(priv);
+	}
+
+	return 0;
+}
+
+/*
+ * A transfer joins the batch.  Its TDO is waited for unless the caller
+ * takes it at JTAG_flush() (handler->defer_tdo).
+ */
+static int jtag_mctp_shift(JTAG_Handler *handler, int type, int bits,
+		const uint8_t *out, uint8_t *in, int state)
+{
+	int rc;
+
+	rc = jtag_mctp_transfer(handler, type, bits, out, in, state);
+	if (rc < 0 || !in || handler->defer_tdo)
+		return rc;
+	return jtag_mctp_flush(handler);
+}
+
+static int jtag_mctp_shift_raw(JTAG_Handler *handler, const uint8_t *tms, const uint8_t *tdi,
+		uint8_t *tdo, int bits, int end_state)
+{
+	uint8_t buf[sizeof(struct mctp_jtag_msg) + sizeof(struct jtag_bitbang2)];
+	struct mctp_jtag_msg *req = (struct mctp_jtag_msg *)buf;
+	struct jtag_bitbang2 *bitbang = (struct jtag_bitbang2 *)&req->data[0];
+	int data_bytes = (bits + 7) / 8;
+	struct jtag_mctp_priv *priv = handler->priv;
+	struct jtag_mctp_tdo tdo_dest;
+	struct iovec iov[3];
+	uint8_t status = 0;
+	int rc;
+
+	if (priv->no_bitbang)
+		return -EOPNOTSUPP;
+	/* batched, a move and a transfer take no more round trips */
+	if (tdo && !priv->no_batch)
+		return -EOPNOTSUPP;
+	req->cmd = CMD_JTAG_BITBANG;
+	bitbang->length = bits;
+	iov[0].iov_base = buf;
+	iov[0].iov_len = sizeof(buf);
+	iov[1].iov_base = (void *)tms;
+	iov[1].iov_len = data_bytes;
+	iov[2].iov_base = (void *)(tdi ? tdi : jtag_mctp_zeros(priv, data_bytes));
+	iov[2].iov_len = data_bytes;
+	if (!iov[2].iov_base)
+		return -1;
+	/* once the endpoint has taken a bitbang, moves are batched */
+	if (!tdo && priv->bitbang_ok) {
+		rc = jtag_mctp_op(handler, iov, 3, NULL, data_bytes, false);
+		if (rc < 0)
+			return rc;
+		handler->tap_state = end_state;
+		return rc;
+	}
+	rc = jtag_mctp_send_batch(handler);
+	if (rc < 0)
+		return rc;
+	tdo_dest.in = tdo;
+	tdo_dest.bytes = data_bytes;
+	rc = jtag_mctp_queue(handler, iov, 3, &tdo_dest, 1, false);
+	if (rc < 0)
+		return rc;
+	rc = jtag_mctp_drain(handler, &status);
+	if (rc < 0)
+		return rc;
+	if (status) {
+		DBG_log(LEV_INFO, "jtag_mctp: no bitbang support, moving by state");
+		priv->no_bitbang = true;
+		return -EOPNOTSUPP;
+	}
+
+	priv->bitbang_ok = true;
+	handler->tap_state = end_state;
 	return rc;
 }
 
@@ -281,11 +1562,15 @@ static const struct jtag_ops jtag_mctp_ops = {
 	.run_tck = jtag_mctp_run_tck,
 	.shift_dr = jtag_mctp_shift_dr,
 	.shift_ir = jtag_mctp_shift_ir,
+	.shift_raw = jtag_mctp_shift_raw,
+	.shift_submit = jtag_mctp_shift_submit,
+	.shift_complete = jtag_mctp_shift_complete,
+	.flush = jtag_mctp_flush,
+	.get_link_stats = jtag_mctp_get_link_stats,
 };
 
 JTAG_Handler jtag_mctp_handler = {
 	.name = "jtag_mctp",
 	.type = JTAG_INTF_MCTP,
-	.priv = &jtag_priv,
 	.ops = &jtag_mctp_ops,
 };
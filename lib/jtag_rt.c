@@ -0,0 +1,109 @@
+/* Copyright (c) 2025, Nuvoton Corporation */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+
+#include "../include/jtag.h"
+
+/*
+ * Real-time mode for the thread playing SVF files.  Page faults and
+ * preemption stretch RUNTEST waits and the gaps between ioctls, so the
+ * thread is pinned to one CPU, runs SCHED_FIFO below the kernel's
+ * threaded IRQ handlers, keeps all its memory locked and sleeps with
+ * minimal timer slack.  JTAG_rt_exit() puts everything back.
+ */
+#define JTAG_RT_STACK_PREFAULT	(64 * 1024)
+
+static struct {
+	bool active;
+	bool locked;
+	bool pinned;
+	cpu_set_t cpus;
+	int policy;
+	struct sched_param param;
+	int timer_slack;
+} jtag_rt;
+
+/* touch the stack the player may use, so it is mapped and locked */
+static void __attribute__((noinline)) jtag_rt_prefault_stack(void)
+{
+	volatile uint8_t stack[JTAG_RT_STACK_PREFAULT];
+
+	memset((void *)stack, 0, sizeof(stack));
+}
+
+/*
+ * Enter real-time mode: pin to cpu (< 0: keep the affinity) and run at
+ * SCHED_FIFO priority, clamped to 1..JTAG_RT_MAX_PRIO.  Call it once the
+ * SVF session is created, so that its buffers are locked as well.  Steps
+ * that fail are reported and skipped; returns -1 if none took effect.
+ */
+int JTAG_rt_enter(int cpu, int priority)
+{
+	struct sched_param param;
+	cpu_set_t set;
+	int ret = -1;
+
+	if (jtag_rt.active)
+		return 0;
+	memset(&jtag_rt, 0, sizeof(jtag_rt));
+
+	if (cpu >= 0 && sched_getaffinity(0, sizeof(jtag_rt.cpus), &jtag_rt.cpus) == 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) == 0) {
+			jtag_rt.pinned = true;
+			ret = 0;
+		} else {
+			perror("rt: sched_setaffinity");
+		}
+	}
+
+	jtag_rt.policy = sched_getscheduler(0);
+	sched_getparam(0, &jtag_rt.param);
+	if (priority < 1)
+		priority = 1;
+	if (priority > JTAG_RT_MAX_PRIO)
+		priority = JTAG_RT_MAX_PRIO;
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = priority;
+	if (sched_setscheduler(0, SCHED_FIFO, &param) == 0)
+		ret = 0;
+	else
+		perror("rt: sched_setscheduler");
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) {
+		jtag_rt.locked = true;
+		jtag_rt_prefault_stack();
+		ret = 0;
+	} else {
+		perror("rt: mlockall");
+	}
+
+	jtag_rt.timer_slack = prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0);
+	prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0);
+
+	jtag_rt.active = true;
+	LOG_DEBUG("rt: cpu %d, SCHED_FIFO %d", cpu, priority);
+
+	return ret;
+}
+
+void JTAG_rt_exit(void)
+{
+	if (!jtag_rt.active)
+		return;
+	if (jtag_rt.timer_slack > 0)
+		prctl(PR_SET_TIMERSLACK, jtag_rt.timer_slack, 0, 0, 0);
+	if (jtag_rt.locked)
+		munlockall();
+	sched_setscheduler(0, jtag_rt.policy, &jtag_rt.param);
+	if (jtag_rt.pinned)
+		sched_setaffinity(0, sizeof(jtag_rt.cpus), &jtag_rt.cpus);
+	jtag_rt.active = false;
+}
@@ -28,12 +28,20 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdarg.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include "../include/jtag.h"
 
 #define ERROR_OK                        (0)
@@ -99,67 +107,88 @@ static const char *svf_trst_mode_name[4] = {
 	"ABSENT"
 };
 
-struct svf_statemove {
-	tap_state_t from;
-	tap_state_t to;
-	uint32_t num_of_moves;
-	tap_state_t paths[8];
-};
-
 /*
- * These paths are from the SVF specification for the STATE command, to be
- * used when the STATE command only includes the final state.  The first
- * element of the path is the "from" (current) state, and the last one is
- * the "to" (target) state.
- *
- * All specified paths are the shortest ones in the JTAG spec, and are thus
- * not (!!) exact matches for the paths used elsewhere in OpenOCD.  Note
- * that PAUSE-to-PAUSE transitions all go through UPDATE and then CAPTURE,
- * which has specific effects on the various registers; they are not NOPs.
- *
- * Paths to RESET are disabled here.  As elsewhere in OpenOCD, and in XSVF
- * and many SVF implementations, we don't want to risk missing that state.
- * To get to RESET, always we ignore the current state.
+ * TMS sequences (first bit in bit 0) between every pair of TAP states,
+ * indexed by JtagStates [from][to], used when the STATE command or a
+ * RUNTEST only names the final state.  These are the shortest paths of the
+ * JTAG state diagram that do not pass through Test-Logic-Reset.  Paths to
+ * RESET ignore the current state and are always five TMS ones, as in XSVF
+ * and many SVF implementations; moving to the current state is a no-op.
  */
-static const struct svf_statemove svf_statemoves[] = {
-	/* from			to				num_of_moves,	paths[8] */
-/*	{TAP_RESET,		TAP_RESET,		1,				{TAP_RESET}}, */
-	{TAP_RESET,		TAP_IDLE,		2,				{TAP_RESET, TAP_IDLE} },
-	{TAP_RESET,		TAP_DRPAUSE,	6,				{TAP_RESET, TAP_IDLE, TAP_DRSELECT,
-														TAP_DRCAPTURE, TAP_DREXIT1, TAP_DRPAUSE} },
-	{TAP_RESET,		TAP_IRPAUSE,	7,				{TAP_RESET, TAP_IDLE, TAP_DRSELECT,
-														TAP_IRSELECT, TAP_IRCAPTURE,
-														TAP_IREXIT1, TAP_IRPAUSE} },
-
-/*	{TAP_IDLE,		TAP_RESET,		4,				{TAP_IDLE,
- * TAP_DRSELECT, TAP_IRSELECT, TAP_RESET}}, */
-	{TAP_IDLE,		TAP_IDLE,		1,				{TAP_IDLE} },
-	{TAP_IDLE,		TAP_DRPAUSE,	5,				{TAP_IDLE, TAP_DRSELECT, TAP_DRCAPTURE,
-														TAP_DREXIT1, TAP_DRPAUSE} },
-	{TAP_IDLE,		TAP_IRPAUSE,	6,				{TAP_IDLE, TAP_DRSELECT, TAP_IRSELECT,
-														TAP_IRCAPTURE, TAP_IREXIT1, TAP_IRPAUSE} },
-
-/*	{TAP_DRPAUSE,	TAP_RESET,		6,				{TAP_DRPAUSE,
- * TAP_DREXIT2, TAP_DRUPDATE, TAP_DRSELECT, TAP_IRSELECT, TAP_RESET}}, */
-	{TAP_DRPAUSE,	TAP_IDLE,		4,				{TAP_DRPAUSE, TAP_DREXIT2, TAP_DRUPDATE,
-														TAP_IDLE} },
-	{TAP_DRPAUSE,	TAP_DRPAUSE,	7,				{TAP_DRPAUSE, TAP_DREXIT2, TAP_DRUPDATE,
-														TAP_DRSELECT, TAP_DRCAPTURE,
-														TAP_DREXIT1, TAP_DRPAUSE} },
-	{TAP_DRPAUSE,	TAP_IRPAUSE,	8,				{TAP_DRPAUSE, TAP_DREXIT2, TAP_DRUPDATE,
-														TAP_DRSELECT, TAP_IRSELECT,
-														TAP_IRCAPTURE, TAP_IREXIT1, TAP_IRPAUSE} },
-
-/*	{TAP_IRPAUSE,	TAP_RESET,		6,				{TAP_IRPAUSE,
- * TAP_IREXIT2, TAP_IRUPDATE, TAP_DRSELECT, TAP_IRSELECT, TAP_RESET}}, */
-	{TAP_IRPAUSE,	TAP_IDLE,		4,				{TAP_IRPAUSE, TAP_IREXIT2, TAP_IRUPDATE,
-														TAP_IDLE} },
-	{TAP_IRPAUSE,	TAP_DRPAUSE,	7,				{TAP_IRPAUSE, TAP_IREXIT2, TAP_IRUPDATE,
-														TAP_DRSELECT, TAP_DRCAPTURE,
-														TAP_DREXIT1, TAP_DRPAUSE} },
-	{TAP_IRPAUSE,	TAP_IRPAUSE,	8,				{TAP_IRPAUSE, TAP_IREXIT2, TAP_IRUPDATE,
-														TAP_DRSELECT, TAP_IRSELECT,
-														TAP_IRCAPTURE, TAP_IREXIT1, TAP_IRPAUSE} }
+struct svf_tms_path {
+	uint8_t tms;
+	uint8_t len;
+};
+
+static const struct svf_tms_path svf_tms_paths[16][16] = {
+	/* from TLR */ {
+		{0x1f, 5}, {0x00, 1}, {0x02, 2}, {0x02, 3}, {0x02, 4}, {0x0a, 4}, {0x0a, 5}, {0x2a, 6},
+		{0x1a, 5}, {0x06, 3}, {0x06, 4}, {0x06, 5}, {0x16, 5}, {0x16, 6}, {0x56, 7}, {0x36, 6} },
+	/* from RTI */ {
+		{0x1f, 5}, {0x00, 0}, {0x01, 1}, {0x01, 2}, {0x01, 3}, {0x05, 3}, {0x05, 4}, {0x15, 5},
+		{0x0d, 4}, {0x03, 2}, {0x03, 3}, {0x03, 4}, {0x0b, 4}, {0x0b, 5}, {0x2b, 6}, {0x1b, 5} },
+	/* from SelDR */ {
+		{0x1f, 5}, {0x06, 4}, {0x00, 0}, {0x00, 1}, {0x00, 2}, {0x02, 2}, {0x02, 3}, {0x0a, 4},
+		{0x06, 3}, {0x01, 1}, {0x01, 2}, {0x01, 3}, {0x05, 3}, {0x05, 4}, {0x15, 5}, {0x0d, 4} },
+	/* from CapDR */ {
+		{0x1f, 5}, {0x03, 3}, {0x07, 3}, {0x00, 0}, {0x00, 1}, {0x01, 1}, {0x01, 2}, {0x05, 3},
+		{0x03, 2}, {0x0f, 4}, {0x0f, 5}, {0x0f, 6}, {0x2f, 6}, {0x2f, 7}, {0xaf, 8}, {0x6f, 7} },
+	/* from ShfDR */ {
+		{0x1f, 5}, {0x03, 3}, {0x07, 3}, {0x07, 4}, {0x00, 0}, {0x01, 1}, {0x01, 2}, {0x05, 3},
+		{0x03, 2}, {0x0f, 4}, {0x0f, 5}, {0x0f, 6}, {0x2f, 6}, {0x2f, 7}, {0xaf, 8}, {0x6f, 7} },
+	/* from Ex1DR */ {
+		{0x1f, 5}, {0x01, 2}, {0x03, 2}, {0x03, 3}, {0x02, 3}, {0x00, 0}, {0x00, 1}, {0x02, 2},
+		{0x01, 1}, {0x07, 3}, {0x07, 4}, {0x07, 5}, {0x17, 5}, {0x17, 6}, {0x57, 7}, {0x37, 6} },
+	/* from PauDR */ {
+		{0x1f, 5}, {0x03, 3}, {0x07, 3}, {0x07, 4}, {0x01, 2}, {0x05, 3}, {0x00, 0}, {0x01, 1},
+		{0x03, 2}, {0x0f, 4}, {0x0f, 5}, {0x0f, 6}, {0x2f, 6}, {0x2f, 7}, {0xaf, 8}, {0x6f, 7} },
+	/* from Ex2DR */ {
+		{0x1f, 5}, {0x01, 2}, {0x03, 2}, {0x03, 3}, {0x00, 1}, {0x02, 2}, {0x02, 3}, {0x00, 0},
+		{0x01, 1}, {0x07, 3}, {0x07, 4}, {0x07, 5}, {0x17, 5}, {0x17, 6}, {0x57, 7}, {0x37, 6} },
+	/* from UpdDR */ {
+		{0x1f, 5}, {0x00, 1}, {0x01, 1}, {0x01, 2}, {0x01, 3}, {0x05, 3}, {0x05, 4}, {0x15, 5},
+		{0x00, 0}, {0x03, 2}, {0x03, 3}, {0x03, 4}, {0x0b, 4}, {0x0b, 5}, {0x2b, 6}, {0x1b, 5} },
+	/* from SelIR */ {
+		{0x1f, 5}, {0x06, 4}, {0x0e, 4}, {0x0e, 5}, {0x0e, 6}, {0x2e, 6}, {0x2e, 7}, {0xae, 8},
+		{0x6e, 7}, {0x00, 0}, {0x00, 1}, {0x00, 2}, {0x02, 2}, {0x02, 3}, {0x0a, 4}, {0x06, 3} },
+	/* from CapIR */ {
+		{0x1f, 5}, {0x03, 3}, {0x07, 3}, {0x07, 4}, {0x07, 5}, {0x17, 5}, {0x17, 6}, {0x57, 7},
+		{0x37, 6}, {0x0f, 4}, {0x00, 0}, {0x00, 1}, {0x01, 1}, {0x01, 2}, {0x05, 3}, {0x03, 2} },
+	/* from ShfIR */ {
+		{0x1f, 5}, {0x03, 3}, {0x07, 3}, {0x07, 4}, {0x07, 5}, {0x17, 5}, {0x17, 6}, {0x57, 7},
+		{0x37, 6}, {0x0f, 4}, {0x0f, 5}, {0x00, 0}, {0x01, 1}, {0x01, 2}, {0x05, 3}, {0x03, 2} },
+	/* from Ex1IR */ {
+		{0x1f, 5}, {0x01, 2}, {0x03, 2}, {0x03, 3}, {0x03, 4}, {0x0b, 4}, {0x0b, 5}, {0x2b, 6},
+		{0x1b, 5}, {0x07, 3}, {0x07, 4}, {0x02, 3}, {0x00, 0}, {0x00, 1}, {0x02, 2}, {0x01, 1} },
+	/* from PauIR */ {
+		{0x1f, 5}, {0x03, 3}, {0x07, 3}, {0x07, 4}, {0x07, 5}, {0x17, 5}, {0x17, 6}, {0x57, 7},
+		{0x37, 6}, {0x0f, 4}, {0x0f, 5}, {0x01, 2}, {0x05, 3}, {0x00, 0}, {0x01, 1}, {0x03, 2} },
+	/* from Ex2IR */ {
+		{0x1f, 5}, {0x01, 2}, {0x03, 2}, {0x03, 3}, {0x03, 4}, {0x0b, 4}, {0x0b, 5}, {0x2b, 6},
+		{0x1b, 5}, {0x07, 3}, {0x07, 4}, {0x00, 1}, {0x02, 2}, {0x02, 3}, {0x00, 0}, {0x01, 1} },
+	/* from UpdIR */ {
+		{0x1f, 5}, {0x00, 1}, {0x01, 1}, {0x01, 2}, {0x01, 3}, {0x05, 3}, {0x05, 4}, {0x15, 5},
+		{0x0d, 4}, {0x03, 2}, {0x03, 3}, {0x03, 4}, {0x0b, 4}, {0x0b, 5}, {0x2b, 6}, {0x00, 0} },
+};
+
+/* next state for TMS 0 and TMS 1, to follow explicit STATE paths */
+static const uint8_t svf_tap_next[16][2] = {
+	[JtagTLR]   = { JtagRTI,   JtagTLR },
+	[JtagRTI]   = { JtagRTI,   JtagSelDR },
+	[JtagSelDR] = { JtagCapDR, JtagSelIR },
+	[JtagCapDR] = { JtagShfDR, JtagEx1DR },
+	[JtagShfDR] = { JtagShfDR, JtagEx1DR },
+	[JtagEx1DR] = { JtagPauDR, JtagUpdDR },
+	[JtagPauDR] = { JtagPauDR, JtagEx2DR },
+	[JtagEx2DR] = { JtagShfDR, JtagUpdDR },
+	[JtagUpdDR] = { JtagRTI,   JtagSelDR },
+	[JtagSelIR] = { JtagCapIR, JtagTLR },
+	[JtagCapIR] = { JtagShfIR, JtagEx1IR },
+	[JtagShfIR] = { JtagShfIR, JtagEx1IR },
+	[JtagEx1IR] = { JtagPauIR, JtagUpdIR },
+	[JtagPauIR] = { JtagPauIR, JtagEx2IR },
+	[JtagEx2IR] = { JtagShfIR, JtagUpdIR },
+	[JtagUpdIR] = { JtagRTI,   JtagSelDR },
 };
 
 #define XXR_TDI				(1 << 0)
@@ -173,6 +202,7 @@ struct svf_xxr_para {
 	uint8_t *tdo;
 	uint8_t *mask;
 	uint8_t *smask;
+	int size;	/* bytes allocated for each of tdi/tdo/mask/smask */
 };
 
 struct svf_para {
@@ -196,23 +226,23 @@ static const struct svf_para svf_para_init = {
 /*	frequency, ir_end_state, dr_end_state, runtest_run_state, runtest_end_state, trst_mode */
 	0,			TAP_IDLE,		TAP_IDLE,	TAP_IDLE,		TAP_IDLE,		TRST_Z,
 /*	hir_para */
-/*	{len,	data_mask,	tdi,	tdo,	mask,	smask}, */
-	{0,			0,		NULL,	NULL,	NULL,	NULL},
+/*	{len,	data_mask,	tdi,	tdo,	mask,	smask,	size}, */
+	{0,			0,		NULL,	NULL,	NULL,	NULL,	0},
 /*	hdr_para */
-/*	{len,	data_mask,	tdi,	tdo,	mask,	smask}, */
-	{0,			0,		NULL,	NULL,	NULL,	NULL},
+/*	{len,	data_mask,	tdi,	tdo,	mask,	smask,	size}, */
+	{0,			0,		NULL,	NULL,	NULL,	NULL,	0},
 /*	tir_para */
-/*	{len,	data_mask,	tdi,	tdo,	mask,	smask}, */
-	{0,			0,		NULL,	NULL,	NULL,	NULL},
+/*	{len,	data_mask,	tdi,	tdo,	mask,	smask,	size}, */
+	{0,			0,		NULL,	NULL,	NULL,	NULL,	0},
 /*	tdr_para */
-/*	{len,	data_mask,	tdi,	tdo,	mask,	smask}, */
-	{0,			0,		NULL,	NULL,	NULL,	NULL},
+/*	{len,	data_mask,	tdi,	tdo,	mask,	smask,	size}, */
+	{0,			0,		NULL,	NULL,	NULL,	NULL,	0},
 /*	sir_para */
-/*	{len,	data_mask,	tdi,	tdo,	mask,	smask}, */
-	{0,			0,		NULL,	NULL,	NULL,	NULL},
+/*	{len,	data_mask,	tdi,	tdo,	mask,	smask,	size}, */
+	{0,			0,		NULL,	NULL,	NULL,	NULL,	0},
 /*	sdr_para */
-/*	{len,	data_mask,	tdi,	tdo,	mask,	smask}, */
-	{0,			0,		NULL,	NULL,	NULL,	NULL},
+/*	{len,	data_mask,	tdi,	tdo,	mask,	smask,	size}, */
+	{0,			0,		NULL,	NULL,	NULL,	NULL,	0},
 };
 
 struct svf_check_tdo_para {
@@ -221,16 +251,22 @@ struct svf_check_tdo_para {
 	int enabled;		/* check is enabled or not */
 	int buffer_offset;	/* buffer_offset to buffers */
 	int bit_len;		/* bit length to check */
+	const uint8_t *tdo;	/* expected data */
+	const uint8_t *mask;	/* compare mask */
 };
 
 #define SVF_CHECK_TDO_PARA_SIZE 1024
 static struct svf_check_tdo_para *svf_check_tdo_para;
 static int svf_check_tdo_para_index;
+static int svf_check_tdo_para_size;
 
 static int svf_read_command_from_file(FILE *fd);
 static int svf_check_tdo(bool silent);
-static int svf_add_check_para(uint8_t enabled, int buffer_offset, int bit_len);
+static int svf_add_check_para(uint8_t enabled, int buffer_offset, int bit_len,
+	const uint8_t *tdo, const uint8_t *mask);
 static int svf_run_command(char *cmd_str);
+static int svf_xxr_scan(bool ir);
+static void svf_set_freq(int hz);
 //static int svf_execute_tap(void);
 
 static FILE *svf_fd;
@@ -243,52 +279,131 @@ static int svf_getline(char **lineptr, size_t *n, FILE *stream);
 long file_offset;
 int loop = 0;
 int loop_line_number;
+/* a check inside the current LOOP iteration had to be committed early and failed */
+static int svf_loop_failed;
 
 #define SVF_MAX_BUFFER_SIZE_TO_COMMIT   (1024 * 1024)
 static uint8_t *svf_tdi_buffer, *svf_tdo_buffer, *svf_mask_buffer;
 static int svf_buffer_index, svf_buffer_size ;
+
+/*
+ * Bounded-memory mode: with a budget the staging buffers, the check table
+ * and the scan templates are sized to fit in it, scans that do not fit are
+ * shifted in windows and pending TDO checks are committed as soon as the
+ * staging buffers fill up.
+ */
+#define SVF_MIN_WINDOW_SIZE	64
+static size_t svf_mem_limit;
 static int svf_quiet;
 static int svf_nil;
 static int svf_ignore_error;
 
 /* Targetting particular tap */
 static int svf_tap_is_specified;
+
+/*
+ * TCK rate policy, see enum svf_freq_policy.  The rate last set is cached
+ * so repeated FREQUENCY commands and policy switches cost no ioctl.
+ */
+static int svf_freq_cur;	/* rate last set, 0: unknown */
+static int svf_freq_fast;	/* scan rate of SVF_FREQ_DYNAMIC, 0: leave as is */
+
+/*
+ * Scan template: HIR+SIR+TIR (or HDR+SDR+TDR) laid out for the current
+ * body length.  The header and trailer bits are filled in once, when a
+ * HIR/TIR (HDR/TDR) command changes them or the body length changes; each
+ * scan then only inserts its own body bits.
+ */
+struct svf_scan_tmpl {
+	int dirty;
+	int body_len;
+	int size;	/* bytes allocated for each array */
+	uint8_t *tdi;
+	uint8_t *tdo;
+	uint8_t *mask;
+};
+static struct svf_scan_tmpl svf_ir_tmpl, svf_dr_tmpl;
+
+static struct svf_stats svf_stats;
+
 static int svf_set_padding(struct svf_xxr_para *para, int len, unsigned char tdi);
+static int svf_apply_padding(void);
 
 /* Progress Indicator */
 static long svf_total_lines;
 static int svf_percentage;
 static int svf_last_printed_percentage = -1;
 
-static bool buf_cmp_masked(uint8_t a, uint8_t b, uint8_t m)
+/*
+ * Load 8 bytes as a little-endian word so that bit n of the word is bit n of
+ * the scan, whatever the host byte order.
+ */
+static inline uint64_t buf_get_u64(const uint8_t *p)
 {
-    return (a & m) != (b & m);
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
 }
-static bool buf_cmp_trailing(uint8_t a, uint8_t b, uint8_t m, unsigned trailing)
+
+/*
+ * Compare the first size bits of buf1 and buf2 under mask.  Returns the bit
+ * offset of the first masked difference, or -1 if the buffers match.
+ *
+ * The bulk is compared 64 bits at a time (16 bytes at a time with NEON);
+ * words whose mask is all ones or all zeros skip the AND with the mask.
+ */
+static int buf_cmp_mask_first(const uint8_t *buf1, const uint8_t *buf2,
+	const uint8_t *mask, unsigned size)
 {
-    uint8_t mask = (1 << trailing) - 1;
-    return buf_cmp_masked(a, b, mask & m);
+	unsigned bytes = size / 8;
+	unsigned trailing = size % 8;
+	unsigned i = 0;
+	uint64_t m, diff;
+	uint8_t d;
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+	for (; i + 16 <= bytes; i += 16) {
+		uint8x16_t vd = veorq_u8(vld1q_u8(buf1 + i), vld1q_u8(buf2 + i));
+
+		if (vmaxvq_u8(vandq_u8(vd, vld1q_u8(mask + i))))
+			break;	/* locate the bit with the word loop below */
+	}
+#endif
+	for (; i + 8 <= bytes; i += 8) {
+		m = buf_get_u64(mask + i);
+		if (!m)
+			continue;
+		diff = buf_get_u64(buf1 + i) ^ buf_get_u64(buf2 + i);
+		if (~m)
+			diff &= m;
+		if (diff)
+			return i * 8 + __builtin_ctzll(diff);
+	}
+	for (; i < bytes; i++) {
+		d = (buf1[i] ^ buf2[i]) & mask[i];
+		if (d)
+			return i * 8 + __builtin_ctz(d);
+	}
+	if (trailing) {
+		d = (buf1[i] ^ buf2[i]) & mask[i] & ((1 << trailing) - 1);
+		if (d)
+			return i * 8 + __builtin_ctz(d);
+	}
+
+	return -1;
 }
 
 bool buf_cmp_mask(const void *_buf1, const void *_buf2,
     const void *_mask, unsigned size)
 {
-	unsigned i, last;
     if (!_buf1 || !_buf2)
         return _buf1 != _buf2 || _buf1 != _mask;
 
-    const uint8_t *buf1 = _buf1, *buf2 = _buf2, *mask = _mask;
-    last = size / 8;
-    for (i = 0; i < last; i++) {
-        if (buf_cmp_masked(buf1[i], buf2[i], mask[i])) {
-            LOG_INFO("%s: (%d) 0x%02x 0x%02x 0x%02x\n", __func__, i, buf1[i], buf2[i], mask[i]);
-            return true;
-        }
-    }
-    unsigned trailing = size % 8;
-    if (!trailing)
-        return false;
-    return buf_cmp_trailing(buf1[last], buf2[last], mask[last], trailing);
+    return buf_cmp_mask_first(_buf1, _buf2, _mask, size) >= 0;
 }
 
 void *buf_set_ones(void *_buf, unsigned size)
@@ -326,11 +441,18 @@ void *buf_set_buf(const void *_src, unsigned src_start,
      * len is a multiple of 8bit so we can simple copy
      * the buffer */
     if ((sq == 0) && (dq == 0) &&  (lq == 0)) {
-        for (i = 0; i < lb; i++)
-            *dst++ = *src++;
+        memcpy(dst, src, lb);
         return _dst;
     }
 
+    /* byte aligned with trailing bits: copy whole bytes, then the rest */
+    if ((sq == 0) && (dq == 0)) {
+        memcpy(dst, src, lb);
+        src += lb;
+        dst += lb;
+        len = lq;
+    }
+
 
     /* fallback to slow bit copy */
     for (i = 0; i < len; i++) {
@@ -451,142 +573,481 @@ static void svf_free_xxd_para(struct svf_xxr_para *para)
 			free(para->smask);
 			para->smask = NULL;
 		}
+		para->size = 0;
 	}
 }
-#if 0
-int svf_add_statemove(tap_state_t state_to)
+
+static void svf_free_scan_tmpl(struct svf_scan_tmpl *tmpl)
 {
-	tap_state_t state_from = cmd_queue_cur_state;
-	unsigned index_var;
+	free(tmpl->tdi);
+	free(tmpl->tdo);
+	free(tmpl->mask);
+	memset(tmpl, 0, sizeof(*tmpl));
+}
 
-	/* when resetting, be paranoid and ignore current state */
-	if (state_to == TAP_RESET) {
-		if (svf_nil)
-			return ERROR_OK;
+void JTAG_get_svf_stats(struct svf_stats *stats)
+{
+	memcpy(stats, &svf_stats, sizeof(*stats));
+}
 
-		jtag_add_tlr();
-		return ERROR_OK;
+/*
+ * Checkpoint journal.  Before the first command after a vendor phase
+ * comment (erase, program, verify, ...) the pending TDO checks are
+ * committed and the position in the file, the TAP state and the sticky
+ * SVF parameters are recorded.  A resumed run replays the file up to the
+ * checkpoint without touching the JTAG interface, which rebuilds every
+ * sticky parameter, then moves the TAP to the recorded state and goes on
+ * live.  Every checkpoint is written, into two slots in turn, so a torn
+ * write leaves the previous checkpoint valid; only the sync is batched to
+ * once per SVF_JOURNAL_SYNC_MS, and a checkpoint lost with the page cache
+ * just resumes from an earlier one.
+ */
+#define SVF_JOURNAL_MAGIC	0x4a465653	/* "SVFJ" */
+#define SVF_JOURNAL_VERSION	1
+#define SVF_JOURNAL_SYNC_MS	1000
+
+struct svf_journal_rec {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t line;
+	uint64_t digest;	/* FNV-1a of the whole SVF file */
+	int64_t file_size;
+	int64_t offset;		/* resume point, start of a command */
+	int32_t tap_state;
+	int32_t ir_end_state;
+	int32_t dr_end_state;
+	int32_t runtest_run_state;
+	int32_t runtest_end_state;
+	int32_t trst_mode;
+	uint32_t frequency;
+	int32_t xxr_len[6];	/* hir, hdr, tir, tdr, sir, sdr */
+	uint32_t reserved;
+	uint64_t csum;
+};
+
+static const char * const svf_phase_markers[] = {
+	"erase", "program", "verify", "usercode",
+};
+
+static int svf_journal_fd = -1;
+static struct svf_journal_rec svf_journal;
+static int svf_journal_dirty;		/* written but not synced */
+static unsigned int svf_journal_written;	/* records written, picks the slot */
+static struct timeval svf_journal_synced;
+static int svf_phase_mark;
+
+/*
+ * Adaptive TCK rate: the phase checkpoints double as in-memory barriers,
+ * every TDO check before one has passed.  When a check fails the rate
+ * steps down and the file is replayed dry up to the last barrier.
+ */
+static int svf_barriers;	/* phase checkpoints are taken */
+static struct svf_journal_rec svf_barrier;
+static struct svf_journal_rec svf_run_start;	/* parameters when the run began */
+static int svf_tdo_failed;	/* a TDO check reported a mismatch */
+static int svf_freq_unadapted;	/* the rate before the first step down */
+
+/* pre-flight probe: comments mentioning the USERCODE since the last command */
+static int svf_probing;
+static int svf_comment_seen;
+static int svf_comment_usercode;
+
+/* what a dry pass would have cost on the wire */
+static struct {
+	unsigned long long bits;
+	unsigned long long tcks;
+	unsigned long long wait_usec;
+} svf_dry_cost;
+
+static uint64_t svf_fnv1a(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
 	}
+	return hash;
+}
 
-	for (index_var = 0; index_var < ARRAY_SIZE(svf_statemoves); index_var++) {
-		if ((svf_statemoves[index_var].from == state_from)
-				&& (svf_statemoves[index_var].to == state_to)) {
-			if (svf_nil)
-				continue;
-						/* recorded path includes current state ... avoid
-						 *extra TCKs! */
-			if (svf_statemoves[index_var].num_of_moves > 1)
-				jtag_add_pathmove(svf_statemoves[index_var].num_of_moves - 1,
-					svf_statemoves[index_var].paths + 1);
-			else
-				jtag_add_pathmove(svf_statemoves[index_var].num_of_moves,
-					svf_statemoves[index_var].paths);
-			return ERROR_OK;
+static uint64_t svf_file_digest(FILE *fd)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	uint8_t buf[4096];
+	size_t n;
+
+	fseek(fd, 0L, SEEK_SET);
+	while ((n = fread(buf, 1, sizeof(buf), fd)) > 0)
+		hash = svf_fnv1a(hash, buf, n);
+	fseek(fd, 0L, SEEK_SET);
+	return hash;
+}
+
+static bool svf_comment_has(const char *comment, const char * const *words, unsigned num)
+{
+	const char *p;
+	unsigned i;
+
+	for (p = comment; *p && *p != '\n'; p++) {
+		for (i = 0; i < num; i++) {
+			if (!strncasecmp(p, words[i], strlen(words[i])))
+				return true;
 		}
 	}
-	LOG_ERROR("SVF: can not move to %s", tap_state_name(state_to));
-	return ERROR_FAIL;
+	return false;
 }
-#endif
-int handle_svf_command(JTAG_Handler* state, char *filename)
+
+/* called for each comment read before a command */
+static void svf_check_comment(const char *comment)
 {
-	int command_num = 0;
-	int ret = ERROR_OK;
-	long svf_cur_pos;
-	long svf_file_size;
-	long pos;
-	int progress, tmp;
+	static const char * const usercode[] = { "usercode" };
+
+	if (svf_barriers &&
+			svf_comment_has(comment, svf_phase_markers, ARRAY_SIZE(svf_phase_markers)))
+		svf_phase_mark = 1;
+	if (svf_probing) {
+		svf_comment_seen = 1;
+		if (svf_comment_has(comment, usercode, ARRAY_SIZE(usercode)))
+			svf_comment_usercode = 1;
+	}
+}
 
-	jtag_handler = state;
-	/* parse command line */
-	svf_quiet = 0;
-	svf_nil = 0;
-	svf_ignore_error = 0;
+static void svf_journal_params(struct svf_journal_rec *rec)
+{
+	struct svf_xxr_para *xxr[] = {
+		&svf_para.hir_para, &svf_para.hdr_para, &svf_para.tir_para,
+		&svf_para.tdr_para, &svf_para.sir_para, &svf_para.sdr_para,
+	};
+	unsigned i;
+
+	rec->ir_end_state = svf_para.ir_end_state;
+	rec->dr_end_state = svf_para.dr_end_state;
+	rec->runtest_run_state = svf_para.runtest_run_state;
+	rec->runtest_end_state = svf_para.runtest_end_state;
+	rec->trst_mode = svf_para.trst_mode;
+	rec->frequency = (uint32_t)svf_para.frequency;
+	for (i = 0; i < ARRAY_SIZE(xxr); i++)
+		rec->xxr_len[i] = xxr[i]->len;
+}
 
-	svf_fd = fopen(filename, "r");
-	if (svf_fd == NULL) {
-		LOG_ERROR("failed to open %s\n", filename);
-		return -1;
-	} else
-		LOG_DEBUG("svf processing file: \"%s\"", filename);
-	fseek(svf_fd, 0L, SEEK_END);
-	svf_file_size = ftell(svf_fd);
-	fseek(svf_fd, 0L, SEEK_SET);
-	svf_cur_pos = 0;
-	progress = 0;
+/* undo the parameter changes of the run, svf_journal_params() in reverse */
+static void svf_restore_params(const struct svf_journal_rec *rec)
+{
+	struct svf_xxr_para *xxr[] = {
+		&svf_para.hir_para, &svf_para.hdr_para, &svf_para.tir_para,
+		&svf_para.tdr_para, &svf_para.sir_para, &svf_para.sdr_para,
+	};
+	unsigned i;
+
+	svf_para.ir_end_state = rec->ir_end_state;
+	svf_para.dr_end_state = rec->dr_end_state;
+	svf_para.runtest_run_state = rec->runtest_run_state;
+	svf_para.runtest_end_state = rec->runtest_end_state;
+	svf_para.trst_mode = rec->trst_mode;
+	svf_para.frequency = rec->frequency;
+	for (i = 0; i < ARRAY_SIZE(xxr); i++)
+		xxr[i]->len = rec->xxr_len[i];
+	svf_ir_tmpl.dirty = 1;
+	svf_dr_tmpl.dirty = 1;
+}
 
-	/* init */
-	svf_line_number = 0;
-	svf_command_buffer_size = 0;
+static uint64_t svf_journal_csum(const struct svf_journal_rec *rec)
+{
+	return svf_fnv1a(0xcbf29ce484222325ULL, rec, offsetof(struct svf_journal_rec, csum));
+}
 
-	svf_check_tdo_para_index = 0;
-	svf_check_tdo_para = malloc(sizeof(struct svf_check_tdo_para) * SVF_CHECK_TDO_PARA_SIZE);
-	if (NULL == svf_check_tdo_para) {
-		LOG_ERROR("not enough memory");
-		ret = ERROR_FAIL;
-		goto free_all;
+static void svf_journal_flush(void)
+{
+	if (svf_journal_fd < 0 || !svf_journal_dirty)
+		return;
+	if (fdatasync(svf_journal_fd) < 0)
+		LOG_ERROR("failed to sync svf journal");
+	svf_journal_dirty = 0;
+	gettimeofday(&svf_journal_synced, NULL);
+}
+
+static void svf_journal_checkpoint(long offset, int line)
+{
+	struct timeval now;
+
+	svf_journal.seq++;
+	svf_journal.offset = offset;
+	svf_journal.line = line;
+	svf_journal.tap_state = jtag_handler->tap_state;
+	svf_journal_params(&svf_journal);
+	svf_journal.csum = svf_journal_csum(&svf_journal);
+	/* the other slot than the last record written keeps it valid */
+	if (pwrite(svf_journal_fd, &svf_journal, sizeof(svf_journal),
+			(svf_journal_written & 1) * sizeof(svf_journal)) != sizeof(svf_journal)) {
+		LOG_ERROR("failed to write svf journal");
+		return;
 	}
+	svf_journal_written++;
+	svf_journal_dirty = 1;
 
-	svf_buffer_index = 0;
-	/* double the buffer size */
-	/* in case current command cannot be committed, and next command is a bit scan command */
-	/* here is 32K bits for this big scan command, it should be enough */
-	/* buffer will be reallocated if buffer size is not enough */
-	if (svf_realloc_buffers(2 * SVF_MAX_BUFFER_SIZE_TO_COMMIT) != ERROR_OK) {
-		ret = ERROR_FAIL;
-		goto free_all;
+	gettimeofday(&now, NULL);
+	if ((now.tv_sec - svf_journal_synced.tv_sec) * 1000 +
+			(now.tv_usec - svf_journal_synced.tv_usec) / 1000 >= SVF_JOURNAL_SYNC_MS)
+		svf_journal_flush();
+}
+
+/* return the slot of the newest valid checkpoint of the journal, -1 if there is none */
+static int svf_journal_load(int fd, struct svf_journal_rec *rec)
+{
+	struct svf_journal_rec slot[2];
+	int i, best = -1;
+
+	for (i = 0; i < 2; i++) {
+		if (pread(fd, &slot[i], sizeof(slot[i]), i * sizeof(slot[i])) != sizeof(slot[i]) ||
+				slot[i].magic != SVF_JOURNAL_MAGIC ||
+				slot[i].version != SVF_JOURNAL_VERSION ||
+				slot[i].csum != svf_journal_csum(&slot[i]))
+			continue;
+		if (best < 0 || slot[i].seq > slot[best].seq)
+			best = i;
 	}
+	if (best < 0)
+		return -1;
+	*rec = slot[best];
+	return best;
+}
 
-	memcpy(&svf_para, &svf_para_init, sizeof(svf_para));
+static int svf_dry_set_state(JTAG_Handler *handler, int state)
+{
+	handler->tap_state = state;
+	return 0;
+}
 
-	while (ERROR_OK == svf_read_command_from_file(svf_fd)) {
-		int c;
-		/* Run Command */
-		if (jtag_handler->single_step) {
-			if (strlen(svf_command_buffer) > 80) {
-				char buffer[80];
-				snprintf(buffer, sizeof(buffer), "%s", svf_command_buffer);
-				printf("line %d run: %s\n", svf_line_number, buffer);
-			} else
-				printf("line %d run: %s\n", svf_line_number, svf_command_buffer);
-			printf("press key to continue\n");
-			c = getchar();
-		}
-		if (ERROR_OK != svf_run_command(svf_command_buffer)) {
-			LOG_ERROR("fail to run command at line %d", svf_line_number);
+static int svf_dry_run_tck(JTAG_Handler *handler, int state, int tcks)
+{
+	(void)tcks;
+	if (state != JTAG_STATE_CURRENT)
+		handler->tap_state = state;
+	return 0;
+}
+
+static int svf_dry_shift(JTAG_Handler *handler, int bits, const uint8_t *out, uint8_t *in, int state)
+{
+	(void)bits;
+	(void)out;
+	(void)in;
+	handler->tap_state = state;
+	return 0;
+}
+
+/* stands in for the real interface while a resumed run replays the file */
+static const struct jtag_ops svf_dry_ops = {
+	.set_state = svf_dry_set_state,
+	.run_tck = svf_dry_run_tck,
+	.shift_ir = svf_dry_shift,
+	.shift_dr = svf_dry_shift,
+};
+
+static JTAG_Handler svf_dry_handler = {
+	.name = "svf_dry",
+	.ops = &svf_dry_ops,
+};
+
+/* shift the last SIR again, without checking its TDO */
+static int svf_reload_ir(void)
+{
+	int data_mask = svf_para.sir_para.data_mask;
+	int ret;
+
+	if (!svf_para.sir_para.len)
+		return ERROR_OK;
+	svf_para.sir_para.data_mask &= ~XXR_TDO;
+	ret = svf_xxr_scan(true);
+	svf_para.sir_para.data_mask = data_mask;
+
+	return ret;
+}
+
+/*
+ * Fast-forward to a checkpoint: replay the file from its start without
+ * touching the JTAG interface, then move the TAP to the recorded state.
+ * The replay starts from the TAP state the run started in, which the
+ * previous file of the session may have left anywhere.
+ */
+static int svf_replay_to(const struct svf_journal_rec *rec)
+{
+	JTAG_Handler *handler = jtag_handler;
+	struct svf_journal_rec now;
+	int ret = ERROR_OK;
+
+	fseek(svf_fd, 0L, SEEK_SET);
+	svf_line_number = 0;
+	svf_dry_handler.tap_state = svf_run_start.tap_state;
+	svf_dry_handler.frequency = handler->frequency;
+	svf_dry_handler.loglevel = handler->loglevel;
+	jtag_handler = &svf_dry_handler;
+	svf_nil = 1;
+	while (ftell(svf_fd) < rec->offset) {
+		if (ERROR_OK != svf_read_command_from_file(svf_fd) ||
+				ERROR_OK != svf_run_command(svf_command_buffer)) {
 			ret = ERROR_FAIL;
 			break;
 		}
-		command_num++;
-		if (svf_file_size > 0) {
-			pos = ftell(svf_fd);
-			if (pos > svf_cur_pos)
-				svf_cur_pos = pos;
+	}
+	svf_nil = 0;
+	svf_phase_mark = 0;
+	jtag_handler = handler;
+
+	memcpy(&now, rec, sizeof(now));
+	svf_journal_params(&now);
+	if (ret != ERROR_OK || ftell(svf_fd) != rec->offset ||
+			memcmp(&now, rec, sizeof(now)) ||
+			svf_dry_handler.tap_state != rec->tap_state) {
+		LOG_ERROR("svf file does not match the checkpoint at line %d", rec->line);
+		return ERROR_FAIL;
+	}
 
-			tmp = 100 * svf_cur_pos / svf_file_size;
-			if (tmp > progress) {
-				progress = tmp;
-				if (jtag_handler->loglevel > LEV_DEBUG) {
-					printf("Progress: %d%%\r", progress);
-					fflush(stdout);
-				}
-			}
+	svf_line_number = rec->line;
+	if (jtag_handler->svf_freq_policy == SVF_FREQ_FOLLOW ||
+			(svf_para.frequency > 0 && !jtag_handler->frequency))
+		svf_set_freq(svf_para.frequency ? svf_para.frequency : svf_freq_fast);
+	/* the TAP has been reset since the checkpoint, reload the last instruction */
+	if (svf_reload_ir() != ERROR_OK)
+		return ERROR_FAIL;
+	JTAG_set_tap_state(jtag_handler, rec->tap_state);
+	LOG_INFO("resuming at line %d", rec->line);
+
+	return ERROR_OK;
+}
+
+/*
+ * Open the journal for a run.  With resume and a checkpoint for this very
+ * file, fast-forward to it; otherwise start a fresh journal.
+ */
+static int svf_journal_start(JTAG_Handler *handler, long file_size)
+{
+	struct svf_journal_rec rec;
+	uint64_t digest;
+	int slot;
+
+	svf_journal_fd = open(handler->svf_journal, O_RDWR | O_CREAT, 0644);
+	if (svf_journal_fd < 0) {
+		LOG_ERROR("failed to open svf journal %s", handler->svf_journal);
+		return ERROR_FAIL;
+	}
+	digest = svf_file_digest(svf_fd);
+	svf_phase_mark = 0;
+
+	if (handler->svf_resume) {
+		slot = svf_journal_load(svf_journal_fd, &rec);
+		if (slot >= 0 && rec.digest == digest && rec.file_size == file_size) {
+			memcpy(&svf_journal, &rec, sizeof(svf_journal));
+			svf_journal_written = slot + 1;
+			svf_journal_dirty = 0;
+			gettimeofday(&svf_journal_synced, NULL);
+			return svf_replay_to(&rec);
 		}
+		LOG_INFO("no checkpoint for this file, starting from the beginning");
 	}
 
-	svf_check_tdo(false);
-	printf("\nDone!\n");
-free_all:
+	memset(&svf_journal, 0, sizeof(svf_journal));
+	svf_journal.magic = SVF_JOURNAL_MAGIC;
+	svf_journal.version = SVF_JOURNAL_VERSION;
+	svf_journal.digest = digest;
+	svf_journal.file_size = file_size;
+	if (ftruncate(svf_journal_fd, 0) < 0)
+		LOG_ERROR("failed to reset svf journal");
+	svf_journal_written = 0;
+	svf_journal_dirty = 0;
+	gettimeofday(&svf_journal_synced, NULL);
 
-	fclose(svf_fd);
-	svf_fd = 0;
+	return ERROR_OK;
+}
+
+static void svf_barrier_set(long offset, int line)
+{
+	svf_barrier.offset = offset;
+	svf_barrier.line = line;
+	svf_barrier.tap_state = jtag_handler->tap_state;
+	svf_journal_params(&svf_barrier);
+}
+
+/*
+ * After a TDO mismatch in adaptive mode, lower the TCK rate one step and
+ * go back to the last barrier.  ERROR_OK means the run can go on.
+ */
+static int svf_adapt_frequency(void)
+{
+	int from = svf_freq_cur;
+	int to;
+
+	if (!jtag_handler->svf_adaptive || !svf_tdo_failed)
+		return ERROR_FAIL;
+	svf_tdo_failed = 0;
+	/* scans run at the fast rate of the dynamic policy */
+	if (jtag_handler->svf_freq_policy == SVF_FREQ_DYNAMIC && svf_freq_fast > 0)
+		from = svf_freq_fast;
+	if (from <= 0)
+		from = JTAG_get_clock_frequency(jtag_handler);
+	to = JTAG_freq_step_down(from);
+	if (to <= 0) {
+		LOG_ERROR("TDO check failed at the lowest TCK rate");
+		return ERROR_FAIL;
+	}
+	LOG_INFO("TDO check failed at %d Hz, retrying at %d Hz from line %d",
+			from, to, svf_barrier.line);
+	if (!svf_stats.freq_fallbacks++)
+		svf_freq_unadapted = from;
+	jtag_handler->svf_max_freq = to;
+	svf_freq_fast = to;
+	svf_set_freq(to);
 
+	svf_check_tdo_para_index = 0;
+	svf_buffer_index = 0;
+	loop = 0;
+	svf_loop_failed = 0;
+	svf_restore_params(&svf_run_start);
+	JTAG_set_tap_state(jtag_handler, JtagTLR);
+
+	return svf_replay_to(&svf_barrier);
+}
+
+/* keep the journal if the run failed, drop it once the file is done */
+static void svf_journal_stop(JTAG_Handler *handler, int ret)
+{
+	if (svf_journal_fd < 0)
+		return;
+	if (ret == ERROR_OK) {
+		close(svf_journal_fd);
+		unlink(handler->svf_journal);
+	} else {
+		svf_journal_flush();
+		close(svf_journal_fd);
+	}
+	svf_journal_fd = -1;
+}
+
+/*
+ * SVF session: the working buffers, the check table, the decoded XXR
+ * parameters and the scan templates outlive a single file so that several
+ * files can be played back to back on the same handler without paying the
+ * setup again.  The engine state is global, only one session can exist.
+ */
+struct svf_session {
+	JTAG_Handler *handler;
+};
+static struct svf_session svf_session;
+static int svf_session_active;
+
+static void svf_free_all(void)
+{
 	/* free buffers */
 	if (svf_command_buffer) {
 		free(svf_command_buffer);
 		svf_command_buffer = NULL;
 		svf_command_buffer_size = 0;
 	}
+	if (svf_read_line) {
+		free(svf_read_line);
+		svf_read_line = NULL;
+		svf_read_line_size = 0;
+	}
 	if (svf_check_tdo_para) {
 		free(svf_check_tdo_para);
 		svf_check_tdo_para = NULL;
@@ -613,40 +1074,395 @@ free_all:
 	svf_free_xxd_para(&svf_para.tir_para);
 	svf_free_xxd_para(&svf_para.sdr_para);
 	svf_free_xxd_para(&svf_para.sir_para);
-
-	svf_ignore_error = 0;
-	return ret;
+	svf_free_scan_tmpl(&svf_ir_tmpl);
+	svf_free_scan_tmpl(&svf_dr_tmpl);
 }
 
-static int svf_getline(char **lineptr, size_t *n, FILE *stream)
+struct svf_session *svf_session_create(JTAG_Handler *handler)
 {
-#define MIN_CHUNK 16	/* Buffer is increased by this size each time as required */
-	size_t i = 0;
+	int window;
 
-	if (*lineptr == NULL) {
-		*n = MIN_CHUNK;
-		*lineptr = malloc(*n);
-		if (!*lineptr)
-			return -1;
+	if (svf_session_active) {
+		LOG_ERROR("svf session already in use");
+		return NULL;
 	}
 
-	(*lineptr)[0] = fgetc(stream);
-	while ((*lineptr)[i] != '\n') {
-		(*lineptr)[++i] = fgetc(stream);
-		if (feof(stream)) {
-			(*lineptr)[0] = 0;
-			return -1;
-		}
-		if ((i + 2) > *n) {
-			*n += MIN_CHUNK;
-			*lineptr = realloc(*lineptr, *n);
-		}
+	svf_mem_limit = handler->svf_mem_limit;
+	if (svf_mem_limit) {
+		/* 1/16 of the budget for checks, the rest split between the
+		 * three staging buffers and the three template buffers */
+		svf_check_tdo_para_size = svf_mem_limit / 16 / sizeof(struct svf_check_tdo_para);
+		if (svf_check_tdo_para_size > SVF_CHECK_TDO_PARA_SIZE)
+			svf_check_tdo_para_size = SVF_CHECK_TDO_PARA_SIZE;
+		if (svf_check_tdo_para_size < 16)
+			svf_check_tdo_para_size = 16;
+		window = (svf_mem_limit - svf_check_tdo_para_size *
+				sizeof(struct svf_check_tdo_para)) / 6;
+		window &= ~7;
+		if (window < SVF_MIN_WINDOW_SIZE)
+			window = SVF_MIN_WINDOW_SIZE;
+		LOG_INFO("svf memory budget %zu bytes: %d byte windows, %d checks",
+			svf_mem_limit, window, svf_check_tdo_para_size);
+	} else {
+		svf_check_tdo_para_size = SVF_CHECK_TDO_PARA_SIZE;
+		/* double the buffer size */
+		/* in case current command cannot be committed, and next command is a bit scan command */
+		/* here is 32K bits for this big scan command, it should be enough */
+		/* buffer will be reallocated if buffer size is not enough */
+		window = 2 * SVF_MAX_BUFFER_SIZE_TO_COMMIT;
 	}
 
-	(*lineptr)[++i] = 0;
+	svf_check_tdo_para_index = 0;
+	svf_check_tdo_para = malloc(sizeof(struct svf_check_tdo_para) * svf_check_tdo_para_size);
+	if (NULL == svf_check_tdo_para) {
+		LOG_ERROR("not enough memory");
+		goto free_all;
+	}
 
-	return sizeof(*lineptr);
-}
+	svf_buffer_index = 0;
+	if (svf_realloc_buffers(window) != ERROR_OK)
+		goto free_all;
+
+	memcpy(&svf_para, &svf_para_init, sizeof(svf_para));
+
+	svf_session.handler = handler;
+	svf_session_active = 1;
+	return &svf_session;
+
+free_all:
+	svf_free_all();
+	return NULL;
+}
+
+void svf_session_destroy(struct svf_session *session)
+{
+	if (!session || !svf_session_active)
+		return;
+	svf_free_all();
+	memset(session, 0, sizeof(*session));
+	svf_session_active = 0;
+}
+
+/*
+ * Play one SVF file.  The TAP state, the HIR/HDR/TIR/TDR padding, the
+ * ENDIR/ENDDR states and the last SIR/SDR data carry over from the
+ * previous file of the session, as if the files were concatenated.
+ */
+int svf_session_run(struct svf_session *session, char *filename, bool single_step)
+{
+	int command_num = 0;
+	int ret = ERROR_OK;
+	long svf_cur_pos;
+	long svf_file_size;
+	long pos, cmd_start = 0;
+	int progress, tmp, cmd_line = 0;
+	int max_freq;
+
+	if (!session || !svf_session_active)
+		return ERROR_FAIL;
+
+	jtag_handler = session->handler;
+	/* a rate lowered by --adaptive-freq only holds for this file */
+	max_freq = jtag_handler->svf_max_freq;
+	jtag_handler->single_step = single_step;
+	/* parse command line */
+	svf_quiet = 0;
+	svf_nil = 0;
+	svf_ignore_error = 0;
+
+	svf_fd = fopen(filename, "r");
+	if (svf_fd == NULL) {
+		LOG_ERROR("failed to open %s\n", filename);
+		return -1;
+	} else
+		LOG_DEBUG("svf processing file: \"%s\"", filename);
+	fseek(svf_fd, 0L, SEEK_END);
+	svf_file_size = ftell(svf_fd);
+	fseek(svf_fd, 0L, SEEK_SET);
+	svf_cur_pos = 0;
+	progress = 0;
+
+	/* init */
+	svf_line_number = 0;
+	svf_check_tdo_para_index = 0;
+	svf_buffer_index = 0;
+	loop = 0;
+	svf_loop_failed = 0;
+	memset(&svf_stats, 0, sizeof(svf_stats));
+	svf_freq_cur = jtag_handler->frequency;
+	svf_freq_fast = jtag_handler->svf_max_freq;
+	if (!svf_freq_fast && jtag_handler->svf_freq_policy != SVF_FREQ_FIXED)
+		svf_freq_fast = JTAG_get_clock_frequency(jtag_handler);
+	svf_barriers = jtag_handler->svf_journal || jtag_handler->svf_adaptive;
+	svf_tdo_failed = 0;
+	if (svf_apply_padding() != ERROR_OK) {
+		fclose(svf_fd);
+		svf_fd = 0;
+		return ERROR_FAIL;
+	}
+	svf_barrier_set(0, 0);
+	memcpy(&svf_run_start, &svf_barrier, sizeof(svf_run_start));
+	/* an interface that sends ahead may hand in TDO by svf_check_tdo() */
+	jtag_handler->defer_tdo = jtag_handler->ops->flush != NULL;
+
+	if (jtag_handler->svf_journal &&
+			svf_journal_start(jtag_handler, svf_file_size) != ERROR_OK) {
+		ret = ERROR_FAIL;
+		goto out;
+	}
+
+	while (1) {
+		int c;
+
+		if (svf_barriers) {
+			cmd_start = ftell(svf_fd);
+			cmd_line = svf_line_number;
+		}
+		if (ERROR_OK != svf_read_command_from_file(svf_fd)) {
+			/* end of file, the last checks */
+			if (svf_check_tdo(false) == ERROR_OK)
+				break;
+			if (svf_adapt_frequency() == ERROR_OK)
+				continue;
+			ret = ERROR_FAIL;
+			break;
+		}
+		if (svf_phase_mark) {
+			/* a phase begins: checkpoint the state before its first command */
+			svf_phase_mark = 0;
+			if (!loop) {
+				if (ERROR_OK != svf_check_tdo(false)) {
+					if (svf_adapt_frequency() == ERROR_OK)
+						continue;
+					ret = ERROR_FAIL;
+					break;
+				}
+				/* what the interface sent without waiting is done, too */
+				if (JTAG_flush(jtag_handler)) {
+					LOG_ERROR("an operation before line %d failed", cmd_line);
+					ret = ERROR_FAIL;
+					break;
+				}
+				svf_barrier_set(cmd_start, cmd_line);
+				if (svf_journal_fd >= 0)
+					svf_journal_checkpoint(cmd_start, cmd_line);
+			}
+		}
+		/* Run Command */
+		if (jtag_handler->single_step) {
+			if (strlen(svf_command_buffer) > 80) {
+				char buffer[80];
+				snprintf(buffer, sizeof(buffer), "%s", svf_command_buffer);
+				printf("line %d run: %s\n", svf_line_number, buffer);
+			} else
+				printf("line %d run: %s\n", svf_line_number, svf_command_buffer);
+			printf("press key to continue\n");
+			c = getchar();
+		}
+		if (ERROR_OK != svf_run_command(svf_command_buffer)) {
+			if (svf_adapt_frequency() == ERROR_OK)
+				continue;
+			LOG_ERROR("fail to run command at line %d", svf_line_number);
+			ret = ERROR_FAIL;
+			break;
+		}
+		command_num++;
+		if (svf_file_size > 0) {
+			pos = ftell(svf_fd);
+			if (pos > svf_cur_pos)
+				svf_cur_pos = pos;
+
+			tmp = 100 * svf_cur_pos / svf_file_size;
+			if (tmp > progress) {
+				progress = tmp;
+				if (jtag_handler->loglevel > LEV_DEBUG) {
+					printf("Progress: %d%%\r", progress);
+					fflush(stdout);
+				}
+			}
+		}
+	}
+
+	if (ret == ERROR_OK && JTAG_flush(jtag_handler)) {
+		LOG_ERROR("an operation before the end of %s failed", filename);
+		ret = ERROR_FAIL;
+		goto out;
+	}
+	if (svf_stats.freq_fallbacks)
+		LOG_INFO("%s: TCK rate lowered to %d Hz", jtag_handler->name, svf_freq_cur);
+	printf("\nDone!\n");
+out:
+	svf_journal_stop(jtag_handler, ret);
+	fclose(svf_fd);
+	svf_fd = 0;
+
+	JTAG_flush(jtag_handler);
+	jtag_handler->defer_tdo = false;
+	svf_ignore_error = 0;
+	if (svf_stats.freq_fallbacks) {
+		jtag_handler->svf_max_freq = max_freq;
+		if (svf_freq_unadapted > 0) {
+			svf_set_freq(svf_freq_unadapted);
+			LOG_INFO("%s: TCK rate back to %d Hz for the next file",
+					jtag_handler->name, svf_freq_cur);
+		}
+	}
+	return ret;
+}
+
+/*
+ * Pre-flight check: is the device already running the image of this
+ * file?  The file is played dry; only the IDCODE check (the first 32-bit
+ * SDR with TDO) and the USERCODE check (the first 32-bit SDR with TDO
+ * after a comment naming the USERCODE) are shifted for real, each after
+ * reloading the SIR in front of it.  Returns 1 when both match, 0 when
+ * either does not or the file has no USERCODE check, and an estimate of
+ * the programming time in est_ms.
+ */
+int svf_session_is_current(struct svf_session *session, char *filename, unsigned long *est_ms)
+{
+	JTAG_Handler *handler;
+	int idcode = 0, usercode = 0, current = -1;
+	unsigned long long freq;
+	int ret = ERROR_OK;
+
+	if (!session || !svf_session_active)
+		return ERROR_FAIL;
+	handler = session->handler;
+
+	svf_fd = fopen(filename, "r");
+	if (svf_fd == NULL) {
+		LOG_ERROR("failed to open %s\n", filename);
+		return ERROR_FAIL;
+	}
+	svf_line_number = 0;
+	svf_check_tdo_para_index = 0;
+	svf_buffer_index = 0;
+	loop = 0;
+	svf_loop_failed = 0;
+	memset(&svf_dry_cost, 0, sizeof(svf_dry_cost));
+	svf_probing = 1;
+	svf_comment_seen = 0;
+	svf_comment_usercode = 0;
+	jtag_handler = handler;
+	if (svf_apply_padding() != ERROR_OK) {
+		fclose(svf_fd);
+		svf_fd = 0;
+		return ERROR_FAIL;
+	}
+
+	svf_dry_handler.tap_state = handler->tap_state;
+	svf_dry_handler.frequency = handler->frequency;
+	svf_dry_handler.loglevel = handler->loglevel;
+	jtag_handler = &svf_dry_handler;
+	svf_nil = 1;
+
+	while (ERROR_OK == svf_read_command_from_file(svf_fd)) {
+		bool match;
+
+		if (svf_comment_seen) {
+			/* a new comment block, remember if it is about the USERCODE */
+			usercode = svf_comment_usercode;
+			svf_comment_seen = 0;
+			svf_comment_usercode = 0;
+		}
+		if (ERROR_OK != svf_run_command(svf_command_buffer)) {
+			ret = ERROR_FAIL;
+			break;
+		}
+		if (current >= 0 || loop || strncmp(svf_command_buffer, "SDR", 3) ||
+				svf_para.sdr_para.len != 32 ||
+				!(svf_para.sdr_para.data_mask & XXR_TDO) ||
+				(idcode && !usercode))
+			continue;
+
+		/* redo the SIR and this SDR on the real interface */
+		jtag_handler = handler;
+		svf_nil = 0;
+		if (svf_reload_ir() != ERROR_OK || svf_xxr_scan(false) != ERROR_OK) {
+			ret = ERROR_FAIL;
+			break;
+		}
+		match = svf_check_tdo(true) == ERROR_OK;
+		svf_nil = 1;
+		svf_dry_handler.tap_state = handler->tap_state;
+		jtag_handler = &svf_dry_handler;
+
+		LOG_INFO("%s at line %d %s", usercode ? "USERCODE" : "IDCODE",
+			svf_line_number, match ? "matches" : "differs");
+		if (!match)
+			current = 0;
+		else if (usercode)
+			current = idcode;
+		else
+			idcode = 1;
+	}
+
+	svf_nil = 0;
+	svf_probing = 0;
+	jtag_handler = handler;
+	fclose(svf_fd);
+	svf_fd = 0;
+	if (ret != ERROR_OK)
+		return ret;
+	if (current < 0)
+		LOG_INFO("%s has no %s check", filename, idcode ? "USERCODE" : "IDCODE");
+
+	if (est_ms) {
+		freq = JTAG_get_clock_frequency(handler);
+		if (!freq)
+			freq = svf_para.frequency;
+		*est_ms = svf_dry_cost.wait_usec / 1000;
+		if (freq)
+			*est_ms += (svf_dry_cost.bits + svf_dry_cost.tcks) * 1000 / freq;
+	}
+
+	return current > 0;
+}
+
+int handle_svf_command(JTAG_Handler* state, char *filename)
+{
+	struct svf_session *session;
+	int ret;
+
+	session = svf_session_create(state);
+	if (!session)
+		return ERROR_FAIL;
+	ret = svf_session_run(session, filename, state->single_step);
+	svf_session_destroy(session);
+
+	return ret;
+}
+
+static int svf_getline(char **lineptr, size_t *n, FILE *stream)
+{
+#define MIN_CHUNK 16	/* Buffer is increased by this size each time as required */
+	size_t i = 0;
+
+	if (*lineptr == NULL) {
+		*n = MIN_CHUNK;
+		*lineptr = malloc(*n);
+		if (!*lineptr)
+			return -1;
+	}
+
+	(*lineptr)[0] = fgetc(stream);
+	while ((*lineptr)[i] != '\n') {
+		(*lineptr)[++i] = fgetc(stream);
+		if (feof(stream)) {
+			(*lineptr)[0] = 0;
+			return -1;
+		}
+		if ((i + 2) > *n) {
+			*n += MIN_CHUNK;
+			*lineptr = realloc(*lineptr, *n);
+		}
+	}
+
+	(*lineptr)[++i] = 0;
+
+	return sizeof(*lineptr);
+}
 
 #define SVFP_CMD_INC_CNT 1024
 static int svf_read_command_from_file(FILE *fd)
@@ -664,6 +1480,8 @@ static int svf_read_command_from_file(FILE *fd)
 		switch (ch) {
 			case '!':
 				slash = 0;
+				if (!cmd_pos)
+					svf_check_comment(&svf_read_line[i + 1]);
 				if (svf_getline(&svf_read_line, &svf_read_line_size, svf_fd) <= 0)
 					return ERROR_FAIL;
 				svf_line_number++;
@@ -672,6 +1490,8 @@ static int svf_read_command_from_file(FILE *fd)
 			case '/':
 				if (++slash == 2) {
 					slash = 0;
+					if (!cmd_pos)
+						svf_check_comment(&svf_read_line[i + 1]);
 					if (svf_getline(&svf_read_line, &svf_read_line_size,
 						svf_fd) <= 0)
 						return ERROR_FAIL;
@@ -709,8 +1529,8 @@ static int svf_read_command_from_file(FILE *fd)
 				 *  - terminating NUL ('\0')
 				 */
 				if (cmd_pos + 3 > svf_command_buffer_size) {
-					svf_command_buffer = realloc(svf_command_buffer, cmd_pos + 3);
-					svf_command_buffer_size = cmd_pos + 3;
+					svf_command_buffer_size = 2 * svf_command_buffer_size + SVFP_CMD_INC_CNT;
+					svf_command_buffer = realloc(svf_command_buffer, svf_command_buffer_size);
 					if (svf_command_buffer == NULL) {
 						LOG_ERROR("not enough memory");
 						return ERROR_FAIL;
@@ -782,6 +1602,94 @@ bool svf_tap_state_is_stable(tap_state_t state)
 			|| (TAP_DRPAUSE == state) || (TAP_IRPAUSE == state);
 }
 
+static void svf_set_freq(int hz)
+{
+	int max = jtag_handler->svf_max_freq;
+
+	if (max && hz > max)
+		hz = max;
+	if (svf_nil || hz <= 0 || hz == svf_freq_cur)
+		return;
+	if (JTAG_set_clock_frequency(jtag_handler, hz)) {
+		svf_freq_cur = 0;
+		return;
+	}
+	svf_freq_cur = hz;
+	svf_stats.freq_switches++;
+}
+
+/*
+ * Move the TAP to a stable state with the precomputed TMS sequence in one
+ * call, or let the interface find the path if it cannot clock raw TMS.
+ */
+static int svf_tap_move(JTAG_Handler *handler, tap_state_t state)
+{
+	int from = handler->tap_state;
+	const struct svf_tms_path *move;
+	int ret;
+
+	if (from >= JtagTLR && from <= JtagUpdIR) {
+		move = &svf_tms_paths[from][state];
+		if (!move->len)
+			return ERROR_OK;
+		ret = JTAG_shift_raw(handler, &move->tms, NULL, NULL, move->len, state);
+		if (ret != -EOPNOTSUPP)
+			return ret ? ERROR_FAIL : ERROR_OK;
+	}
+	if (JTAG_set_tap_state(handler, state))
+		return ERROR_FAIL;
+
+	return ERROR_OK;
+}
+
+static int svf_move_to(tap_state_t state)
+{
+	return svf_tap_move(jtag_handler, state);
+}
+
+/*
+ * Walk an explicit STATE path.  Every state must follow from the previous
+ * one in a single TCK, the last one must be stable.
+ */
+static int svf_tap_path(JTAG_Handler *handler, const tap_state_t *path, int num)
+{
+	uint8_t tms[256 / 8];
+	int from = handler->tap_state;
+	int i, ret;
+
+	if (from < JtagTLR || from > JtagUpdIR || num > (int)sizeof(tms) * 8) {
+		LOG_ERROR("cannot follow STATE path from %s", tap_state_name(from));
+		return ERROR_FAIL;
+	}
+	memset(tms, 0, sizeof(tms));
+	for (i = 0; i < num; i++) {
+		if (svf_tap_next[from][1] == path[i]) {
+			tms[i / 8] |= 1 << (i % 8);
+		} else if (svf_tap_next[from][0] != path[i]) {
+			LOG_ERROR("STATE: %s does not follow %s",
+					tap_state_name(path[i]), tap_state_name(from));
+			return ERROR_FAIL;
+		}
+		from = path[i];
+	}
+
+	ret = JTAG_shift_raw(handler, tms, NULL, NULL, num, path[num - 1]);
+	if (ret != -EOPNOTSUPP)
+		return ret ? ERROR_FAIL : ERROR_OK;
+	/* the interface only knows stable states, pass through each one */
+	for (i = 0; i < num; i++) {
+		if (JTAG_set_tap_state(handler, path[i]))
+			return ERROR_FAIL;
+	}
+
+	return ERROR_OK;
+}
+
+static int svf_path_move(const tap_state_t *path, int num)
+{
+	return svf_tap_path(jtag_handler, path, num);
+}
+
 static int svf_find_string_in_array(char *str, char **strs, int num_of_element)
 {
 	int i;
@@ -812,17 +1720,70 @@ static int svf_adjust_array_length(uint8_t **arr, int orig_bit_len, int new_bit_
 	return ERROR_OK;
 }
 
+/*
+ * Make room for bit_len bits in all arrays of a scan parameter.  The
+ * allocation only ever grows (in powers of two) so that scans of varying
+ * length stop allocating once the longest one has been seen.
+ */
+static int svf_reserve_xxr_para(struct svf_xxr_para *para, int bit_len)
+{
+	uint8_t **arr[] = { &para->tdi, &para->tdo, &para->mask, &para->smask };
+	int bytes = (bit_len + 7) >> 3;
+	int size = para->size ? para->size : 16;
+	unsigned i;
+	void *ptr;
+
+	if (para->size && bytes <= para->size)
+		return ERROR_OK;
+	while (size < bytes)
+		size <<= 1;
+	for (i = 0; i < ARRAY_SIZE(arr); i++) {
+		ptr = realloc(*arr[i], size);
+		if (!ptr) {
+			LOG_ERROR("not enough memory");
+			return ERROR_FAIL;
+		}
+		memset((uint8_t *)ptr + para->size, 0, size - para->size);
+		*arr[i] = ptr;
+	}
+	para->size = size;
+
+	return ERROR_OK;
+}
+
 static int svf_set_padding(struct svf_xxr_para *para, int len, unsigned char tdi)
 {
-	int error = ERROR_OK;
-	error |= svf_adjust_array_length(&para->tdi, para->len, len);
-	memset(para->tdi, tdi, (len + 7) >> 3);
-	error |= svf_adjust_array_length(&para->tdo, para->len, len);
-	error |= svf_adjust_array_length(&para->mask, para->len, len);
+	if (svf_reserve_xxr_para(para, len) != ERROR_OK)
+		return ERROR_FAIL;
+	memset(para->tdi, tdi, para->size);
+	memset(para->tdo, 0, para->size);
+	memset(para->mask, 0, para->size);
 	para->len = len;
 	para->data_mask = XXR_TDI;
 
-	return error;
+	return ERROR_OK;
+}
+
+/*
+ * Pad every scan for one device of a chain as the handler asks, the other
+ * devices get BYPASS.  The files' own HIR/HDR/TIR/TDR are then skipped.
+ */
+static int svf_apply_padding(void)
+{
+	const struct jtag_padding *pad = &jtag_handler->svf_padding;
+
+	svf_tap_is_specified = jtag_handler->svf_padded;
+	if (!svf_tap_is_specified)
+		return ERROR_OK;
+	if (svf_set_padding(&svf_para.hir_para, pad->hir, 0xff) != ERROR_OK ||
+			svf_set_padding(&svf_para.tir_para, pad->tir, 0xff) != ERROR_OK ||
+			svf_set_padding(&svf_para.hdr_para, pad->hdr, 0) != ERROR_OK ||
+			svf_set_padding(&svf_para.tdr_para, pad->tdr, 0) != ERROR_OK)
+		return ERROR_FAIL;
+	svf_ir_tmpl.dirty = 1;
+	svf_dr_tmpl.dirty = 1;
+
+	return ERROR_OK;
 }
 
 static int svf_copy_hexstring_to_binary(char *str, uint8_t **bin, int orig_bit_len, int bit_len)
@@ -888,24 +1849,52 @@ static int svf_copy_hexstring_to_binary(char *str, uint8_t **bin, int orig_bit_l
 	return ERROR_OK;
 }
 
+/*
+ * Report a failed TDO check.  Only the 64-bit window holding the first
+ * mismatching bit is dumped, the full scan can be megabits long.
+ */
+static void svf_report_mismatch(struct svf_check_tdo_para *para, int bit)
+{
+	const uint8_t *read = &svf_tdi_buffer[para->buffer_offset];
+	int base = (bit / 64) * 8;
+	int nbits = para->bit_len - base * 8;
+
+	if (nbits > 64)
+		nbits = 64;
+	LOG_ERROR("tdo check error at line %d, bit %d of %d: read %d want %d",
+			para->line_num, bit, para->bit_len,
+			(read[bit / 8] >> (bit % 8)) & 1,
+			(para->tdo[bit / 8] >> (bit % 8)) & 1);
+	LOG_ERROR("bits %d..%d:", base * 8, base * 8 + nbits - 1);
+	SVF_BUF_LOG(ERROR, &read[base], nbits, "READ");
+	SVF_BUF_LOG(ERROR, &para->tdo[base], nbits, "WANT");
+	SVF_BUF_LOG(ERROR, &para->mask[base], nbits, "MASK");
+}
+
 static int svf_check_tdo(bool silent)
 {
-	int i, len, index_var;
+	int i, len, index_var, bit;
 
-	for (i = 0; i < svf_check_tdo_para_index; i++) {
+	/* the interface may still owe the TDO of these scans */
+	if (svf_check_tdo_para_index && JTAG_flush(jtag_handler)) {
+		LOG_ERROR("scan before line %d failed", svf_line_number);
+		return ERROR_FAIL;
+	}
+	for (i = 0; i < svf_check_tdo_para_index; i++) {
+		if (!svf_check_tdo_para[i].enabled)
+			continue;
 		index_var = svf_check_tdo_para[i].buffer_offset;
 		len = svf_check_tdo_para[i].bit_len;
-		if ((svf_check_tdo_para[i].enabled)
-				&& buf_cmp_mask(&svf_tdi_buffer[index_var], &svf_tdo_buffer[index_var],
-				&svf_mask_buffer[index_var], len)) {
+		bit = buf_cmp_mask_first(&svf_tdi_buffer[index_var], svf_check_tdo_para[i].tdo,
+				svf_check_tdo_para[i].mask, len);
+		if (bit >= 0) {
 			if (!silent) {
-				LOG_ERROR("tdo check error at line %d",
-						svf_check_tdo_para[i].line_num);
-				SVF_BUF_LOG(ERROR, &svf_tdi_buffer[index_var], len, "READ");
-				SVF_BUF_LOG(ERROR, &svf_tdo_buffer[index_var], len, "WANT");
-				SVF_BUF_LOG(ERROR, &svf_mask_buffer[index_var], len, "MASK");
-			} else
+				svf_report_mismatch(&svf_check_tdo_para[i], bit);
+				svf_tdo_failed = 1;
+			} else {
 				svf_check_tdo_para_index = 0;
+				svf_buffer_index = 0;
+			}
 			if (svf_ignore_error == 0)
 				return ERROR_FAIL;
 			else
@@ -913,13 +1902,15 @@ static int svf_check_tdo(bool silent)
 		}
 	}
 	svf_check_tdo_para_index = 0;
+	svf_buffer_index = 0;
 
 	return ERROR_OK;
 }
 
-static int svf_add_check_para(uint8_t enabled, int buffer_offset, int bit_len)
+static int svf_add_check_para(uint8_t enabled, int buffer_offset, int bit_len,
+	const uint8_t *tdo, const uint8_t *mask)
 {
-	if (svf_check_tdo_para_index >= SVF_CHECK_TDO_PARA_SIZE) {
+	if (svf_check_tdo_para_index >= svf_check_tdo_para_size) {
 		LOG_ERROR("toooooo many operation undone");
 		return ERROR_FAIL;
 	}
@@ -928,6 +1919,8 @@ static int svf_add_check_para(uint8_t enabled, int buffer_offset, int bit_len)
 	svf_check_tdo_para[svf_check_tdo_para_index].bit_len = bit_len;
 	svf_check_tdo_para[svf_check_tdo_para_index].enabled = enabled;
 	svf_check_tdo_para[svf_check_tdo_para_index].buffer_offset = buffer_offset;
+	svf_check_tdo_para[svf_check_tdo_para_index].tdo = tdo;
+	svf_check_tdo_para[svf_check_tdo_para_index].mask = mask;
 	svf_check_tdo_para_index++;
 
 	return ERROR_OK;
@@ -945,6 +1938,476 @@ static int svf_execute_tap(void)
 	return ERROR_OK;
 }
 #endif
+static int svf_build_scan_tmpl(struct svf_scan_tmpl *tmpl, struct svf_xxr_para *head,
+	struct svf_xxr_para *tail, int body_len)
+{
+	int len = head->len + body_len + tail->len;
+	int bytes = (len + 7) >> 3;
+	uint8_t **arr[] = { &tmpl->tdi, &tmpl->tdo, &tmpl->mask };
+	uint8_t *head_arr[] = { head->tdi, head->tdo, head->mask };
+	uint8_t *tail_arr[] = { tail->tdi, tail->tdo, tail->mask };
+	unsigned i;
+	void *ptr;
+
+	for (i = 0; i < ARRAY_SIZE(arr); i++) {
+		if (bytes > tmpl->size) {
+			ptr = realloc(*arr[i], bytes);
+			if (!ptr) {
+				LOG_ERROR("not enough memory");
+				return ERROR_FAIL;
+			}
+			*arr[i] = ptr;
+		}
+		memset(*arr[i], 0, bytes);
+		buf_set_buf(head_arr[i], 0, *arr[i], 0, head->len);
+		buf_set_buf(tail_arr[i], 0, *arr[i], head->len + body_len, tail->len);
+	}
+	svf_stats.copy_bytes += 3 * bytes;
+	if (bytes > tmpl->size)
+		tmpl->size = bytes;
+	tmpl->body_len = body_len;
+	tmpl->dirty = 0;
+
+	return ERROR_OK;
+}
+
+/*
+ * Run the pending TDO checks to free the staging buffers.  Inside a LOOP
+ * a failure is remembered for ENDLOOP instead of failing the command.
+ */
+static int svf_commit_checks(void)
+{
+	if (!svf_check_tdo_para_index)
+		return ERROR_OK;
+	if (loop) {
+		if (svf_check_tdo(true) != ERROR_OK)
+			svf_loop_failed = 1;
+		return ERROR_OK;
+	}
+	return svf_check_tdo(false);
+}
+
+static uint8_t *svf_xxr_array(struct svf_xxr_para *para, int which)
+{
+	if (which == XXR_TDO)
+		return para->tdo;
+	if (which == XXR_MASK)
+		return para->mask;
+	return para->tdi;
+}
+
+/* copy nbits of the head+body+tail concatenation, starting at bit first */
+static void svf_copy_scan_window(uint8_t *dst, int which, struct svf_xxr_para **parts,
+	int first, int nbits)
+{
+	int i, n, start = 0, dst_bit = 0;
+
+	for (i = 0; i < 3 && nbits > 0; i++) {
+		if (first < start + parts[i]->len) {
+			n = start + parts[i]->len - first;
+			if (n > nbits)
+				n = nbits;
+			buf_set_buf(svf_xxr_array(parts[i], which), first - start,
+					dst, dst_bit, n);
+			dst_bit += n;
+			first += n;
+			nbits -= n;
+		}
+		start += parts[i]->len;
+	}
+	svf_stats.copy_bytes += (dst_bit + 7) >> 3;
+}
+
+/*
+ * Shift a scan larger than the staging buffers in windows, staying in
+ * Shift-xR between them, and check every window as soon as it is back.
+ * Unpadded scans are shifted and compared straight from the parsed data.
+ */
+static int svf_xxr_scan_windowed(bool ir, struct svf_xxr_para **parts, int len, bool check)
+{
+	tap_state_t shift_state = ir ? TAP_IRSHIFT : TAP_DRSHIFT;
+	tap_state_t end_state = ir ? svf_para.ir_end_state : svf_para.dr_end_state;
+	bool padded = parts[0]->len || parts[2]->len;
+	int window = svf_buffer_size * 8;
+	int first, nbits, bit, bit_base, bit_cnt, ret = ERROR_OK;
+	const uint8_t *out, *tdo, *mask;
+	uint8_t *in;
+
+	/* the windows reuse the staging buffers */
+	if (svf_commit_checks() != ERROR_OK)
+		return ERROR_FAIL;
+
+	for (first = 0; first < len; first += nbits) {
+		nbits = len - first > window ? window : len - first;
+		if (padded) {
+			svf_copy_scan_window(svf_tdi_buffer, XXR_TDI, parts, first, nbits);
+			out = svf_tdi_buffer;
+		} else {
+			out = parts[1]->tdi + first / 8;
+		}
+		in = check ? svf_tdi_buffer : NULL;
+
+		if (svf_nil)
+			continue;
+		if ((ir ? JTAG_ir_scan : JTAG_dr_scan)(jtag_handler, nbits, out, in,
+				first + nbits < len ? shift_state : end_state) < 0 ||
+				(in && JTAG_flush(jtag_handler))) {
+			LOG_ERROR("%s scan of %d bits failed", ir ? "IR" : "DR", len);
+			return ERROR_FAIL;
+		}
+		if (!check || ret != ERROR_OK)
+			continue;
+
+		if (padded) {
+			svf_copy_scan_window(svf_tdo_buffer, XXR_TDO, parts, first, nbits);
+			svf_copy_scan_window(svf_mask_buffer, XXR_MASK, parts, first, nbits);
+			tdo = svf_tdo_buffer;
+			mask = svf_mask_buffer;
+		} else {
+			tdo = parts[1]->tdo + first / 8;
+			mask = parts[1]->mask + first / 8;
+		}
+		bit = buf_cmp_mask_first(in, tdo, mask, nbits);
+		if (bit < 0)
+			continue;
+		if (loop) {
+			svf_loop_failed = 1;
+		} else {
+			svf_tdo_failed = 1;
+			bit_base = (bit / 64) * 64;
+			bit_cnt = nbits - bit_base > 64 ? 64 : nbits - bit_base;
+			LOG_ERROR("tdo check error at line %d, bit %d of %d",
+					svf_line_number, first + bit, len);
+			SVF_BUF_LOG(ERROR, &in[bit_base / 8], bit_cnt, "READ");
+			SVF_BUF_LOG(ERROR, &tdo[bit_base / 8], bit_cnt, "WANT");
+			SVF_BUF_LOG(ERROR, &mask[bit_base / 8], bit_cnt, "MASK");
+			if (svf_ignore_error == 0)
+				ret = ERROR_FAIL;
+			else
+				svf_ignore_error++;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Scans this short are clocked as one raw TMS/TDI vector holding the move
+ * into the shift state, the shift and the move to the end state.  The one
+ * call replaces the state move and transfer of the shift ops, which pays
+ * off for bitbanged TCKs only while the vector stays short.
+ */
+#define SVF_RAW_SCAN_MAX_TCKS	64
+
+static int svf_raw_scan(JTAG_Handler *handler, bool ir, int len, const uint8_t *out,
+		uint8_t *in, tap_state_t end_state)
+{
+	uint8_t tms[SVF_RAW_SCAN_MAX_TCKS / 8], tdi[SVF_RAW_SCAN_MAX_TCKS / 8];
+	uint8_t tdo[SVF_RAW_SCAN_MAX_TCKS / 8];
+	const struct svf_tms_path *enter, *leave;
+	int from = handler->tap_state;
+	int bits, ret;
+
+	if (from < JtagTLR || from > JtagUpdIR || !len)
+		return -EOPNOTSUPP;
+	enter = &svf_tms_paths[from][ir ? JtagShfIR : JtagShfDR];
+	leave = &svf_tms_paths[ir ? JtagEx1IR : JtagEx1DR][end_state];
+	bits = enter->len + len + leave->len;
+	if (bits > SVF_RAW_SCAN_MAX_TCKS)
+		return -EOPNOTSUPP;
+
+	memset(tms, 0, sizeof(tms));
+	memset(tdi, 0, sizeof(tdi));
+	buf_set_buf(&enter->tms, 0, tms, 0, enter->len);
+	if (out)
+		buf_set_buf(out, 0, tdi, enter->len, len);
+	/* the last shift leaves through Exit1 */
+	tms[(enter->len + len - 1) / 8] |= 1 << ((enter->len + len - 1) % 8);
+	buf_set_buf(&leave->tms, 0, tms, enter->len + len, leave->len);
+
+	ret = JTAG_shift_raw(handler, tms, tdi, in ? tdo : NULL, bits, end_state);
+	if (ret)
+		return ret;
+	if (in)
+		buf_set_buf(tdo, enter->len, in, 0, len);
+
+	return 0;
+}
+
+/*
+ * Shift a SIR or SDR together with its header and trailer.  Without
+ * padding the parsed TDI is handed to the backend as is; otherwise the
+ * body is inserted into the prebuilt template.  Outside a LOOP the check
+ * runs before the next command, so expected TDO and MASK are compared in
+ * place and only copied aside when the check is deferred.
+ */
+static int svf_xxr_scan(bool ir)
+{
+	struct svf_xxr_para *head = ir ? &svf_para.hir_para : &svf_para.hdr_para;
+	struct svf_xxr_para *body = ir ? &svf_para.sir_para : &svf_para.sdr_para;
+	struct svf_xxr_para *tail = ir ? &svf_para.tir_para : &svf_para.tdr_para;
+	struct svf_scan_tmpl *tmpl = ir ? &svf_ir_tmpl : &svf_dr_tmpl;
+	int len = head->len + body->len + tail->len;
+	int bytes = (len + 7) >> 3;
+	int body_bytes = (body->len + 7) >> 3;
+	bool check = body->data_mask & XXR_TDO;
+	bool padded = head->len || tail->len;
+	struct svf_xxr_para *parts[] = { head, body, tail };
+	tap_state_t end_state = ir ? svf_para.ir_end_state : svf_para.dr_end_state;
+	const uint8_t *out, *tdo, *mask;
+	uint8_t *in = NULL;
+	int ret;
+
+	if (svf_nil) {
+		/* dry run, only track where the scan leaves the TAP */
+		jtag_handler->tap_state = end_state;
+		svf_dry_cost.bits += len;
+		return ERROR_OK;
+	}
+
+	if (jtag_handler->svf_freq_policy == SVF_FREQ_DYNAMIC)
+		svf_set_freq(svf_freq_fast);
+
+	svf_stats.scans++;
+	svf_stats.scan_bytes += bytes;
+	svf_stats.legacy_copy_bytes += check ? 3 * bytes : bytes;
+
+	if (svf_mem_limit && (padded || check) && bytes > svf_buffer_size)
+		return svf_xxr_scan_windowed(ir, parts, len, check);
+
+	if (padded && (tmpl->dirty || !tmpl->tdi || tmpl->body_len != body->len)) {
+		if (svf_build_scan_tmpl(tmpl, head, tail, body->len) != ERROR_OK)
+			return ERROR_FAIL;
+	}
+
+	if (padded) {
+		buf_set_buf(body->tdi, 0, tmpl->tdi, head->len, body->len);
+		svf_stats.copy_bytes += body_bytes;
+		out = tmpl->tdi;
+	} else {
+		out = body->tdi;
+		svf_stats.zero_copy_scans++;
+	}
+
+	if (check) {
+		/*
+		 * check buffer size first, commit pending checks (they point
+		 * into the buffers) and reallocate if still necessary
+		 */
+		if ((svf_buffer_size - svf_buffer_index) < bytes ||
+				svf_check_tdo_para_index >= svf_check_tdo_para_size) {
+			if (svf_commit_checks() != ERROR_OK)
+				return ERROR_FAIL;
+		}
+		if (svf_buffer_size < bytes) {
+			if (svf_realloc_buffers(bytes) != ERROR_OK) {
+				LOG_ERROR("not enough memory");
+				return ERROR_FAIL;
+			}
+		}
+		if (padded) {
+			buf_set_buf(body->tdo, 0, tmpl->tdo, head->len, body->len);
+			buf_set_buf(body->mask, 0, tmpl->mask, head->len, body->len);
+			svf_stats.copy_bytes += 2 * body_bytes;
+			tdo = tmpl->tdo;
+			mask = tmpl->mask;
+		} else {
+			tdo = body->tdo;
+			mask = body->mask;
+		}
+		/* the parsed TDO is overwritten by the next scan */
+		if (loop || jtag_handler->defer_tdo) {
+			memcpy(&svf_tdo_buffer[svf_buffer_index], tdo, bytes);
+			memcpy(&svf_mask_buffer[svf_buffer_index], mask, bytes);
+			svf_stats.copy_bytes += 2 * bytes;
+			tdo = &svf_tdo_buffer[svf_buffer_index];
+			mask = &svf_mask_buffer[svf_buffer_index];
+		}
+		if (svf_add_check_para(1, svf_buffer_index, len, tdo, mask) != ERROR_OK)
+			return ERROR_FAIL;
+		in = &svf_tdi_buffer[svf_buffer_index];
+		svf_buffer_index += bytes;
+	}
+
+	if (svf_nil)
+		return ERROR_OK;
+
+	ret = svf_raw_scan(jtag_handler, ir, len, out, in, end_state);
+	if (!ret) {
+		svf_stats.raw_scans++;
+	} else if (ret == -EOPNOTSUPP && ir) {
+		ret = JTAG_ir_scan(jtag_handler, len, out, in, end_state);
+	} else if (ret == -EOPNOTSUPP) {
+		LOG_DEBUG("dr_scan: num_bits %d end_state %d\n", len, end_state);
+		ret = JTAG_dr_scan(jtag_handler, len, out, in, end_state);
+	}
+	if (ret < 0) {
+		LOG_ERROR("%s scan of %d bits failed", ir ? "IR" : "DR", len);
+		return ERROR_FAIL;
+	}
+
+	return ERROR_OK;
+}
+
+/* parse the arguments of a HIR/HDR/SIR/SDR/TIR/TDR command into para */
+static int svf_parse_xxr(struct svf_xxr_para *para, char **argus, int num_of_argu)
+{
+	uint8_t **pbuffer;
+	int orig_len, i;
+
+	/* XXR length [TDI (tdi)] [TDO (tdo)][MASK (mask)] [SMASK (smask)] */
+	if ((num_of_argu > 10) || (num_of_argu % 2)) {
+		LOG_ERROR("invalid parameter of %s", argus[0]);
+		return ERROR_FAIL;
+	}
+	orig_len = para->len;
+	para->len = atoi(argus[1]);
+	if (svf_reserve_xxr_para(para, para->len) != ERROR_OK)
+		return ERROR_FAIL;
+
+	LOG_DEBUG("\tlength = %d", para->len);
+	para->data_mask = 0;
+	for (i = 2; i < num_of_argu; i += 2) {
+		if ((strlen(argus[i + 1]) < 3) || (argus[i + 1][0] != '(') ||
+		(argus[i + 1][strlen(argus[i + 1]) - 1] != ')')) {
+			LOG_ERROR("data section error");
+			return ERROR_FAIL;
+		}
+		argus[i + 1][strlen(argus[i + 1]) - 1] = '\0';
+		/* TDI, TDO, MASK, SMASK */
+		if (!strcmp(argus[i], "TDI")) {
+			/* TDI */
+			pbuffer = &para->tdi;
+			para->data_mask |= XXR_TDI;
+		} else if (!strcmp(argus[i], "TDO")) {
+			/* TDO */
+			pbuffer = &para->tdo;
+			para->data_mask |= XXR_TDO;
+		} else if (!strcmp(argus[i], "MASK") || !strcmp(argus[i], "CMASK")) {
+			/* MASK */
+			pbuffer = &para->mask;
+			para->data_mask |= XXR_MASK;
+		} else if (!strcmp(argus[i], "SMASK")) {
+			/* SMASK */
+			pbuffer = &para->smask;
+			para->data_mask |= XXR_SMASK;
+		} else {
+			LOG_ERROR("unknow parameter: %s", argus[i]);
+			return ERROR_FAIL;
+		}
+		if (ERROR_OK !=
+		svf_copy_hexstring_to_binary(&argus[i + 1][1], pbuffer,
+			para->size << 3, para->len)) {
+			LOG_ERROR("fail to parse hex value");
+			return ERROR_FAIL;
+		}
+		//SVF_BUF_LOG(DEBUG, *pbuffer, para->len, argus[i]);
+	}
+	/* If a command changes the length of the last scan of the same type and the
+	 * MASK parameter is absent, */
+	/* the mask pattern used is all cares */
+	if (!(para->data_mask & XXR_MASK) && (orig_len != para->len)) {
+		/* MASK not defined and length changed */
+		buf_set_ones(para->mask, para->len);
+	}
+	/* If TDO is absent, no comparison is needed, set the mask to 0 */
+	if (!(para->data_mask & XXR_TDO))
+		memset(para->mask, 0, (para->len + 7) >> 3);
+
+	return ERROR_OK;
+}
+
+/*
+ * Parse the arguments of a RUNTEST command.  run_state and end_state hold
+ * the sticky states and are updated, run_count and min_time are set.
+ */
+static int svf_parse_runtest(char **argus, int num_of_argu, tap_state_t *run_state,
+	tap_state_t *end_state, int *run_count, float *min_time)
+{
+	int i, i_tmp;
+
+	/* RUNTEST [run_state] run_count run_clk [min_time SEC [MAXIMUM max_time
+	 * SEC]] [ENDSTATE end_state] */
+	/* RUNTEST [run_state] min_time SEC [MAXIMUM max_time SEC] [ENDSTATE
+	 * end_state] */
+	if ((num_of_argu < 3) || (num_of_argu > 11)) {
+		LOG_ERROR("invalid parameter of %s", argus[0]);
+		return ERROR_FAIL;
+	}
+	/* init */
+	*run_count = 0;
+	*min_time = 0;
+	i = 1;
+
+	/* run_state */
+	i_tmp = tap_state_by_name(argus[i]);
+	if (i_tmp != TAP_INVALID) {
+		if (svf_tap_state_is_stable(i_tmp)) {
+			*run_state = i_tmp;
+
+			/* When a run_state is specified, the new
+			 * run_state becomes the default end_state.
+			 */
+			*end_state = i_tmp;
+			LOG_DEBUG("\trun_state = %s", tap_state_name(i_tmp));
+			i++;
+		} else {
+			LOG_ERROR("%s: %s is not a stable state", argus[0], tap_state_name(i_tmp));
+			return ERROR_FAIL;
+		}
+	}
+
+	/* run_count run_clk */
+	if (((i + 2) <= num_of_argu) && strcmp(argus[i + 1], "SEC")) {
+		if (!strcmp(argus[i + 1], "TCK")) {
+			/* clock source is TCK */
+			*run_count = atoi(argus[i]);
+			LOG_DEBUG("\trun_count@TCK = %d", *run_count);
+		} else {
+			LOG_ERROR("%s not supported for clock", argus[i + 1]);
+			return ERROR_FAIL;
+		}
+		i += 2;
+	}
+	/* min_time SEC */
+	if (((i + 2) <= num_of_argu) && !strcmp(argus[i + 1], "SEC")) {
+		*min_time = atof(argus[i]);
+		LOG_DEBUG("\tmin_time = %fs", *min_time);
+		i += 2;
+	}
+	/* MAXIMUM max_time SEC */
+	if (((i + 3) <= num_of_argu) &&
+	!strcmp(argus[i], "MAXIMUM") && !strcmp(argus[i + 2], "SEC")) {
+		float max_time = 0;
+		max_time = atof(argus[i + 1]);
+		LOG_DEBUG("\tmax_time = %fs", max_time);
+		i += 3;
+	}
+	/* ENDSTATE end_state */
+	if (((i + 2) <= num_of_argu) && !strcmp(argus[i], "ENDSTATE")) {
+		i_tmp = tap_state_by_name(argus[i + 1]);
+
+		if (svf_tap_state_is_stable(i_tmp)) {
+			*end_state = i_tmp;
+			LOG_DEBUG("\tend_state = %s", tap_state_name(i_tmp));
+		} else {
+			LOG_ERROR("%s: %s is not a stable state", argus[0], tap_state_name(i_tmp));
+			return ERROR_FAIL;
+		}
+		i += 2;
+	}
+
+	/* all parameter should be parsed */
+	if (i != num_of_argu) {
+		LOG_ERROR("fail to parse parameter of RUNTEST, %d out of %d is parsed",
+				i,
+				num_of_argu);
+		return ERROR_FAIL;
+	}
+
+	return ERROR_OK;
+}
+
 static int svf_run_command(char *cmd_str)
 {
 	char *argus[256], command;
@@ -958,10 +2421,8 @@ static int svf_run_command(char *cmd_str)
 	float min_time;
 	/* for XXR */
 	struct svf_xxr_para *xxr_para_tmp;
-	uint8_t **pbuffer_tmp;
-	struct scan_field field;
 	/* for STATE */
-	tap_state_t *path = NULL, state;
+	tap_state_t path[ARRAY_SIZE(argus)], state;
 	/* flag padding commands skipped due to -tap command */
 	int padding_command_skipped = 0;
 
@@ -987,16 +2448,18 @@ static int svf_run_command(char *cmd_str)
 			file_offset = ftell(svf_fd);
 			loop--;
 			loop_line_number = svf_line_number;
+			svf_loop_failed = 0;
 			break;
 		case ENDLOOP:
 			if (loop > 0) {
-				if (ERROR_OK == svf_check_tdo(true)) {
+				if (ERROR_OK == svf_check_tdo(true) && !svf_loop_failed) {
 					loop = 0;
 					break;
 				} else {
 					fseek(svf_fd, file_offset, SEEK_SET);
 					svf_line_number = loop_line_number;
 					loop--;
+					svf_loop_failed = 0;
 				}
 			}
 			break;
@@ -1031,8 +2494,9 @@ static int svf_run_command(char *cmd_str)
 				return ERROR_FAIL;
 			}
 			if (1 == num_of_argu) {
-				/* TODO: set jtag speed to full speed */
 				svf_para.frequency = 0;
+				if (jtag_handler->svf_freq_policy == SVF_FREQ_FOLLOW)
+					svf_set_freq(svf_freq_fast);
 			} else {
 				if (strcmp(argus[2], "HZ")) {
 					LOG_ERROR("HZ not found in FREQUENCY command");
@@ -1041,12 +2505,11 @@ static int svf_run_command(char *cmd_str)
 				//if (ERROR_OK != svf_execute_tap())
 				//	return ERROR_FAIL;
 				svf_para.frequency = atof(argus[1]);
-				/* TODO: set jtag speed to */
-				if (svf_para.frequency > 0 && !jtag_handler->frequency) {
-					LOG_DEBUG("\tfrequency = %f", svf_para.frequency);
-					JTAG_set_clock_frequency(jtag_handler,
-						(unsigned int)svf_para.frequency);
-				}
+				LOG_DEBUG("\tfrequency = %f", svf_para.frequency);
+				if (jtag_handler->svf_freq_policy == SVF_FREQ_FOLLOW ||
+						(jtag_handler->svf_freq_policy == SVF_FREQ_FIXED &&
+						 svf_para.frequency > 0 && !jtag_handler->frequency))
+					svf_set_freq((int)svf_para.frequency);
 			}
 			break;
 		case HDR:
@@ -1055,6 +2518,7 @@ static int svf_run_command(char *cmd_str)
 				break;
 			}
 			xxr_para_tmp = &svf_para.hdr_para;
+			svf_dr_tmpl.dirty = 1;
 			goto XXR_common;
 		case HIR:
 			if (svf_tap_is_specified) {
@@ -1062,6 +2526,7 @@ static int svf_run_command(char *cmd_str)
 				break;
 			}
 			xxr_para_tmp = &svf_para.hir_para;
+			svf_ir_tmpl.dirty = 1;
 			goto XXR_common;
 		case TDR:
 			if (svf_tap_is_specified) {
@@ -1069,6 +2534,7 @@ static int svf_run_command(char *cmd_str)
 				break;
 			}
 			xxr_para_tmp = &svf_para.tdr_para;
+			svf_dr_tmpl.dirty = 1;
 			goto XXR_common;
 		case TIR:
 			if (svf_tap_is_specified) {
@@ -1076,6 +2542,7 @@ static int svf_run_command(char *cmd_str)
 				break;
 			}
 			xxr_para_tmp = &svf_para.tir_para;
+			svf_ir_tmpl.dirty = 1;
 			goto XXR_common;
 		case SDR:
 			xxr_para_tmp = &svf_para.sdr_para;
@@ -1084,292 +2551,12 @@ static int svf_run_command(char *cmd_str)
 			xxr_para_tmp = &svf_para.sir_para;
 			goto XXR_common;
 XXR_common:
-			/* XXR length [TDI (tdi)] [TDO (tdo)][MASK (mask)] [SMASK (smask)] */
-			if ((num_of_argu > 10) || (num_of_argu % 2)) {
-				LOG_ERROR("invalid parameter of %s", argus[0]);
+			if (svf_parse_xxr(xxr_para_tmp, argus, num_of_argu) != ERROR_OK)
 				return ERROR_FAIL;
-			}
-			i_tmp = xxr_para_tmp->len;
-			xxr_para_tmp->len = atoi(argus[1]);
-			/* If we are to enlarge the buffers, all parts of xxr_para_tmp
-			 * need to be freed */
-			if (i_tmp < xxr_para_tmp->len) {
-				free(xxr_para_tmp->tdi);
-				xxr_para_tmp->tdi = NULL;
-				free(xxr_para_tmp->tdo);
-				xxr_para_tmp->tdo = NULL;
-				free(xxr_para_tmp->mask);
-				xxr_para_tmp->mask = NULL;
-				free(xxr_para_tmp->smask);
-				xxr_para_tmp->smask = NULL;
-			}
-
-			LOG_DEBUG("\tlength = %d", xxr_para_tmp->len);
-			xxr_para_tmp->data_mask = 0;
-			for (i = 2; i < num_of_argu; i += 2) {
-				if ((strlen(argus[i + 1]) < 3) || (argus[i + 1][0] != '(') ||
-				(argus[i + 1][strlen(argus[i + 1]) - 1] != ')')) {
-					LOG_ERROR("data section error");
-					return ERROR_FAIL;
-				}
-				argus[i + 1][strlen(argus[i + 1]) - 1] = '\0';
-				/* TDI, TDO, MASK, SMASK */
-				if (!strcmp(argus[i], "TDI")) {
-					/* TDI */
-					pbuffer_tmp = &xxr_para_tmp->tdi;
-					xxr_para_tmp->data_mask |= XXR_TDI;
-				} else if (!strcmp(argus[i], "TDO")) {
-					/* TDO */
-					pbuffer_tmp = &xxr_para_tmp->tdo;
-					xxr_para_tmp->data_mask |= XXR_TDO;
-				} else if (!strcmp(argus[i], "MASK") || !strcmp(argus[i], "CMASK")) {
-					/* MASK */
-					pbuffer_tmp = &xxr_para_tmp->mask;
-					xxr_para_tmp->data_mask |= XXR_MASK;
-				} else if (!strcmp(argus[i], "SMASK")) {
-					/* SMASK */
-					pbuffer_tmp = &xxr_para_tmp->smask;
-					xxr_para_tmp->data_mask |= XXR_SMASK;
-				} else {
-					LOG_ERROR("unknow parameter: %s", argus[i]);
-					return ERROR_FAIL;
-				}
-				if (ERROR_OK !=
-				svf_copy_hexstring_to_binary(&argus[i + 1][1], pbuffer_tmp, i_tmp,
-					xxr_para_tmp->len)) {
-					LOG_ERROR("fail to parse hex value");
-					return ERROR_FAIL;
-				}
-				//SVF_BUF_LOG(DEBUG, *pbuffer_tmp, xxr_para_tmp->len, argus[i]);
-			}
-			/* If a command changes the length of the last scan of the same type and the
-			 * MASK parameter is absent, */
-			/* the mask pattern used is all cares */
-			if (!(xxr_para_tmp->data_mask & XXR_MASK) && (i_tmp != xxr_para_tmp->len)) {
-				/* MASK not defined and length changed */
-				if (ERROR_OK !=
-				svf_adjust_array_length(&xxr_para_tmp->mask, i_tmp,
-					xxr_para_tmp->len)) {
-					LOG_ERROR("fail to adjust length of array");
-					return ERROR_FAIL;
-				}
-				buf_set_ones(xxr_para_tmp->mask, xxr_para_tmp->len);
-			}
-			/* If TDO is absent, no comparison is needed, set the mask to 0 */
-			if (!(xxr_para_tmp->data_mask & XXR_TDO)) {
-				if (NULL == xxr_para_tmp->tdo) {
-					if (ERROR_OK !=
-					svf_adjust_array_length(&xxr_para_tmp->tdo, i_tmp,
-						xxr_para_tmp->len)) {
-						LOG_ERROR("fail to adjust length of array");
-						return ERROR_FAIL;
-					}
-				}
-				if (NULL == xxr_para_tmp->mask) {
-					if (ERROR_OK !=
-					svf_adjust_array_length(&xxr_para_tmp->mask, i_tmp,
-						xxr_para_tmp->len)) {
-						LOG_ERROR("fail to adjust length of array");
-						return ERROR_FAIL;
-					}
-				}
-				memset(xxr_para_tmp->mask, 0, (xxr_para_tmp->len + 7) >> 3);
-			}
 			/* do scan if necessary */
-			if (SDR == command) {
-				/* check buffer size first, reallocate if necessary */
-				i = svf_para.hdr_para.len + svf_para.sdr_para.len +
-						svf_para.tdr_para.len;
-				if ((svf_buffer_size - svf_buffer_index) < ((i + 7) >> 3)) {
-					/* reallocate buffer */
-					if (svf_realloc_buffers(svf_buffer_index + ((i + 7) >> 3)) != ERROR_OK) {
-						LOG_ERROR("not enough memory");
-						return ERROR_FAIL;
-					}
-				}
-
-				/* assemble dr data */
-				i = 0;
-				buf_set_buf(svf_para.hdr_para.tdi,
-						0,
-						&svf_tdi_buffer[svf_buffer_index],
-						i,
-						svf_para.hdr_para.len);
-				i += svf_para.hdr_para.len;
-				buf_set_buf(svf_para.sdr_para.tdi,
-						0,
-						&svf_tdi_buffer[svf_buffer_index],
-						i,
-						svf_para.sdr_para.len);
-				i += svf_para.sdr_para.len;
-				buf_set_buf(svf_para.tdr_para.tdi,
-						0,
-						&svf_tdi_buffer[svf_buffer_index],
-						i,
-						svf_para.tdr_para.len);
-				i += svf_para.tdr_para.len;
-
-				/* add check data */
-				if (svf_para.sdr_para.data_mask & XXR_TDO) {
-					/* assemble dr mask data */
-					i = 0;
-					buf_set_buf(svf_para.hdr_para.mask,
-							0,
-							&svf_mask_buffer[svf_buffer_index],
-							i,
-							svf_para.hdr_para.len);
-					i += svf_para.hdr_para.len;
-					buf_set_buf(svf_para.sdr_para.mask,
-							0,
-							&svf_mask_buffer[svf_buffer_index],
-							i,
-							svf_para.sdr_para.len);
-					i += svf_para.sdr_para.len;
-					buf_set_buf(svf_para.tdr_para.mask,
-							0,
-							&svf_mask_buffer[svf_buffer_index],
-							i,
-							svf_para.tdr_para.len);
-
-					/* assemble dr check data */
-					i = 0;
-					buf_set_buf(svf_para.hdr_para.tdo,
-							0,
-							&svf_tdo_buffer[svf_buffer_index],
-							i,
-							svf_para.hdr_para.len);
-					i += svf_para.hdr_para.len;
-					buf_set_buf(svf_para.sdr_para.tdo,
-							0,
-							&svf_tdo_buffer[svf_buffer_index],
-							i,
-							svf_para.sdr_para.len);
-					i += svf_para.sdr_para.len;
-					buf_set_buf(svf_para.tdr_para.tdo,
-							0,
-							&svf_tdo_buffer[svf_buffer_index],
-							i,
-							svf_para.tdr_para.len);
-					i += svf_para.tdr_para.len;
-
-					svf_add_check_para(1, svf_buffer_index, i);
-				} else
-					svf_add_check_para(0, svf_buffer_index, i);
-				field.num_bits = i;
-				field.out_value = &svf_tdi_buffer[svf_buffer_index];
-				field.in_value = (xxr_para_tmp->data_mask & XXR_TDO) ? &svf_tdi_buffer[svf_buffer_index] : NULL;
-				if (!svf_nil) {
-					/* NOTE:  doesn't use SVF-specified state paths */
-					LOG_DEBUG("dr_scan: num_bits %d end_state %d\n",
-						field.num_bits, svf_para.dr_end_state);
-					JTAG_dr_scan(jtag_handler, field.num_bits,
-						field.out_value,
-						field.in_value,
-						svf_para.dr_end_state);
-					#if 0
-					jtag_add_plain_dr_scan(field.num_bits,
-							field.out_value,
-							field.in_value,
-							svf_para.dr_end_state);
-					#endif
-				}
-
-				svf_buffer_index += (i + 7) >> 3;
-			} else if (SIR == command) {
-				/* check buffer size first, reallocate if necessary */
-				i = svf_para.hir_para.len + svf_para.sir_para.len +
-						svf_para.tir_para.len;
-				if ((svf_buffer_size - svf_buffer_index) < ((i + 7) >> 3)) {
-					if (svf_realloc_buffers(svf_buffer_index + ((i + 7) >> 3)) != ERROR_OK) {
-						LOG_ERROR("not enough memory");
-						return ERROR_FAIL;
-					}
-				}
-
-				/* assemble ir data */
-				i = 0;
-				buf_set_buf(svf_para.hir_para.tdi,
-						0,
-						&svf_tdi_buffer[svf_buffer_index],
-						i,
-						svf_para.hir_para.len);
-				i += svf_para.hir_para.len;
-				buf_set_buf(svf_para.sir_para.tdi,
-						0,
-						&svf_tdi_buffer[svf_buffer_index],
-						i,
-						svf_para.sir_para.len);
-				i += svf_para.sir_para.len;
-				buf_set_buf(svf_para.tir_para.tdi,
-						0,
-						&svf_tdi_buffer[svf_buffer_index],
-						i,
-						svf_para.tir_para.len);
-				i += svf_para.tir_para.len;
-
-				/* add check data */
-				if (svf_para.sir_para.data_mask & XXR_TDO) {
-					/* assemble dr mask data */
-					i = 0;
-					buf_set_buf(svf_para.hir_para.mask,
-							0,
-							&svf_mask_buffer[svf_buffer_index],
-							i,
-							svf_para.hir_para.len);
-					i += svf_para.hir_para.len;
-					buf_set_buf(svf_para.sir_para.mask,
-							0,
-							&svf_mask_buffer[svf_buffer_index],
-							i,
-							svf_para.sir_para.len);
-					i += svf_para.sir_para.len;
-					buf_set_buf(svf_para.tir_para.mask,
-							0,
-							&svf_mask_buffer[svf_buffer_index],
-							i,
-							svf_para.tir_para.len);
-
-					/* assemble dr check data */
-					i = 0;
-					buf_set_buf(svf_para.hir_para.tdo,
-							0,
-							&svf_tdo_buffer[svf_buffer_index],
-							i,
-							svf_para.hir_para.len);
-					i += svf_para.hir_para.len;
-					buf_set_buf(svf_para.sir_para.tdo,
-							0,
-							&svf_tdo_buffer[svf_buffer_index],
-							i,
-							svf_para.sir_para.len);
-					i += svf_para.sir_para.len;
-					buf_set_buf(svf_para.tir_para.tdo,
-							0,
-							&svf_tdo_buffer[svf_buffer_index],
-							i,
-							svf_para.tir_para.len);
-					i += svf_para.tir_para.len;
-
-					svf_add_check_para(1, svf_buffer_index, i);
-				} else
-					svf_add_check_para(0, svf_buffer_index, i);
-				field.num_bits = i;
-				field.out_value = &svf_tdi_buffer[svf_buffer_index];
-				field.in_value = (xxr_para_tmp->data_mask & XXR_TDO) ? &svf_tdi_buffer[svf_buffer_index] : NULL;
-				if (!svf_nil) {
-					/* NOTE:  doesn't use SVF-specified state paths */
-					JTAG_ir_scan(jtag_handler, field.num_bits,
-						field.out_value, field.in_value,
-						svf_para.ir_end_state);
-					#if 0
-					jtag_add_plain_ir_scan(field.num_bits,
-							field.out_value,
-							field.in_value,
-							svf_para.ir_end_state);
-					#endif
-				}
-
-				svf_buffer_index += (i + 7) >> 3;
+			if (SDR == command || SIR == command) {
+				if (svf_xxr_scan(SIR == command) != ERROR_OK)
+					return ERROR_FAIL;
 			}
 			break;
 		case PIO:
@@ -1378,135 +2565,86 @@ XXR_common:
 			return ERROR_FAIL;
 			break;
 		case RUNTEST:
-			/* RUNTEST [run_state] run_count run_clk [min_time SEC [MAXIMUM max_time
-			 * SEC]] [ENDSTATE end_state] */
-			/* RUNTEST [run_state] min_time SEC [MAXIMUM max_time SEC] [ENDSTATE
-			 * end_state] */
-			if ((num_of_argu < 3) || (num_of_argu > 11)) {
-				LOG_ERROR("invalid parameter of %s", argus[0]);
+			if (svf_parse_runtest(argus, num_of_argu, &svf_para.runtest_run_state,
+					&svf_para.runtest_end_state, &run_count, &min_time) != ERROR_OK)
 				return ERROR_FAIL;
-			}
-			/* init */
-			run_count = 0;
-			min_time = 0;
-			i = 1;
-
-			/* run_state */
-			i_tmp = tap_state_by_name(argus[i]);
-			if (i_tmp != TAP_INVALID) {
-				if (svf_tap_state_is_stable(i_tmp)) {
-					svf_para.runtest_run_state = i_tmp;
-
-					/* When a run_state is specified, the new
-					 * run_state becomes the default end_state.
-					 */
-					svf_para.runtest_end_state = i_tmp;
-					LOG_DEBUG("\trun_state = %s", tap_state_name(i_tmp));
-					i++;
-				} else {
-					LOG_ERROR("%s: %s is not a stable state", argus[0], tap_state_name(i_tmp));
-					return ERROR_FAIL;
-				}
-			}
+#if 1
+			/* FIXME handle statemove failures */
+			uint32_t min_usec = 1000000 * min_time;
+			struct timeval start,end;
+			unsigned long diff = 0;
 
-			/* run_count run_clk */
-			if (((i + 2) <= num_of_argu) && strcmp(argus[i + 1], "SEC")) {
-				if (!strcmp(argus[i + 1], "TCK")) {
-					/* clock source is TCK */
-					run_count = atoi(argus[i]);
-					LOG_DEBUG("\trun_count@TCK = %d", run_count);
-				} else {
-					LOG_ERROR("%s not supported for clock", argus[i + 1]);
-					return ERROR_FAIL;
-				}
-				i += 2;
-			}
-			/* min_time SEC */
-			if (((i + 2) <= num_of_argu) && !strcmp(argus[i + 1], "SEC")) {
-				min_time = atof(argus[i]);
-				LOG_DEBUG("\tmin_time = %fs", min_time);
-				i += 2;
-			}
-			/* MAXIMUM max_time SEC */
-			if (((i + 3) <= num_of_argu) &&
-			!strcmp(argus[i], "MAXIMUM") && !strcmp(argus[i + 2], "SEC")) {
-				float max_time = 0;
-				max_time = atof(argus[i + 1]);
-				LOG_DEBUG("\tmax_time = %fs", max_time);
-				i += 3;
+			/* enter into run_state if necessary */
+			if (ERROR_OK != svf_move_to(svf_para.runtest_run_state))
+				return ERROR_FAIL;
+			if (svf_nil) {
+				svf_dry_cost.tcks += run_count;
+				svf_dry_cost.wait_usec += min_usec;
 			}
-			/* ENDSTATE end_state */
-			if (((i + 2) <= num_of_argu) && !strcmp(argus[i], "ENDSTATE")) {
-				i_tmp = tap_state_by_name(argus[i + 1]);
 
-				if (svf_tap_state_is_stable(i_tmp)) {
-					svf_para.runtest_end_state = i_tmp;
-					LOG_DEBUG("\tend_state = %s", tap_state_name(i_tmp));
-				} else {
-					LOG_ERROR("%s: %s is not a stable state", argus[0], tap_state_name(i_tmp));
-					return ERROR_FAIL;
-				}
-				i += 2;
+			/*
+			 * clock the wait at the FREQUENCY rate and hold it as long
+			 * as those TCKs take, should the driver round the rate up
+			 */
+			if (jtag_handler->svf_freq_policy == SVF_FREQ_DYNAMIC &&
+					run_count > 0 && svf_para.frequency > 0) {
+				uint64_t tck_usec = (uint64_t)run_count * 1000000 /
+					svf_para.frequency;
+
+				svf_set_freq((int)svf_para.frequency);
+				if (min_usec < tck_usec)
+					min_usec = tck_usec;
 			}
 
-			/* all parameter should be parsed */
-			if (i == num_of_argu) {
-#if 1
-				/* FIXME handle statemove failures */
-				uint32_t min_usec = 1000000 * min_time;
-				struct timeval start,end;
-				unsigned long diff = 0;
+			/* scans and the move may still be queued: time from when they ran */
+			if (min_usec > 0 && !svf_nil && JTAG_flush(jtag_handler))
+				return ERROR_FAIL;
 
-				/* enter into run_state if necessary */
-				//if (cmd_queue_cur_state != svf_para.runtest_run_state)
-				JTAG_set_tap_state(jtag_handler, svf_para.runtest_run_state);
+			/* add clocks and/or min wait */
+			if (run_count > 0) {
+				gettimeofday(&start,NULL);
+				if (!svf_nil)
+					JTAG_run_test(jtag_handler, JTAG_STATE_CURRENT, run_count);
+					//JTAG_wait_cycles(jtag_handler, run_count);
+				gettimeofday(&end,NULL);
+				diff = 1000000 * (end.tv_sec-start.tv_sec)+ end.tv_usec-start.tv_usec;
+				total_runtest_time += diff;
+			}
 
-				/* add clocks and/or min wait */
-				if (run_count > 0) {
+			if (min_usec > diff) {
+				min_usec -= diff;
+				if (!svf_nil) {
 					gettimeofday(&start,NULL);
-					if (!svf_nil)
-						JTAG_run_test(jtag_handler, JTAG_STATE_CURRENT, run_count);
-						//JTAG_wait_cycles(jtag_handler, run_count);
-					gettimeofday(&end,NULL);
-					diff = 1000000 * (end.tv_sec-start.tv_sec)+ end.tv_usec-start.tv_usec;
-					total_runtest_time += diff;
-				}
-
-				if (min_usec > diff) {
-					min_usec -= diff;
-					if (!svf_nil) {
-						gettimeofday(&start,NULL);
-						diff = 0;
-						while (min_usec > diff) {
-							usleep(1);
-							gettimeofday(&end,NULL);
-							diff = 1000000 * (end.tv_sec-start.tv_sec)+
-								end.tv_usec-start.tv_usec;
-						}
-						total_runtest_time += diff;
+					diff = 0;
+					while (min_usec > diff) {
+						usleep(1);
+						gettimeofday(&end,NULL);
+						diff = 1000000 * (end.tv_sec-start.tv_sec)+
+							end.tv_usec-start.tv_usec;
 					}
+					total_runtest_time += diff;
+					svf_stats.waits++;
+					svf_stats.wait_overshoot_usec += diff - min_usec;
+					if (diff - min_usec > svf_stats.max_wait_overshoot_usec)
+						svf_stats.max_wait_overshoot_usec = diff - min_usec;
 				}
+			}
 
-				/* move to end_state if necessary */
-				if (svf_para.runtest_end_state != svf_para.runtest_run_state)
-					JTAG_set_tap_state(jtag_handler, svf_para.runtest_end_state);
+			/* move to end_state if necessary */
+			if (svf_para.runtest_end_state != svf_para.runtest_run_state &&
+					ERROR_OK != svf_move_to(svf_para.runtest_end_state))
+				return ERROR_FAIL;
 
 #else
-				if (svf_para.runtest_run_state != TAP_IDLE) {
-					LOG_ERROR("cannot runtest in %s state",
-							tap_state_name(svf_para.runtest_run_state));
-					return ERROR_FAIL;
-				}
-
-				if (!svf_nil)
-					jtag_add_runtest(run_count, svf_para.runtest_end_state);
-#endif
-			} else {
-				LOG_ERROR("fail to parse parameter of RUNTEST, %d out of %d is parsed",
-						i,
-						num_of_argu);
+			if (svf_para.runtest_run_state != TAP_IDLE) {
+				LOG_ERROR("cannot runtest in %s state",
+						tap_state_name(svf_para.runtest_run_state));
 				return ERROR_FAIL;
 			}
+
+			if (!svf_nil)
+				jtag_add_runtest(run_count, svf_para.runtest_end_state);
+#endif
 			break;
 		case STATE:
 			/* STATE [pathstate1 [pathstate2 ...[pathstaten]]] stable_state */
@@ -1516,18 +2654,12 @@ XXR_common:
 			}
 			if (num_of_argu > 2) {
 				/* STATE pathstate1 ... stable_state */
-				path = malloc((num_of_argu - 1) * sizeof(tap_state_t));
-				if (NULL == path) {
-					LOG_ERROR("not enough memory");
-					return ERROR_FAIL;
-				}
 				num_of_argu--;	/* num of path */
 				i_tmp = 1;		/* path is from parameter 1 */
 				for (i = 0; i < num_of_argu; i++, i_tmp++) {
 					path[i] = tap_state_by_name(argus[i_tmp]);
 					if (path[i] == TAP_INVALID) {
 						LOG_ERROR("%s: %s is not a valid state", argus[0], argus[i_tmp]);
-						free(path);
 						return ERROR_FAIL;
 					}
 				}
@@ -1535,30 +2667,25 @@ XXR_common:
 					/* execute last path if necessary */
 					if (svf_tap_state_is_stable(path[num_of_argu - 1])) {
 						/* last state MUST be stable state */
-						//if (!svf_nil)
-						//	jtag_add_pathmove(num_of_argu, path);
-						JTAG_set_tap_state(jtag_handler, path[num_of_argu - 1]);
+						if (ERROR_OK != svf_path_move(path, num_of_argu))
+							return ERROR_FAIL;
 						LOG_DEBUG("\tmove to %s by path_move",
 								tap_state_name(path[num_of_argu - 1]));
 					} else {
 						LOG_ERROR("%s: %s is not a stable state",
 								argus[0],
 								tap_state_name(path[num_of_argu - 1]));
-						free(path);
 						return ERROR_FAIL;
 					}
 				}
-
-				free(path);
-				path = NULL;
 			} else {
 				/* STATE stable_state */
 				state = tap_state_by_name(argus[1]);
 				if (svf_tap_state_is_stable(state)) {
 					LOG_DEBUG("\tmove to %s",
 							tap_state_name(state));
-					/* FIXME handle statemove failures */
-					JTAG_set_tap_state(jtag_handler, state);
+					if (ERROR_OK != svf_move_to(state))
+						return ERROR_FAIL;
 				} else {
 					LOG_ERROR("%s: %s is not a stable state",
 							argus[0], tap_state_name(state));
@@ -1608,7 +2735,13 @@ XXR_common:
 			return ERROR_FAIL;
 			break;
 	}
-	if ((loop == 0) && (ERROR_OK != svf_check_tdo(false)))
+	/*
+	 * Check after every command, unless the interface may hand in TDO
+	 * late: then the checks gather until a RUNTEST, a full staging
+	 * buffer, a phase mark or the end of the file.
+	 */
+	if ((loop == 0) && (!jtag_handler->defer_tdo || command == RUNTEST) &&
+			(ERROR_OK != svf_check_tdo(false)))
 		return ERROR_FAIL;
 #if 0
 	if (svf_check_tdo_para_index >= SVF_CHECK_TDO_PARA_SIZE / 2) {
@@ -1629,3 +2762,1355 @@ XXR_common:
 }
 
 
+
+/*
+ * Chain mode: one SVF file per device of a daisy chain, device 0 nearest
+ * TDO.  The files are parsed up front into per-device lists of scans and
+ * waits and then played together.  The devices whose next operation is a
+ * SIR share one chain IR scan, the devices whose next operation is an SDR
+ * share one chain DR scan, and every other device is held in BYPASS (IR
+ * all ones), so the HIR/HDR/TIR/TDR padding of each scan is made of the
+ * other devices rather than taken from the files.  The TCKs of a RUNTEST
+ * are clocked as soon as the device reaches it, while it still holds its
+ * own instruction; its minimum time then runs while the other devices go
+ * on scanning.  This relies on erase and program operations being
+ * self-timed, i.e. unaffected by the device being put in BYPASS once the
+ * TCKs are clocked.  Journals, LOOP and PIO are not supported.
+ */
+#define SVF_CHAIN_MAX_DEVICES	16
+
+enum svf_chain_op_type {
+	SVF_CHAIN_SIR,
+	SVF_CHAIN_SDR,
+	SVF_CHAIN_WAIT,
+};
+
+struct svf_chain_op {
+	enum svf_chain_op_type type;
+	int line;
+	int len;		/* scan length in bits */
+	tap_state_t end_state;
+	uint8_t *tdi;
+	uint8_t *tdo;		/* NULL: nothing to check */
+	uint8_t *mask;
+	int tcks;		/* RUNTEST TCKs */
+	uint32_t usec;		/* RUNTEST minimum time */
+};
+
+struct svf_chain_dev {
+	const char *filename;
+	struct svf_chain_op *ops;
+	int num_ops;
+	int size_ops;
+	int next;		/* next operation to play */
+	int ir_len;
+	int dr_max;		/* longest SDR */
+	float frequency;	/* lowest FREQUENCY of the file, 0: none */
+	const uint8_t *ir;	/* instruction of the last SIR played */
+	bool ir_bypass;		/* ir is BYPASS itself */
+	bool bypassed;		/* BYPASS is loaded instead of ir */
+	bool waiting;
+	struct timeval ready;	/* end of the running RUNTEST */
+	int offset;		/* position in the current chain scan */
+};
+
+struct svf_chain {
+	struct svf_chain_dev dev[SVF_CHAIN_MAX_DEVICES];
+	int num;
+	uint8_t *tdi;
+	uint8_t *tdo;
+	uint8_t *slice;
+};
+
+static struct svf_chain_op *svf_chain_add_op(struct svf_chain_dev *dev,
+	enum svf_chain_op_type type)
+{
+	struct svf_chain_op *ops;
+	int size;
+
+	if (dev->num_ops == dev->size_ops) {
+		size = dev->size_ops ? 2 * dev->size_ops : 64;
+		ops = realloc(dev->ops, size * sizeof(*ops));
+		if (!ops) {
+			LOG_ERROR("not enough memory");
+			return NULL;
+		}
+		dev->ops = ops;
+		dev->size_ops = size;
+	}
+	ops = &dev->ops[dev->num_ops++];
+	memset(ops, 0, sizeof(*ops));
+	ops->type = type;
+	ops->line = svf_line_number;
+
+	return ops;
+}
+
+static uint8_t *svf_chain_dup(const uint8_t *buf, int bits)
+{
+	uint8_t *copy = malloc((bits + 7) >> 3);
+
+	if (!copy) {
+		LOG_ERROR("not enough memory");
+		return NULL;
+	}
+	memcpy(copy, buf, (bits + 7) >> 3);
+
+	return copy;
+}
+
+static void svf_chain_free(struct svf_chain *chain)
+{
+	struct svf_chain_dev *dev;
+	int i, j;
+
+	for (i = 0; i < chain->num; i++) {
+		dev = &chain->dev[i];
+		for (j = 0; j < dev->num_ops; j++) {
+			free(dev->ops[j].tdi);
+			free(dev->ops[j].tdo);
+			free(dev->ops[j].mask);
+		}
+		free(dev->ops);
+	}
+	free(chain->tdi);
+	free(chain->tdo);
+	free(chain->slice);
+}
+
+/* read the scans and waits of one device's file */
+static int svf_chain_parse(struct svf_chain_dev *dev)
+{
+	struct svf_xxr_para para[2];	/* SIR, SDR */
+	tap_state_t end_state[2] = { TAP_IDLE, TAP_IDLE };
+	tap_state_t run_state = TAP_IDLE, run_end_state = TAP_IDLE, state;
+	struct svf_chain_op *op;
+	char *argus[256];
+	float frequency = 0, min_time;
+	int num_of_argu, command, run_count, ir, len;
+	int ret = ERROR_FAIL;
+
+	svf_fd = fopen(dev->filename, "r");
+	if (svf_fd == NULL) {
+		LOG_ERROR("failed to open %s\n", dev->filename);
+		return ERROR_FAIL;
+	}
+	memset(para, 0, sizeof(para));
+	svf_line_number = 0;
+
+	while (ERROR_OK == svf_read_command_from_file(svf_fd)) {
+		if (ERROR_OK != svf_parse_cmd_string(svf_command_buffer,
+				strlen(svf_command_buffer), argus, &num_of_argu))
+			goto out;
+		command = svf_find_string_in_array(argus[0],
+				(char **)svf_command_name, ARRAY_SIZE(svf_command_name));
+		switch (command) {
+		case ENDDR:
+		case ENDIR:
+			if (num_of_argu != 2) {
+				LOG_ERROR("invalid parameter of %s", argus[0]);
+				goto out;
+			}
+			state = tap_state_by_name(argus[1]);
+			if (!svf_tap_state_is_stable(state) || state == TAP_RESET) {
+				LOG_ERROR("%s line %d: %s %s is not supported in chain mode",
+						dev->filename, svf_line_number, argus[0], argus[1]);
+				goto out;
+			}
+			end_state[command == ENDDR] = state;
+			break;
+		case FREQUENCY:
+			frequency = num_of_argu == 3 ? atof(argus[1]) : 0;
+			if (frequency > 0 && (!dev->frequency || frequency < dev->frequency))
+				dev->frequency = frequency;
+			break;
+		case HDR:
+		case HIR:
+		case TDR:
+		case TIR:
+			/* the other devices of the chain make up the padding */
+			break;
+		case SDR:
+		case SIR:
+			ir = command == SIR;
+			if (svf_parse_xxr(&para[!ir], argus, num_of_argu) != ERROR_OK)
+				goto out;
+			len = para[!ir].len;
+			if (len <= 0)
+				break;
+			if (ir) {
+				if (dev->ir_len && dev->ir_len != len) {
+					LOG_ERROR("%s line %d: SIR of %d bits, the IR has %d",
+							dev->filename, svf_line_number, len, dev->ir_len);
+					goto out;
+				}
+				dev->ir_len = len;
+			} else if (!dev->ir_len) {
+				LOG_ERROR("%s line %d: SDR before the first SIR is not supported in chain mode",
+						dev->filename, svf_line_number);
+				goto out;
+			} else if (len > dev->dr_max) {
+				dev->dr_max = len;
+			}
+
+			op = svf_chain_add_op(dev, ir ? SVF_CHAIN_SIR : SVF_CHAIN_SDR);
+			if (!op)
+				goto out;
+			op->len = len;
+			op->end_state = end_state[!ir];
+			op->tdi = svf_chain_dup(para[!ir].tdi, len);
+			if (!op->tdi)
+				goto out;
+			if (para[!ir].data_mask & XXR_TDO) {
+				op->tdo = svf_chain_dup(para[!ir].tdo, len);
+				op->mask = svf_chain_dup(para[!ir].mask, len);
+				if (!op->tdo || !op->mask)
+					goto out;
+			}
+			break;
+		case RUNTEST:
+			if (svf_parse_runtest(argus, num_of_argu, &run_state, &run_end_state,
+					&run_count, &min_time) != ERROR_OK)
+				goto out;
+			if (run_state != TAP_IDLE || run_end_state != TAP_IDLE) {
+				LOG_ERROR("%s line %d: RUNTEST outside IDLE is not supported in chain mode",
+						dev->filename, svf_line_number);
+				goto out;
+			}
+			op = svf_chain_add_op(dev, SVF_CHAIN_WAIT);
+			if (!op)
+				goto out;
+			op->tcks = run_count;
+			op->usec = 1000000 * min_time;
+			/* the TCKs may be clocked faster than the file assumes */
+			if (run_count > 0 && frequency > 0 &&
+					op->usec < (uint64_t)run_count * 1000000 / frequency)
+				op->usec = (uint64_t)run_count * 1000000 / frequency;
+			break;
+		case STATE:
+			/* the player moves the TAP itself, only a reset cannot be shared */
+			state = tap_state_by_name(argus[num_of_argu - 1]);
+			if (state == TAP_RESET && dev->num_ops) {
+				LOG_ERROR("%s line %d: STATE RESET after the first scan is not supported in chain mode",
+						dev->filename, svf_line_number);
+				goto out;
+			}
+			break;
+		case TRST:
+			break;
+		default:
+			LOG_ERROR("%s line %d: %s is not supported in chain mode",
+					dev->filename, svf_line_number, argus[0]);
+			goto out;
+		}
+	}
+	svf_phase_mark = 0;
+
+	if (!dev->ir_len) {
+		LOG_ERROR("%s: no SIR, the IR length is unknown", dev->filename);
+		goto out;
+	}
+	ret = ERROR_OK;
+out:
+	svf_free_xxd_para(&para[0]);
+	svf_free_xxd_para(&para[1]);
+	fclose(svf_fd);
+	svf_fd = 0;
+
+	return ret;
+}
+
+static void svf_chain_set_ones(uint8_t *buf, int start, int len)
+{
+	int i;
+
+	for (i = start; i < start + len; i++)
+		buf[i / 8] |= 1 << (i % 8);
+}
+
+static bool svf_chain_is_bypass(const uint8_t *ir, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (!((ir[i / 8] >> (i % 8)) & 1))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * One chain scan.  In an IR scan the devices in sel shift their next SIR,
+ * the devices in keep reload their current instruction and all others get
+ * BYPASS.  In a DR scan the devices in sel shift their next SDR and all
+ * others, which are in BYPASS, add one bit each.  The TDO of every device
+ * is checked right away.
+ */
+static int svf_chain_scan(struct svf_chain *chain, bool ir, unsigned sel, unsigned keep)
+{
+	tap_state_t end_state = TAP_IDLE;
+	struct svf_chain_dev *dev;
+	struct svf_chain_op *op;
+	int i, len, bits = 0, bit, parts = 0;
+	bool check = false;
+
+	for (i = 0; i < chain->num; i++) {
+		dev = &chain->dev[i];
+		op = &dev->ops[dev->next];
+		dev->offset = bits;
+		if (sel & (1 << i)) {
+			len = op->len;
+			buf_set_buf(op->tdi, 0, chain->tdi, bits, len);
+			if (op->end_state != TAP_IDLE)
+				end_state = op->end_state;
+			check |= op->tdo != NULL;
+			parts++;
+		} else if (keep & (1 << i)) {
+			len = dev->ir_len;
+			buf_set_buf(dev->ir, 0, chain->tdi, bits, len);
+		} else {
+			len = ir ? dev->ir_len : 1;
+			svf_chain_set_ones(chain->tdi, bits, len);
+		}
+		bits += len;
+	}
+
+	if ((ir ? JTAG_ir_scan : JTAG_dr_scan)(jtag_handler, bits, chain->tdi,
+			check ? chain->tdo : NULL, end_state) < 0) {
+		LOG_ERROR("chain %s scan of %d bits failed", ir ? "IR" : "DR", bits);
+		return ERROR_FAIL;
+	}
+	svf_stats.scans++;
+	svf_stats.scan_bytes += (bits + 7) >> 3;
+	if (parts > 1)
+		svf_stats.merged_scans++;
+
+	for (i = 0; i < chain->num; i++) {
+		dev = &chain->dev[i];
+		if (ir)
+			dev->bypassed = !((sel | keep) & (1 << i));
+		if (!(sel & (1 << i)))
+			continue;
+		op = &dev->ops[dev->next++];
+		if (ir) {
+			dev->ir = op->tdi;
+			dev->ir_bypass = svf_chain_is_bypass(op->tdi, op->len);
+		}
+		if (!op->tdo)
+			continue;
+		buf_set_buf(chain->tdo, dev->offset, chain->slice, 0, op->len);
+		bit = buf_cmp_mask_first(chain->slice, op->tdo, op->mask, op->len);
+		if (bit >= 0) {
+			LOG_ERROR("device %d: tdo check error at line %d of %s, bit %d of %d: read %d want %d",
+					i, op->line, dev->filename, bit, op->len,
+					(chain->slice[bit / 8] >> (bit % 8)) & 1,
+					(op->tdo[bit / 8] >> (bit % 8)) & 1);
+			return ERROR_FAIL;
+		}
+	}
+
+	return ERROR_OK;
+}
+
+/* sel can shift its SDRs in one DR scan without loading any IR first */
+static bool svf_chain_dr_ready(struct svf_chain *chain, unsigned sel)
+{
+	struct svf_chain_dev *dev;
+	int i;
+
+	for (i = 0; i < chain->num; i++) {
+		dev = &chain->dev[i];
+		if (sel & (1 << i) ? dev->bypassed : !dev->bypassed && !dev->ir_bypass)
+			return false;
+	}
+
+	return true;
+}
+
+/* clock the RUNTEST TCKs of the devices in sel and start their waits */
+static int svf_chain_wait_start(struct svf_chain *chain, unsigned sel)
+{
+	struct svf_chain_dev *dev;
+	struct svf_chain_op *op;
+	struct timeval start, usec;
+	bool timed = false;
+	int i, tcks = 0;
+
+	for (i = 0; i < chain->num; i++) {
+		op = &chain->dev[i].ops[chain->dev[i].next];
+		if ((sel & (1 << i)) && op->tcks > tcks)
+			tcks = op->tcks;
+		if ((sel & (1 << i)) && op->usec)
+			timed = true;
+	}
+
+	if (ERROR_OK != svf_move_to(TAP_IDLE))
+		return ERROR_FAIL;
+	/* the waits run from when the queued scans and the move are done */
+	if (timed && JTAG_flush(jtag_handler))
+		return ERROR_FAIL;
+	gettimeofday(&start, NULL);
+	if (tcks > 0 && JTAG_run_test(jtag_handler, JTAG_STATE_CURRENT, tcks))
+		return ERROR_FAIL;
+
+	for (i = 0; i < chain->num; i++) {
+		if (!(sel & (1 << i)))
+			continue;
+		dev = &chain->dev[i];
+		op = &dev->ops[dev->next++];
+		usec.tv_sec = op->usec / 1000000;
+		usec.tv_usec = op->usec % 1000000;
+		timeradd(&start, &usec, &dev->ready);
+		dev->waiting = true;
+	}
+
+	return ERROR_OK;
+}
+
+/* nothing to shift: idle until the first running wait ends */
+static int svf_chain_sleep(struct svf_chain *chain)
+{
+	const struct timeval *ready = NULL;
+	struct timeval now;
+	unsigned long overshoot;
+	int i;
+
+	for (i = 0; i < chain->num; i++) {
+		if (chain->dev[i].waiting &&
+				(!ready || timercmp(&chain->dev[i].ready, ready, <)))
+			ready = &chain->dev[i].ready;
+	}
+
+	if (ERROR_OK != svf_move_to(TAP_IDLE) || JTAG_flush(jtag_handler))
+		return ERROR_FAIL;
+	do {
+		usleep(1);
+		gettimeofday(&now, NULL);
+	} while (timercmp(&now, ready, <));
+
+	overshoot = 1000000 * (now.tv_sec - ready->tv_sec) + now.tv_usec - ready->tv_usec;
+	svf_stats.waits++;
+	svf_stats.wait_overshoot_usec += overshoot;
+	if (overshoot > svf_stats.max_wait_overshoot_usec)
+		svf_stats.max_wait_overshoot_usec = overshoot;
+
+	return ERROR_OK;
+}
+
+static int svf_chain_play(struct svf_chain *chain)
+{
+	struct svf_chain_dev *dev;
+	unsigned sir, sdr, wait, busy;
+	struct timeval now;
+	int i, ret;
+
+	while (1) {
+		sir = sdr = wait = busy = 0;
+		gettimeofday(&now, NULL);
+		for (i = 0; i < chain->num; i++) {
+			dev = &chain->dev[i];
+			if (dev->waiting) {
+				if (timercmp(&now, &dev->ready, <)) {
+					busy |= 1 << i;
+					continue;
+				}
+				dev->waiting = false;
+			}
+			if (dev->next == dev->num_ops)
+				continue;
+			switch (dev->ops[dev->next].type) {
+			case SVF_CHAIN_SIR:
+				sir |= 1 << i;
+				break;
+			case SVF_CHAIN_SDR:
+				sdr |= 1 << i;
+				break;
+			case SVF_CHAIN_WAIT:
+				wait |= 1 << i;
+				break;
+			}
+		}
+
+		if (wait)
+			ret = svf_chain_wait_start(chain, wait);
+		else if (sdr && svf_chain_dr_ready(chain, sdr))
+			ret = svf_chain_scan(chain, false, sdr, 0);
+		else if (sir || sdr)
+			/* new instructions, and the SDR devices get theirs back */
+			ret = svf_chain_scan(chain, true, sir, sdr);
+		else if (busy)
+			ret = svf_chain_sleep(chain);
+		else
+			break;
+		if (ret != ERROR_OK)
+			return ret;
+	}
+
+	return ERROR_OK;
+}
+
+/*
+ * Play one SVF file per device of the chain, files[0] for the device
+ * nearest TDO, interleaving their scans and overlapping their waits.
+ */
+int svf_session_run_chain(struct svf_session *session, char **files, int num)
+{
+	struct svf_chain chain;
+	struct svf_chain_dev *dev;
+	float frequency = 0;
+	int ir_bits = 0, dr_bits = 0, max_len = 0, bytes;
+	int i, ret = ERROR_FAIL;
+
+	if (!session || !svf_session_active)
+		return ERROR_FAIL;
+	if (num < 1 || num > SVF_CHAIN_MAX_DEVICES) {
+		LOG_ERROR("a chain takes 1 to %d devices", SVF_CHAIN_MAX_DEVICES);
+		return ERROR_FAIL;
+	}
+
+	jtag_handler = session->handler;
+	svf_nil = 0;
+	svf_ignore_error = 0;
+	memset(&svf_stats, 0, sizeof(svf_stats));
+	memset(&chain, 0, sizeof(chain));
+	chain.num = num;
+
+	for (i = 0; i < num; i++) {
+		dev = &chain.dev[i];
+		dev->filename = files[i];
+		if (svf_chain_parse(dev) != ERROR_OK)
+			goto out;
+		LOG_INFO("device %d: %s, %d bit IR, %d operations",
+				i, dev->filename, dev->ir_len, dev->num_ops);
+		ir_bits += dev->ir_len;
+		dr_bits += dev->dr_max > 1 ? dev->dr_max : 1;
+		if (dev->ir_len > max_len)
+			max_len = dev->ir_len;
+		if (dev->dr_max > max_len)
+			max_len = dev->dr_max;
+		if (dev->frequency > 0 && (!frequency || dev->frequency < frequency))
+			frequency = dev->frequency;
+	}
+
+	bytes = ((ir_bits > dr_bits ? ir_bits : dr_bits) + 7) >> 3;
+	chain.tdi = malloc(bytes);
+	chain.tdo = malloc(bytes);
+	chain.slice = malloc((max_len + 7) >> 3);
+	if (!chain.tdi || !chain.tdo || !chain.slice) {
+		LOG_ERROR("not enough memory");
+		goto out;
+	}
+
+	/* the slowest device sets the rate, unless it is forced */
+	svf_freq_cur = jtag_handler->frequency;
+	svf_freq_fast = jtag_handler->svf_max_freq;
+	if (jtag_handler->svf_freq_policy == SVF_FREQ_DYNAMIC)
+		svf_set_freq(svf_freq_fast);
+	else if (jtag_handler->svf_freq_policy == SVF_FREQ_FOLLOW || !jtag_handler->frequency)
+		svf_set_freq((int)frequency);
+
+	/* every device starts from its reset instruction */
+	if (ERROR_OK != svf_move_to(TAP_RESET) || ERROR_OK != svf_move_to(TAP_IDLE))
+		goto out;
+	ret = svf_chain_play(&chain);
+	if (ret == ERROR_OK && JTAG_flush(jtag_handler)) {
+		LOG_ERROR("an operation of the chain failed");
+		ret = ERROR_FAIL;
+	}
+	if (ret == ERROR_OK)
+		printf("\nDone!\n");
+out:
+	svf_chain_free(&chain);
+
+	return ret;
+}
+
+/*
+ * Fan-out: an SVF file is parsed once into a read-only list of operations,
+ * with the HIR/HDR/TIR/TDR padding and the ENDIR/ENDDR states already
+ * applied to every scan, and then played on any number of handlers at the
+ * same time, one thread per handler.  The player keeps its state on its
+ * own stack and in the handler, so the targets share nothing but the
+ * image: each one checks its own TDO and a failing target does not stop
+ * the others.  LOOP and PIO are not supported.
+ */
+enum svf_image_op_type {
+	SVF_IMAGE_STATE,
+	SVF_IMAGE_PATH,
+	SVF_IMAGE_FREQ,
+	SVF_IMAGE_SIR,
+	SVF_IMAGE_SDR,
+	SVF_IMAGE_RUNTEST,
+};
+
+struct svf_image_op {
+	enum svf_image_op_type type;
+	int line;
+	int len;		/* scan length in bits, STATE path length */
+	tap_state_t state;	/* STATE target, scan end state, RUNTEST run state */
+	tap_state_t end_state;	/* RUNTEST */
+	tap_state_t *path;	/* STATE path */
+	uint8_t *tdi;
+	uint8_t *tdo;		/* NULL: nothing to check */
+	uint8_t *mask;
+	int tcks;		/* RUNTEST TCKs */
+	uint32_t usec;		/* RUNTEST minimum time */
+	int hz;			/* FREQUENCY, the rate of a RUNTEST */
+};
+
+struct svf_image {
+	struct svf_image_op *ops;
+	int num_ops;
+	int size_ops;
+	int max_len;		/* longest scan */
+};
+
+static struct svf_image_op *svf_image_add_op(struct svf_image *image,
+	enum svf_image_op_type type)
+{
+	struct svf_image_op *ops;
+	int size;
+
+	if (image->num_ops == image->size_ops) {
+		size = image->size_ops ? 2 * image->size_ops : 256;
+		ops = realloc(image->ops, size * sizeof(*ops));
+		if (!ops) {
+			LOG_ERROR("not enough memory");
+			return NULL;
+		}
+		image->ops = ops;
+		image->size_ops = size;
+	}
+	ops = &image->ops[image->num_ops++];
+	memset(ops, 0, sizeof(*ops));
+	ops->type = type;
+	ops->line = svf_line_number;
+
+	return ops;
+}
+
+void svf_image_free(struct svf_image *image)
+{
+	int i;
+
+	if (!image)
+		return;
+	for (i = 0; i < image->num_ops; i++) {
+		free(image->ops[i].path);
+		free(image->ops[i].tdi);
+		free(image->ops[i].tdo);
+		free(image->ops[i].mask);
+	}
+	free(image->ops);
+	free(image);
+}
+
+/* join header, body and trailer into one scan, as svf_xxr_scan() shifts them */
+static int svf_image_add_scan(struct svf_image *image, bool ir, struct svf_xxr_para *parts,
+	tap_state_t end_state)
+{
+	struct svf_image_op *op;
+	bool check = parts[1].data_mask & XXR_TDO;
+	int len = parts[0].len + parts[1].len + parts[2].len;
+	int bytes = (len + 7) >> 3;
+	int i, pos;
+
+	if (!len)
+		return ERROR_OK;
+	op = svf_image_add_op(image, ir ? SVF_IMAGE_SIR : SVF_IMAGE_SDR);
+	if (!op)
+		return ERROR_FAIL;
+	op->len = len;
+	op->state = end_state;
+	op->tdi = calloc(1, bytes);
+	if (check) {
+		op->tdo = calloc(1, bytes);
+		op->mask = calloc(1, bytes);
+	}
+	if (!op->tdi || (check && (!op->tdo || !op->mask))) {
+		LOG_ERROR("not enough memory");
+		return ERROR_FAIL;
+	}
+	for (i = 0, pos = 0; i < 3; pos += parts[i].len, i++) {
+		if (!parts[i].len)
+			continue;
+		buf_set_buf(parts[i].tdi, 0, op->tdi, pos, parts[i].len);
+		if (check) {
+			buf_set_buf(parts[i].tdo, 0, op->tdo, pos, parts[i].len);
+			buf_set_buf(parts[i].mask, 0, op->mask, pos, parts[i].len);
+		}
+	}
+	if (len > image->max_len)
+		image->max_len = len;
+
+	return ERROR_OK;
+}
+
+/*
+ * Parse an SVF file into an image.  Not reentrant, as it shares the
+ * reader of the session player; svf_image_play() is.
+ */
+struct svf_image *svf_image_load(char *filename)
+{
+	struct svf_xxr_para para[2][3];	/* DR, IR: header, body, trailer */
+	tap_state_t end_state[2] = { TAP_IDLE, TAP_IDLE };
+	tap_state_t run_state = TAP_IDLE, run_end_state = TAP_IDLE, state;
+	struct svf_image *image;
+	struct svf_image_op *op;
+	char *argus[256];
+	float frequency = 0, min_time;
+	int num_of_argu, command, run_count, ir, part, i;
+	int ret = ERROR_FAIL;
+
+	image = calloc(1, sizeof(*image));
+	if (!image) {
+		LOG_ERROR("not enough memory");
+		return NULL;
+	}
+	svf_fd = fopen(filename, "r");
+	if (svf_fd == NULL) {
+		LOG_ERROR("failed to open %s\n", filename);
+		free(image);
+		return NULL;
+	}
+	memset(para, 0, sizeof(para));
+	svf_line_number = 0;
+
+	while (ERROR_OK == svf_read_command_from_file(svf_fd)) {
+		if (ERROR_OK != svf_parse_cmd_string(svf_command_buffer,
+				strlen(svf_command_buffer), argus, &num_of_argu))
+			goto out;
+		command = svf_find_string_in_array(argus[0],
+				(char **)svf_command_name, ARRAY_SIZE(svf_command_name));
+		switch (command) {
+		case ENDDR:
+		case ENDIR:
+			if (num_of_argu != 2) {
+				LOG_ERROR("invalid parameter of %s", argus[0]);
+				goto out;
+			}
+			state = tap_state_by_name(argus[1]);
+			if (!svf_tap_state_is_stable(state)) {
+				LOG_ERROR("%s: %s is not a stable state", argus[0], argus[1]);
+				goto out;
+			}
+			end_state[command == ENDIR] = state;
+			break;
+		case FREQUENCY:
+			if (num_of_argu != 1 && (num_of_argu != 3 || strcmp(argus[2], "HZ"))) {
+				LOG_ERROR("invalid parameter of %s", argus[0]);
+				goto out;
+			}
+			frequency = num_of_argu == 3 ? atof(argus[1]) : 0;
+			op = svf_image_add_op(image, SVF_IMAGE_FREQ);
+			if (!op)
+				goto out;
+			op->hz = (int)frequency;
+			break;
+		case HDR:
+		case HIR:
+		case SDR:
+		case SIR:
+		case TDR:
+		case TIR:
+			ir = command == HIR || command == SIR || command == TIR;
+			part = (command == HDR || command == HIR) ? 0 :
+				(command == SDR || command == SIR) ? 1 : 2;
+			if (svf_parse_xxr(&para[ir][part], argus, num_of_argu) != ERROR_OK)
+				goto out;
+			if (part == 1 && svf_image_add_scan(image, ir, para[ir],
+					end_state[ir]) != ERROR_OK)
+				goto out;
+			break;
+		case RUNTEST:
+			if (svf_parse_runtest(argus, num_of_argu, &run_state, &run_end_state,
+					&run_count, &min_time) != ERROR_OK)
+				goto out;
+			op = svf_image_add_op(image, SVF_IMAGE_RUNTEST);
+			if (!op)
+				goto out;
+			op->state = run_state;
+			op->end_state = run_end_state;
+			op->tcks = run_count;
+			op->usec = 1000000 * min_time;
+			op->hz = (int)frequency;
+			break;
+		case STATE:
+			if (num_of_argu < 2) {
+				LOG_ERROR("invalid parameter of %s", argus[0]);
+				goto out;
+			}
+			state = tap_state_by_name(argus[num_of_argu - 1]);
+			if (!svf_tap_state_is_stable(state)) {
+				LOG_ERROR("%s: %s is not a stable state", argus[0],
+						argus[num_of_argu - 1]);
+				goto out;
+			}
+			op = svf_image_add_op(image, num_of_argu > 2 ?
+					SVF_IMAGE_PATH : SVF_IMAGE_STATE);
+			if (!op)
+				goto out;
+			op->state = state;
+			if (num_of_argu == 2)
+				break;
+			op->len = num_of_argu - 1;
+			op->path = malloc(op->len * sizeof(*op->path));
+			if (!op->path) {
+				LOG_ERROR("not enough memory");
+				goto out;
+			}
+			for (i = 0; i < op->len; i++) {
+				op->path[i] = tap_state_by_name(argus[i + 1]);
+				if (op->path[i] == TAP_INVALID) {
+					LOG_ERROR("%s: %s is not a valid state", argus[0], argus[i + 1]);
+					goto out;
+				}
+			}
+			break;
+		case TRST:
+			/* the player ignores TRST, see svf_run_command() */
+			break;
+		default:
+			LOG_ERROR("%s line %d: %s is not supported for several targets",
+					filename, svf_line_number, argus[0]);
+			goto out;
+		}
+	}
+	svf_phase_mark = 0;
+	ret = ERROR_OK;
+out:
+	for (i = 0; i < 3; i++) {
+		svf_free_xxd_para(&para[0][i]);
+		svf_free_xxd_para(&para[1][i]);
+	}
+	fclose(svf_fd);
+	svf_fd = 0;
+	if (!svf_session_active) {
+		free(svf_command_buffer);
+		svf_command_buffer = NULL;
+		svf_command_buffer_size = 0;
+		free(svf_read_line);
+		svf_read_line = NULL;
+		svf_read_line_size = 0;
+	}
+	if (ret != ERROR_OK) {
+		svf_image_free(image);
+		return NULL;
+	}
+
+	return image;
+}
+
+/* player state of one target, the counterpart of the svf_freq_* globals */
+struct svf_image_player {
+	JTAG_Handler *handler;
+	const struct svf_image *image;
+	const char *target;
+	struct svf_image_result *result;
+	uint8_t *in;
+	int freq_cur;
+	int freq_fast;
+	int next;		/* next operation */
+	bool split;		/* shift through shift_submit/shift_complete */
+	bool nonblock;		/* handler->nonblock before playing */
+	bool pending;		/* the shift of next, or what comes before it, is outstanding */
+	bool held;		/* the interface holds operations back for room */
+	bool armed;		/* handler->handle is watched for its response */
+	bool waiting;		/* the RUNTEST of next waits until ready */
+	struct timeval ready;	/* or, pending, when the response is late */
+	struct timeval start;
+};
+
+/* what svf_image_step() stopped for */
+enum svf_image_step {
+	SVF_STEP_DONE,
+	SVF_STEP_FAIL,
+	SVF_STEP_WAIT,		/* until player->ready */
+	SVF_STEP_IO,		/* until handler->handle is readable */
+};
+
+static void svf_image_set_freq(struct svf_image_player *player, int hz)
+{
+	int max = player->handler->svf_max_freq;
+
+	if (max && hz > max)
+		hz = max;
+	if (hz <= 0 || hz == player->freq_cur)
+		return;
+	if (JTAG_set_clock_frequency(player->handler, hz)) {
+		player->freq_cur = 0;
+		return;
+	}
+	player->freq_cur = hz;
+}
+
+static int svf_image_check(struct svf_image_player *player, const struct svf_image_op *op)
+{
+	uint8_t *in = player->in;
+	int bit;
+
+	player->result->scans++;
+	player->result->scan_bytes += (op->len + 7) >> 3;
+	if (!op->tdo)
+		return ERROR_OK;
+	bit = buf_cmp_mask_first(in, op->tdo, op->mask, op->len);
+	if (bit >= 0) {
+		LOG_ERROR("%s: tdo check error at line %d, bit %d of %d: read %d want %d",
+				player->target, op->line, bit, op->len,
+				(in[bit / 8] >> (bit % 8)) & 1,
+				(op->tdo[bit / 8] >> (bit % 8)) & 1);
+		return ERROR_FAIL;
+	}
+
+	return ERROR_OK;
+}
+
+/*
+ * A response lost on the way never makes the handle readable: past the
+ * interface's response timeout, shift_complete() is called anyway to send
+ * the request again or give up.  Still waiting, it is looked at again
+ * every eighth of the timeout: the interface knows when it is due.
+ */
+static void svf_image_set_late(struct svf_image_player *player, bool again)
+{
+	struct jtag_link_stats link;
+	struct timeval wait;
+	long msec;
+
+	timerclear(&player->ready);
+	if (JTAG_get_link_stats(player->handler, &link) < 0)
+		return;
+	msec = again ? link.rto_msec / 8 + 1 : link.rto_msec;
+	gettimeofday(&player->ready, NULL);
+	wait.tv_sec = msec / 1000;
+	wait.tv_usec = msec % 1000 * 1000;
+	timeradd(&player->ready, &wait, &player->ready);
+}
+
+static int svf_image_scan(struct svf_image_player *player, const struct svf_image_op *op)
+{
+	JTAG_Handler *handler = player->handler;
+	bool ir = op->type == SVF_IMAGE_SIR;
+	uint8_t *in = op->tdo ? player->in : NULL;
+	int ret;
+
+	if (handler->svf_freq_policy == SVF_FREQ_DYNAMIC)
+		svf_image_set_freq(player, player->freq_fast);
+
+	/* only a scan with TDO is worth waiting for on the event loop */
+	if (player->split && in) {
+		ret = handler->ops->shift_submit(handler, ir ? JTAG_SIR_XFER : JTAG_SDR_XFER,
+				op->len, op->tdi, in, op->state);
+		if (ret == 0) {
+			player->pending = true;
+			svf_image_set_late(player, false);
+			return ERROR_OK;
+		}
+	} else {
+		ret = svf_raw_scan(handler, ir, op->len, op->tdi, in, op->state);
+		if (ret == -EOPNOTSUPP && ir)
+			ret = JTAG_ir_scan(handler, op->len, op->tdi, in, op->state);
+		else if (ret == -EOPNOTSUPP)
+			ret = JTAG_dr_scan(handler, op->len, op->tdi, in, op->state);
+	}
+	if (ret < 0) {
+		LOG_ERROR("%s: %s scan of %d bits failed at line %d", player->target,
+				ir ? "IR" : "DR", op->len, op->line);
+		return ERROR_FAIL;
+	}
+
+	return svf_image_check(player, op);
+}
+
+/* the minimum time of a RUNTEST, at the rate it is clocked at */
+static uint64_t svf_image_runtest_usec(const struct svf_image_player *player,
+	const struct svf_image_op *op)
+{
+	uint64_t usec = op->usec;
+
+	if (player->handler->svf_freq_policy == SVF_FREQ_DYNAMIC && op->tcks > 0 && op->hz > 0 &&
+			usec < (uint64_t)op->tcks * 1000000 / op->hz)
+		usec = (uint64_t)op->tcks * 1000000 / op->hz;
+
+	return usec;
+}
+
+/* clock the TCKs of a RUNTEST and set when its minimum time is over */
+static int svf_image_runtest_wait(struct svf_image_player *player, const struct svf_image_op *op)
+{
+	uint64_t usec = svf_image_runtest_usec(player, op);
+	struct timeval wait;
+
+	gettimeofday(&player->ready, NULL);
+	wait.tv_sec = usec / 1000000;
+	wait.tv_usec = usec % 1000000;
+	timeradd(&player->ready, &wait, &player->ready);
+	if (op->tcks > 0 && JTAG_run_test(player->handler, JTAG_STATE_CURRENT, op->tcks)) {
+		LOG_ERROR("%s: RUNTEST failed at line %d", player->target, op->line);
+		return ERROR_FAIL;
+	}
+	player->waiting = true;
+
+	return ERROR_OK;
+}
+
+/*
+ * Move to the state of a RUNTEST.  Its wait is timed from when the queued
+ * scans and the move are done; a split-phase player sends them and goes on
+ * in svf_image_runtest_wait() once shift_complete() has their responses.
+ */
+static int svf_image_runtest(struct svf_image_player *player, const struct svf_image_op *op)
+{
+	JTAG_Handler *handler = player->handler;
+	int ret;
+
+	if (svf_tap_move(handler, op->state) != ERROR_OK)
+		return ERROR_FAIL;
+	if (handler->svf_freq_policy == SVF_FREQ_DYNAMIC && op->tcks > 0 && op->hz > 0)
+		svf_image_set_freq(player, op->hz);
+	if (!svf_image_runtest_usec(player, op))
+		return svf_image_runtest_wait(player, op);
+
+	if (player->split) {
+		ret = handler->ops->shift_complete(handler, false);
+		if (ret == -EAGAIN) {
+			player->pending = true;
+			svf_image_set_late(player, false);
+			return ERROR_OK;
+		}
+	} else {
+		ret = JTAG_flush(handler);
+	}
+	if (ret) {
+		LOG_ERROR("%s: RUNTEST failed at line %d", player->target, op->line);
+		return ERROR_FAIL;
+	}
+
+	return svf_image_runtest_wait(player, op);
+}
+
+/*
+ * Play operations until the image is done or the player has to wait: for
+ * the minimum time of a RUNTEST or, split-phase, for responses: to a
+ * shift, to the operations a RUNTEST or the end waits for, or to make
+ * room for those the interface holds back.  Call it again once the wait
+ * is over.
+ */
+static enum svf_image_step svf_image_step(struct svf_image_player *player)
+{
+	JTAG_Handler *handler = player->handler;
+	const struct svf_image *image = player->image;
+	const struct svf_image_op *op;
+	struct timeval now;
+	int ret = ERROR_OK;
+
+	while (player->next < image->num_ops) {
+		op = &image->ops[player->next];
+		if (player->pending) {
+			ret = handler->ops->shift_complete(handler, false);
+			if (ret == -EAGAIN) {
+				svf_image_set_late(player, true);
+				return SVF_STEP_IO;
+			}
+			/* the response has come */
+			player->pending = false;
+			if (op->type == SVF_IMAGE_RUNTEST) {
+				if (ret < 0)
+					LOG_ERROR("%s: RUNTEST failed at line %d", player->target,
+							op->line);
+				ret = ret < 0 ? ERROR_FAIL : svf_image_runtest_wait(player, op);
+				if (ret != ERROR_OK)
+					break;
+				continue;
+			}
+			if (ret < 0) {
+				LOG_ERROR("%s: %s scan of %d bits failed at line %d", player->target,
+						op->type == SVF_IMAGE_SIR ? "IR" : "DR", op->len, op->line);
+				ret = ERROR_FAIL;
+			} else {
+				ret = svf_image_check(player, op);
+			}
+			if (ret != ERROR_OK)
+				break;
+			player->next++;
+			continue;
+		}
+		if (player->waiting) {
+			gettimeofday(&now, NULL);
+			if (timercmp(&now, &player->ready, <))
+				return SVF_STEP_WAIT;
+			player->waiting = false;
+			if (op->end_state != op->state)
+				ret = svf_tap_move(handler, op->end_state);
+			if (ret != ERROR_OK)
+				break;
+			player->next++;
+			continue;
+		}
+		/* rather than have the interface wait for room, wait here */
+		if (player->split) {
+			ret = handler->ops->shift_complete(handler, true);
+			if (ret == -EAGAIN) {
+				player->held = true;
+				svf_image_set_late(player, true);
+				return SVF_STEP_IO;
+			}
+			player->held = false;
+			if (ret < 0) {
+				LOG_ERROR("%s: an operation before line %d failed", player->target,
+						op->line);
+				ret = ERROR_FAIL;
+				break;
+			}
+		}
+
+		switch (op->type) {
+		case SVF_IMAGE_STATE:
+			ret = svf_tap_move(handler, op->state);
+			break;
+		case SVF_IMAGE_PATH:
+			ret = svf_tap_path(handler, op->path, op->len);
+			break;
+		case SVF_IMAGE_FREQ:
+			if (handler->svf_freq_policy == SVF_FREQ_FOLLOW)
+				svf_image_set_freq(player, op->hz ? op->hz : player->freq_fast);
+			else if (handler->svf_freq_policy == SVF_FREQ_FIXED && !handler->frequency)
+				svf_image_set_freq(player, op->hz);
+			break;
+		case SVF_IMAGE_SIR:
+		case SVF_IMAGE_SDR:
+			ret = svf_image_scan(player, op);
+			if (ret == ERROR_OK && player->pending)
+				return SVF_STEP_IO;
+			break;
+		case SVF_IMAGE_RUNTEST:
+			ret = svf_image_runtest(player, op);
+			if (ret == ERROR_OK && player->pending)
+				return SVF_STEP_IO;
+			if (ret == ERROR_OK)
+				continue;
+			break;
+		}
+		if (ret != ERROR_OK)
+			break;
+		player->next++;
+	}
+
+	if (ret == ERROR_OK && player->split) {
+		ret = handler->ops->shift_complete(handler, false);
+		if (ret == -EAGAIN) {
+			svf_image_set_late(player, player->pending);
+			player->pending = true;
+			return SVF_STEP_IO;
+		}
+		player->pending = false;
+	} else if (ret == ERROR_OK) {
+		ret = JTAG_flush(handler);
+	}
+	if (ret != ERROR_OK && player->next == image->num_ops) {
+		LOG_ERROR("%s: an operation before the end failed", player->target);
+		player->next = image->num_ops - 1;
+		ret = ERROR_FAIL;
+	}
+	if (ret != ERROR_OK) {
+		player->result->line = image->ops[player->next].line;
+		return SVF_STEP_FAIL;
+	}
+	return SVF_STEP_DONE;
+}
+
+static int svf_image_player_init(struct svf_image_player *player, const struct svf_image *image,
+	JTAG_Handler *handler, const char *target, struct svf_image_result *result, bool split)
+{
+	memset(result, 0, sizeof(*result));
+	result->status = ERROR_FAIL;
+	memset(player, 0, sizeof(*player));
+	player->handler = handler;
+	player->image = image;
+	player->target = target;
+	player->result = result;
+	player->split = split && handler->ops->shift_submit && handler->ops->shift_complete;
+	player->in = malloc((image->max_len + 7) / 8 + 1);
+	if (!player->in) {
+		LOG_ERROR("not enough memory");
+		return ERROR_FAIL;
+	}
+	player->nonblock = handler->nonblock;
+	if (player->split)
+		handler->nonblock = true;
+	player->freq_cur = handler->frequency;
+	player->freq_fast = handler->svf_max_freq;
+	if (!player->freq_fast && handler->svf_freq_policy != SVF_FREQ_FIXED)
+		player->freq_fast = JTAG_get_clock_frequency(handler);
+	gettimeofday(&player->start, NULL);
+
+	return ERROR_OK;
+}
+
+static void svf_image_player_done(struct svf_image_player *player, enum svf_image_step step)
+{
+	struct timeval end;
+
+	gettimeofday(&end, NULL);
+	player->result->usec = 1000000 * (end.tv_sec - player->start.tv_sec) +
+		end.tv_usec - player->start.tv_usec;
+	player->result->status = step == SVF_STEP_DONE ? ERROR_OK : ERROR_FAIL;
+	player->handler->nonblock = player->nonblock;
+	free(player->in);
+	player->in = NULL;
+}
+
+/*
+ * Play an image on one handler, from the calling thread.  Several threads
+ * may play the same image on different handlers at once.
+ */
+int svf_image_play(const struct svf_image *image, JTAG_Handler *handler, const char *target,
+	struct svf_image_result *result)
+{
+	struct svf_image_player player;
+	enum svf_image_step step;
+	struct timeval now, left;
+
+	if (svf_image_player_init(&player, image, handler, target, result, false) != ERROR_OK)
+		return ERROR_FAIL;
+	while ((step = svf_image_step(&player)) == SVF_STEP_WAIT) {
+		gettimeofday(&now, NULL);
+		if (timercmp(&now, &player.ready, <)) {
+			timersub(&player.ready, &now, &left);
+			usleep(left.tv_sec * 1000000 + left.tv_usec);
+		}
+	}
+	svf_image_player_done(&player, step);
+
+	return result->status;
+}
+
+/*
+ * Play images on many targets from the calling thread alone.  Every
+ * player runs until it has to wait; the RUNTEST waits of all targets run
+ * on one timerfd and the responses of split-phase shifts are awaited on
+ * the handlers' descriptors, all with one epoll_wait().  A descriptor is
+ * only watched while its player waits for a response, so late answers
+ * to a player doing something else do not wake the loop.  Interfaces
+ * without split-phase shifts shift synchronously.
+ */
+int svf_image_play_all(struct svf_image_target *targets, int num)
+{
+	struct svf_image_player *players;
+	struct epoll_event ev, events[64];
+	struct itimerspec its;
+	struct timeval now, first, left;
+	enum svf_image_step step;
+	bool *ready;
+	int epfd = -1, tfd = -1;
+	int i, n, active = 0, failed = 0;
+	uint64_t expired;
+
+	players = calloc(num, sizeof(*players));
+	ready = calloc(num, sizeof(*ready));
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (!players || !ready || epfd < 0 || tfd < 0) {
+		LOG_ERROR("cannot set up the event loop");
+		failed = num;
+		goto out;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = num;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+
+	for (i = 0; i < num; i++) {
+		if (svf_image_player_init(&players[i], targets[i].image, targets[i].handler,
+				targets[i].name, &targets[i].result, true) != ERROR_OK) {
+			failed++;
+			continue;
+		}
+		ready[i] = true;
+		active++;
+	}
+
+	while (active) {
+		for (i = 0; i < num; i++) {
+			if (!ready[i])
+				continue;
+			ready[i] = false;
+			step = svf_image_step(&players[i]);
+			if (step == SVF_STEP_DONE || step == SVF_STEP_FAIL) {
+				svf_image_player_done(&players[i], step);
+				failed += step == SVF_STEP_FAIL;
+				active--;
+			}
+			if (players[i].armed != (step == SVF_STEP_IO)) {
+				players[i].armed = step == SVF_STEP_IO;
+				ev.events = EPOLLIN;
+				ev.data.u32 = i;
+				epoll_ctl(epfd, players[i].armed ? EPOLL_CTL_ADD : EPOLL_CTL_DEL,
+						targets[i].handler->handle, &ev);
+			}
+		}
+		if (!active)
+			break;
+
+		/* one timer for the wait that ends first */
+		timerclear(&first);
+		for (i = 0; i < num; i++) {
+			if ((players[i].waiting || players[i].pending || players[i].held) &&
+					players[i].in &&
+					timerisset(&players[i].ready) &&
+					(!timerisset(&first) || timercmp(&players[i].ready, &first, <)))
+				first = players[i].ready;
+		}
+		memset(&its, 0, sizeof(its));
+		if (timerisset(&first)) {
+			gettimeofday(&now, NULL);
+			if (timercmp(&now, &first, <))
+				timersub(&first, &now, &left);
+			else
+				timerclear(&left);
+			its.it_value.tv_sec = left.tv_sec;
+			its.it_value.tv_nsec = left.tv_usec * 1000 + 1;
+		}
+		timerfd_settime(tfd, 0, &its, NULL);
+
+		n = epoll_wait(epfd, events, ARRAY_SIZE(events), -1);
+		if (n < 0 && errno != EINTR) {
+			LOG_ERROR("epoll_wait failed");
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (events[i].data.u32 == (uint32_t)num) {
+				if (read(tfd, &expired, sizeof(expired)) < 0)
+					continue;
+			} else if (players[events[i].data.u32].pending ||
+					players[events[i].data.u32].held) {
+				ready[events[i].data.u32] = true;
+			}
+		}
+		gettimeofday(&now, NULL);
+		for (i = 0; i < num; i++) {
+			if (players[i].in &&
+					(players[i].waiting || players[i].pending || players[i].held) &&
+					timerisset(&players[i].ready) &&
+					!timercmp(&now, &players[i].ready, <))
+				ready[i] = true;
+		}
+	}
+	/* players left over after an event loop failure */
+	for (i = 0; i < num; i++) {
+		if (players[i].in) {
+			svf_image_player_done(&players[i], SVF_STEP_FAIL);
+			failed++;
+		}
+	}
+out:
+	if (tfd >= 0)
+		close(tfd);
+	if (epfd >= 0)
+		close(epfd);
+	free(ready);
+	free(players);
+
+	return failed ? ERROR_FAIL : ERROR_OK;
+}
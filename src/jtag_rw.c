@@ -189,7 +189,8 @@ int main(int argc, char **argv)
 				goto exit;
 			memset(xfer.data, 0, len);
 		}
-		ret = JTAG_transfer_data(handler, xfer.data, xfer.data, xfer.data_bitlen);
+		ret = JTAG_transfer_data(handler, xfer.data,
+				(xfer.dir & DIR_R) ? xfer.data : NULL, xfer.data_bitlen);
 		if (ret)
 			goto exit;
 		if (xfer.dir & DIR_R) {
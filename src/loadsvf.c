@@ -5,15 +5,104 @@
 #include <getopt.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <pthread.h>
 #include "../include/jtag.h"
 
+enum {
+	OPT_MAX_MEM = 0x100,
+	OPT_JOURNAL,
+	OPT_RESUME,
+	OPT_SKIP_IF_CURRENT,
+	OPT_FREQ_POLICY,
+	OPT_AUTO_FREQ,
+	OPT_FREQ_CACHE,
+	OPT_ADAPTIVE_FREQ,
+	OPT_RT,
+	OPT_RT_CPU,
+	OPT_RT_PRIO,
+	OPT_CHAIN,
+	OPT_DISCOVER,
+	OPT_CHAIN_CACHE,
+	OPT_DEVICE,
+	OPT_JOBS,
+	OPT_THREADS,
+	OPT_BUS_JOBS,
+	OPT_EVENT_LOOP,
+	OPT_MCTP_WINDOW,
+	OPT_MCTP_MAX_MSG,
+};
+
+#define DEFAULT_RT_PRIO		20
+
+#define DEFAULT_FREQ_CACHE	"/var/cache/loadsvf.freq"
+#define DEFAULT_CHAIN_CACHE	"/var/cache/loadsvf.chains"
+#define CHAIN_KEY_LEN		512
+#define DEFAULT_JOB_THREADS	8
+#define DEFAULT_BUS_JOBS	2
+
+static const struct option long_options[] = {
+	{ "max-mem", required_argument, NULL, OPT_MAX_MEM },
+	{ "journal", required_argument, NULL, OPT_JOURNAL },
+	{ "resume", no_argument, NULL, OPT_RESUME },
+	{ "skip-if-current", no_argument, NULL, OPT_SKIP_IF_CURRENT },
+	{ "freq-policy", required_argument, NULL, OPT_FREQ_POLICY },
+	{ "auto-freq", no_argument, NULL, OPT_AUTO_FREQ },
+	{ "freq-cache", required_argument, NULL, OPT_FREQ_CACHE },
+	{ "adaptive-freq", no_argument, NULL, OPT_ADAPTIVE_FREQ },
+	{ "rt", no_argument, NULL, OPT_RT },
+	{ "rt-cpu", required_argument, NULL, OPT_RT_CPU },
+	{ "rt-prio", required_argument, NULL, OPT_RT_PRIO },
+	{ "chain", no_argument, NULL, OPT_CHAIN },
+	{ "discover", no_argument, NULL, OPT_DISCOVER },
+	{ "chain-cache", required_argument, NULL, OPT_CHAIN_CACHE },
+	{ "device", required_argument, NULL, OPT_DEVICE },
+	{ "jobs", required_argument, NULL, OPT_JOBS },
+	{ "threads", required_argument, NULL, OPT_THREADS },
+	{ "bus-jobs", required_argument, NULL, OPT_BUS_JOBS },
+	{ "event-loop", no_argument, NULL, OPT_EVENT_LOOP },
+	{ "mctp-window", required_argument, NULL, OPT_MCTP_WINDOW },
+	{ "mctp-max-msg", required_argument, NULL, OPT_MCTP_MAX_MSG },
+	{ NULL, 0, NULL, 0 },
+};
+
+/* parse a byte count with an optional K/M suffix, -1 if it is not one */
+static int parse_size(const char *str, size_t *size)
+{
+	unsigned long v;
+	int shift = 0;
+	char *end;
+
+	if (!*str || *str == '-')
+		return -1;
+	errno = 0;
+	v = strtoul(str, &end, 0);
+	if (errno || end == str)
+		return -1;
+	if (*end == 'k' || *end == 'K')
+		shift = 10;
+	else if (*end == 'm' || *end == 'M')
+		shift = 20;
+	if (shift)
+		end++;
+	if (*end || v > (SIZE_MAX >> shift))
+		return -1;
+	*size = (size_t)v << shift;
+
+	return 0;
+}
+
 void showUsage(char **argv)
 {
 	fprintf(stderr, "Usage: %s [option(s)]\n", argv[0]);
 	fprintf(stderr, "  -d <intf>     jtag interface\n");
 	fprintf(stderr, "                (/dev/jtagX: jtag device)\n");
 	fprintf(stderr, "                (mctp: af_mctp socket)\n");
+	fprintf(stderr, "                (mctp:<eid>[:<net>]: af_mctp endpoint)\n");
 	fprintf(stderr, "  -m <mode>     jtag mode if using jtag device\n");
 	fprintf(stderr, "                (0: HW mode)\n");
 	fprintf(stderr, "                (1: SW mode)\n");
@@ -22,13 +111,717 @@ void showUsage(char **argv)
 	fprintf(stderr, "  -l <level>    log level\n");
 	fprintf(stderr, "  -f <freq>     force running at frequency (Mhz)\n");
 	fprintf(stderr, "                for jtag device(HW mode)\n");
-	fprintf(stderr, "  -s <filepath> svf file path\n");
-	fprintf(stderr, "  -g            run svf command line by line\n\n");
+	fprintf(stderr, "                repeat with one -s to program several targets\n");
+	fprintf(stderr, "                at once\n");
+	fprintf(stderr, "  -s <filepath> svf file path, repeat to load several\n");
+	fprintf(stderr, "                files back to back in one session\n");
+	fprintf(stderr, "  -g            run svf command line by line\n");
+	fprintf(stderr, "  --max-mem <size>\n");
+	fprintf(stderr, "                bound svf working memory (e.g. 256K)\n");
+	fprintf(stderr, "  --journal <filepath>\n");
+	fprintf(stderr, "                checkpoint progress to a journal file\n");
+	fprintf(stderr, "  --resume      continue from the journal's last checkpoint\n");
+	fprintf(stderr, "  --skip-if-current\n");
+	fprintf(stderr, "                do nothing if IDCODE and USERCODE already match\n");
+	fprintf(stderr, "  --freq-policy <fixed|follow|dynamic>\n");
+	fprintf(stderr, "                how svf FREQUENCY commands set TCK\n");
+	fprintf(stderr, "  --auto-freq   find the highest TCK rate the board takes\n");
+	fprintf(stderr, "  --freq-cache <filepath>\n");
+	fprintf(stderr, "                --auto-freq results (default %s)\n",
+		DEFAULT_FREQ_CACHE);
+	fprintf(stderr, "  --adaptive-freq\n");
+	fprintf(stderr, "                on TDO mismatch lower TCK and retry the phase\n");
+	fprintf(stderr, "  --rt          real-time mode: pinned, SCHED_FIFO, memory locked\n");
+	fprintf(stderr, "  --rt-cpu <cpu>\n");
+	fprintf(stderr, "                cpu for --rt (default: the last one)\n");
+	fprintf(stderr, "  --rt-prio <prio>\n");
+	fprintf(stderr, "                SCHED_FIFO priority for --rt, 1..%d (default %d)\n",
+		JTAG_RT_MAX_PRIO, DEFAULT_RT_PRIO);
+	fprintf(stderr, "  --chain       program a daisy chain together, one -s file\n");
+	fprintf(stderr, "                per device, the first one nearest TDO\n");
+	fprintf(stderr, "  --discover    list the devices on each -d chain, no -s needed\n");
+	fprintf(stderr, "  --chain-cache <filepath>\n");
+	fprintf(stderr, "                chain topologies (default %s)\n",
+		DEFAULT_CHAIN_CACHE);
+	fprintf(stderr, "  --device <index>\n");
+	fprintf(stderr, "                program one device of the chain, 0 nearest TDO,\n");
+	fprintf(stderr, "                padding the svf file for the others\n");
+	fprintf(stderr, "  --jobs <filepath>\n");
+	fprintf(stderr, "                run a manifest of '<intf> <svf file>' lines\n");
+	fprintf(stderr, "                concurrently, no -d or -s needed\n");
+	fprintf(stderr, "  --threads <n> worker threads for --jobs (default %d)\n",
+		DEFAULT_JOB_THREADS);
+	fprintf(stderr, "  --bus-jobs <n>\n");
+	fprintf(stderr, "                --jobs running at once per mctp net (default %d)\n",
+		DEFAULT_BUS_JOBS);
+	fprintf(stderr, "  --event-loop  drive several -d from one thread, overlapping\n");
+	fprintf(stderr, "                their RUNTEST waits\n");
+	fprintf(stderr, "  --mctp-window <n>\n");
+	fprintf(stderr, "                mctp requests in flight, 1 to wait for each\n");
+	fprintf(stderr, "                (default 4)\n");
+	fprintf(stderr, "  --mctp-max-msg <bytes>\n");
+	fprintf(stderr, "                longest mctp transfer message, longer scans are\n");
+	fprintf(stderr, "                split (default 1024, at least 64)\n\n");
+}
+
+/* open intf, taking the endpoint of mctp:<eid>[:<net>] */
+static JTAG_Handler *open_intf(const char *intf, const struct jtag_args *args)
+{
+	struct jtag_args a = *args;
+	char *end;
+	long v;
+
+	if (strncmp(intf, "mctp:", 5))
+		return JTAG_open((char *)intf, &a);
+	v = strtol(intf + 5, &end, 0);
+	jtag_args_add(&a, ARG_EID, v & 0xff);
+	if (*end == ':')
+		jtag_args_add(&a, ARG_NET, strtol(end + 1, NULL, 0) & 0xff);
+
+	return JTAG_open("mctp", &a);
+}
+
+static void print_chain(const char *intf, const struct jtag_chain *chain, int cached)
+{
+	int i;
+
+	printf("%s: %d device(s), IR %d bits%s\n", intf, chain->num_devices,
+		chain->ir_len, cached ? " (cached)" : "");
+	for (i = 0; i < chain->num_devices; i++) {
+		if (chain->dev_ir_len[i] < 0)
+			printf("  %d: IDCODE %08x, IR unknown\n", i, chain->idcode[i]);
+		else
+			printf("  %d: IDCODE %08x, IR %d\n", i, chain->idcode[i],
+				chain->dev_ir_len[i]);
+	}
+}
+
+struct discover_result {
+	int rc;
+	struct jtag_chain chain;
+};
+
+/*
+ * Discover the chains of all interfaces at once, one process each: every
+ * walk waits on its own interface, and jtag_chain.c shifts through static
+ * buffers, so walks cannot share a process.  The children only read the
+ * cache, the results are stored here.
+ */
+static int discover(char **intfs, int num, const struct jtag_args *args, const char *cache)
+{
+	struct discover_result res;
+	JTAG_Handler *handler;
+	char key[CHAIN_KEY_LEN];
+	int fds[2], *pipes;
+	pid_t *pids;
+	int i, failed = 0;
+
+	pipes = calloc(num, sizeof(*pipes));
+	pids = calloc(num, sizeof(*pids));
+	if (!pipes || !pids)
+		return -1;
+	for (i = 0; i < num; i++) {
+		pids[i] = -1;
+		if (pipe(fds)) {
+			perror("pipe");
+			pipes[i] = -1;
+			continue;
+		}
+		fflush(stdout);
+		pids[i] = fork();
+		if (pids[i] == 0) {
+			close(fds[0]);
+			memset(&res, 0, sizeof(res));
+			res.rc = -1;
+			handler = open_intf(intfs[i], args);
+			if (handler) {
+				JTAG_chain_key(intfs[i], key, sizeof(key));
+				res.rc = JTAG_chain_lookup(handler, cache, key, &res.chain);
+				JTAG_close(handler);
+			}
+			if (write(fds[1], &res, sizeof(res)) != sizeof(res))
+				_exit(1);
+			_exit(0);
+		}
+		close(fds[1]);
+		pipes[i] = fds[0];
+		if (pids[i] < 0) {
+			perror("fork");
+			close(pipes[i]);
+			pipes[i] = -1;
+		}
+	}
+
+	for (i = 0; i < num; i++) {
+		if (pipes[i] < 0 || read(pipes[i], &res, sizeof(res)) != sizeof(res))
+			res.rc = -1;
+		if (pipes[i] >= 0)
+			close(pipes[i]);
+		if (pids[i] > 0)
+			waitpid(pids[i], NULL, 0);
+		if (res.rc < 0) {
+			printf("%s: discovery failed\n", intfs[i]);
+			failed++;
+			continue;
+		}
+		print_chain(intfs[i], &res.chain, res.rc);
+		JTAG_chain_key(intfs[i], key, sizeof(key));
+		if (!res.rc && cache && JTAG_chain_store(cache, key, &res.chain))
+			fprintf(stderr, "cannot update %s\n", cache);
+	}
+	free(pipes);
+	free(pids);
+
+	return failed ? -1 : 0;
+}
+
+/* how the targets of several -d or of --jobs are set up */
+struct target_opts {
+	const struct jtag_args *args;
+	int freq_policy;
+	int frequency;
+	bool auto_freq;
+	const char *freq_cache;
+};
+
+/* the autotune scans and its cache are shared, one target at a time */
+static pthread_mutex_t autotune_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static JTAG_Handler *open_target(char *intf, const struct target_opts *opts)
+{
+	JTAG_Handler *handler;
+	int v = opts->frequency;
+
+	handler = open_intf(intf, opts->args);
+	if (!handler) {
+		fprintf(stderr, "%s: failed to open JTAG\n", intf);
+		return NULL;
+	}
+	JTAG_reset_state(handler);
+	if (opts->auto_freq) {
+		pthread_mutex_lock(&autotune_lock);
+		v = JTAG_autotune_frequency(handler, intf, opts->freq_cache);
+		pthread_mutex_unlock(&autotune_lock);
+		if (v > 0)
+			printf("%s: TCK rate %d Hz\n", intf, v);
+		else
+			fprintf(stderr, "%s: TCK autotune failed\n", intf);
+	}
+	JTAG_set_svf_freq_policy(handler, opts->freq_policy, v > 0 ? v : opts->frequency);
+
+	return handler;
+}
+
+struct fanout_target {
+	char *intf;
+	JTAG_Handler *handler;
+	const struct svf_image *image;
+	pthread_t thread;
+	bool started;
+	struct svf_image_result result;
+};
+
+static void *fanout_play(void *arg)
+{
+	struct fanout_target *t = arg;
+
+	JTAG_svf_image_play(t->image, t->handler, t->intf, &t->result);
+
+	return NULL;
+}
+
+/* play on all opened targets from this thread, see JTAG_svf_image_play_all() */
+static void fanout_event_loop(struct fanout_target *targets, int num)
+{
+	struct svf_image_target *play;
+	int i, n = 0;
+
+	play = calloc(num, sizeof(*play));
+	if (!play) {
+		fprintf(stderr, "not enough memory\n");
+		return;
+	}
+	for (i = 0; i < num; i++) {
+		if (!targets[i].handler)
+			continue;
+		play[n].handler = targets[i].handler;
+		play[n].image = targets[i].image;
+		play[n].name = targets[i].intf;
+		n++;
+	}
+	JTAG_svf_image_play_all(play, n);
+	for (i = 0, n = 0; i < num; i++) {
+		if (!targets[i].handler)
+			continue;
+		targets[i].result = play[n++].result;
+		targets[i].started = true;
+	}
+	free(play);
+}
+
+/*
+ * Program one svf file onto several identical targets: the file is parsed
+ * once and every target plays it from its own thread, or all of them from
+ * one event loop.  A target that fails to open or to verify does not hold
+ * up the others.
+ */
+static int fanout(char **intfs, int num, char *svf_path, const struct target_opts *opts,
+	bool event_loop)
+{
+	struct fanout_target *targets;
+	struct fanout_target *t;
+	struct svf_image *image;
+	struct timeval start, end;
+	unsigned long diff, bytes = 0;
+	int i, passed = 0;
+
+	gettimeofday(&start, NULL);
+	image = JTAG_svf_image_load(svf_path);
+	if (!image) {
+		fprintf(stderr, "Failed to parse %s\n", svf_path);
+		return -1;
+	}
+	gettimeofday(&end, NULL);
+	diff = 1000 * (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000;
+	printf("Parsed %s in %lu ms\n", svf_path, diff);
+
+	targets = calloc(num, sizeof(*targets));
+	if (!targets) {
+		JTAG_svf_image_free(image);
+		return -1;
+	}
+	for (i = 0; i < num; i++) {
+		t = &targets[i];
+		t->intf = intfs[i];
+		t->image = image;
+		t->result.status = -1;
+		t->handler = open_target(t->intf, opts);
+	}
+
+	gettimeofday(&start, NULL);
+	if (event_loop)
+		fanout_event_loop(targets, num);
+	for (i = 0; i < num && !event_loop; i++) {
+		t = &targets[i];
+		if (!t->handler)
+			continue;
+		if (pthread_create(&t->thread, NULL, fanout_play, t)) {
+			fprintf(stderr, "%s: cannot start a thread\n", t->intf);
+			continue;
+		}
+		t->started = true;
+	}
+	for (i = 0; i < num; i++) {
+		if (targets[i].started)
+			pthread_join(targets[i].thread, NULL);
+	}
+	gettimeofday(&end, NULL);
+	diff = 1000000 * (end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
+
+	for (i = 0; i < num; i++) {
+		t = &targets[i];
+		if (t->handler)
+			JTAG_close(t->handler);
+		if (!t->started) {
+			printf("%s: not programmed\n", t->intf);
+			continue;
+		}
+		if (t->result.status)
+			printf("%s: FAILED at line %d after %lu ms\n", t->intf,
+				t->result.line, t->result.usec / 1000);
+		else
+			printf("%s: done in %lu ms, %lu bytes shifted, %lu KB/s\n", t->intf,
+				t->result.usec / 1000, t->result.scan_bytes,
+				t->result.usec ? t->result.scan_bytes * 1000 / t->result.usec : 0);
+		passed += !t->result.status;
+		bytes += t->result.scan_bytes;
+	}
+	printf("%d of %d targets programmed in %lu ms, %lu bytes shifted, %lu KB/s in total\n",
+		passed, num, diff / 1000, bytes, diff ? bytes * 1000 / diff : 0);
+
+	free(targets);
+	JTAG_svf_image_free(image);
+
+	return passed == num ? 0 : -1;
+}
+
+/*
+ * --jobs: a manifest of (interface, svf file) jobs run by a pool of
+ * worker threads.  A worker takes the first job it may run: the jobs of
+ * one chain run one at a time in manifest order, and no more than
+ * bus_limit jobs talk to one MCTP network at once.  A loader thread parses
+ * the images ahead of the workers, each file once, so the next image is
+ * ready while the current one is programming.
+ */
+#define JOBS_MAX_LINE		1024
+#define JOBS_MAX_NETS		256
+
+enum job_state {
+	JOB_PENDING,
+	JOB_RUNNING,
+	JOB_DONE,
+};
+
+struct job_image {
+	char *path;
+	struct svf_image *image;
+	bool loaded;		/* image is set, or NULL if parsing failed */
+	int users;		/* jobs not done yet */
+};
+
+struct job {
+	int line;		/* in the manifest */
+	char *intf;
+	int eid;		/* 0: jtag device */
+	int net;
+	int image_index;
+	struct job_image *image;
+	enum job_state state;
+	unsigned long start_ms;	/* since the scheduler started */
+	unsigned long wall_ms;
+	struct svf_image_result result;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct job *jobs;
+	int num_jobs;
+	struct job_image *images;
+	int num_images;
+	int prefetch;		/* images loaded ahead, at most */
+	int live;		/* images loaded and still in use */
+	int bus_limit;
+	int bus_busy[JOBS_MAX_NETS];
+	const struct target_opts *opts;
+	struct timeval start;
+} sched = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static unsigned long ms_since(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return 1000 * (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1000;
+}
+
+/* the chain a job programs: a jtag device or an mctp endpoint */
+static bool job_same_chain(const struct job *a, const struct job *b)
+{
+	if (a->eid || b->eid)
+		return a->eid == b->eid && a->net == b->net;
+	return !strcmp(a->intf, b->intf);
+}
+
+static int jobs_read(const char *manifest, int net)
+{
+	char line[JOBS_MAX_LINE], intf[JOBS_MAX_LINE], path[JOBS_MAX_LINE];
+	struct job *job;
+	FILE *fp;
+	char *end;
+	int num = 0, i, ret = 0;
+
+	fp = fopen(manifest, "r");
+	if (!fp) {
+		perror(manifest);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		num++;
+		if (sscanf(line, "%s", intf) != 1 || intf[0] == '#')
+			continue;
+		if (sscanf(line, "%s %s", intf, path) != 2) {
+			fprintf(stderr, "%s line %d: want <interface> <svf file>\n", manifest, num);
+			ret = -1;
+			break;
+		}
+		job = realloc(sched.jobs, (sched.num_jobs + 1) * sizeof(*job));
+		if (!job) {
+			ret = -1;
+			break;
+		}
+		sched.jobs = job;
+		job = &sched.jobs[sched.num_jobs++];
+		memset(job, 0, sizeof(*job));
+		job->line = num;
+		job->intf = strdup(intf);
+		job->net = net;
+		if (!strncmp(intf, "mctp:", 5)) {
+			job->eid = strtol(intf + 5, &end, 0) & 0xff;
+			if (*end == ':')
+				job->net = strtol(end + 1, NULL, 0) & 0xff;
+		}
+		/* jobs of the same file share one image */
+		for (i = 0; i < sched.num_images; i++) {
+			if (!strcmp(sched.images[i].path, path))
+				break;
+		}
+		if (i == sched.num_images) {
+			struct job_image *images;
+
+			images = realloc(sched.images, (i + 1) * sizeof(*images));
+			if (!images) {
+				ret = -1;
+				break;
+			}
+			sched.images = images;
+			memset(&images[i], 0, sizeof(*images));
+			images[i].path = strdup(path);
+			sched.num_images++;
+		}
+		sched.images[i].users++;
+		job->image_index = i;
+	}
+	fclose(fp);
+	for (i = 0; i < sched.num_jobs; i++)
+		sched.jobs[i].image = &sched.images[sched.jobs[i].image_index];
+	if (!ret && !sched.num_jobs) {
+		fprintf(stderr, "%s: no jobs\n", manifest);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/* loaded far enough ahead, unless the first pending job waits for an image */
+static bool jobs_prefetch_full(void)
+{
+	int i;
+
+	if (sched.live < sched.prefetch)
+		return false;
+	for (i = 0; i < sched.num_jobs; i++) {
+		if (sched.jobs[i].state == JOB_PENDING)
+			return sched.jobs[i].image->loaded;
+	}
+
+	return true;
+}
+
+static void *jobs_loader(void *arg)
+{
+	struct job_image *img;
+	struct svf_image *image;
+	int i;
+
+	for (i = 0; i < sched.num_images; i++) {
+		img = &sched.images[i];
+		pthread_mutex_lock(&sched.lock);
+		while (jobs_prefetch_full())
+			pthread_cond_wait(&sched.cond, &sched.lock);
+		pthread_mutex_unlock(&sched.lock);
+
+		image = JTAG_svf_image_load(img->path);
+		if (!image)
+			fprintf(stderr, "Failed to parse %s\n", img->path);
+
+		pthread_mutex_lock(&sched.lock);
+		img->image = image;
+		img->loaded = true;
+		if (image)
+			sched.live++;
+		pthread_cond_broadcast(&sched.cond);
+		pthread_mutex_unlock(&sched.lock);
+	}
+
+	return NULL;
+}
+
+/* the first job that may run now; *left tells if any is pending at all */
+static struct job *jobs_next(bool *left)
+{
+	struct job *job, *other;
+	int i, j;
+
+	*left = false;
+	for (i = 0; i < sched.num_jobs; i++) {
+		job = &sched.jobs[i];
+		if (job->state != JOB_PENDING)
+			continue;
+		*left = true;
+		if (!job->image->loaded)
+			continue;
+		if (job->eid && sched.bus_busy[job->net] >= sched.bus_limit)
+			continue;
+		for (j = 0; j < sched.num_jobs; j++) {
+			other = &sched.jobs[j];
+			if (j != i && job_same_chain(job, other) && (other->state == JOB_RUNNING ||
+					(j < i && other->state == JOB_PENDING)))
+				break;
+		}
+		if (j == sched.num_jobs)
+			return job;
+	}
+
+	return NULL;
+}
+
+static void job_run(struct job *job)
+{
+	JTAG_Handler *handler;
+	struct timeval start;
+
+	gettimeofday(&start, NULL);
+	job->result.status = -1;
+	if (!job->image->image)
+		goto out;
+	printf("job %d: %s on %s\n", job->line, job->image->path, job->intf);
+	handler = open_target(job->intf, sched.opts);
+	if (!handler)
+		goto out;
+	JTAG_svf_image_play(job->image->image, handler, job->intf, &job->result);
+	JTAG_close(handler);
+out:
+	job->wall_ms = ms_since(&start);
+}
+
+static void *jobs_worker(void *arg)
+{
+	struct job *job;
+	bool left;
+
+	pthread_mutex_lock(&sched.lock);
+	while (1) {
+		job = jobs_next(&left);
+		if (!job) {
+			if (!left)
+				break;
+			pthread_cond_wait(&sched.cond, &sched.lock);
+			continue;
+		}
+		job->state = JOB_RUNNING;
+		job->start_ms = ms_since(&sched.start);
+		if (job->eid)
+			sched.bus_busy[job->net]++;
+		pthread_mutex_unlock(&sched.lock);
+
+		job_run(job);
+
+		pthread_mutex_lock(&sched.lock);
+		job->state = JOB_DONE;
+		if (job->eid)
+			sched.bus_busy[job->net]--;
+		if (!--job->image->users && job->image->image) {
+			JTAG_svf_image_free(job->image->image);
+			job->image->image = NULL;
+			sched.live--;
+		}
+		pthread_cond_broadcast(&sched.cond);
+	}
+	pthread_mutex_unlock(&sched.lock);
+
+	return NULL;
+}
+
+static int run_jobs(const char *manifest, int threads, int bus_limit, int net,
+	const struct target_opts *opts)
+{
+	pthread_t loader, *workers;
+	struct job *job;
+	int i, started = 0, passed = 0, ret = -1;
+
+	if (jobs_read(manifest, net))
+		goto out;
+	if (threads > sched.num_jobs)
+		threads = sched.num_jobs;
+	sched.opts = opts;
+	sched.bus_limit = bus_limit;
+	sched.prefetch = threads + 1;
+	workers = calloc(threads, sizeof(*workers));
+	if (!workers)
+		goto out;
+
+	gettimeofday(&sched.start, NULL);
+	if (pthread_create(&loader, NULL, jobs_loader, NULL)) {
+		fprintf(stderr, "cannot start the loader thread\n");
+		free(workers);
+		goto out;
+	}
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&workers[i], NULL, jobs_worker, NULL))
+			break;
+		started++;
+	}
+	if (!started) {
+		/* no job will finish, let the loader run through */
+		fprintf(stderr, "cannot start the worker threads\n");
+		pthread_mutex_lock(&sched.lock);
+		sched.prefetch = sched.num_images + 1;
+		pthread_cond_broadcast(&sched.cond);
+		pthread_mutex_unlock(&sched.lock);
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+	pthread_join(loader, NULL);
+	free(workers);
+
+	printf("\n%-5s %-24s %-24s %-8s %9s %9s\n", "line", "interface", "svf file",
+		"result", "start ms", "wall ms");
+	for (i = 0; i < sched.num_jobs; i++) {
+		job = &sched.jobs[i];
+		passed += job->state == JOB_DONE && !job->result.status;
+		printf("%-5d %-24s %-24s %-8s %9lu %9lu\n", job->line, job->intf,
+			job->image->path, job->state != JOB_DONE ? "skipped" :
+			job->result.status ? "FAILED" : "done", job->start_ms, job->wall_ms);
+	}
+	printf("%d of %d jobs done in %lu ms, %d thread(s)\n", passed, sched.num_jobs,
+		ms_since(&sched.start), started);
+	if (passed == sched.num_jobs)
+		ret = 0;
+out:
+	for (i = 0; i < sched.num_images; i++) {
+		JTAG_svf_image_free(sched.images[i].image);
+		free(sched.images[i].path);
+	}
+	for (i = 0; i < sched.num_jobs; i++)
+		free(sched.jobs[i].intf);
+	free(sched.images);
+	free(sched.jobs);
+
+	return ret;
+}
+
+static void print_stats(JTAG_Handler *handler)
+{
+	struct jtag_link_stats link;
+	struct svf_stats stats;
+
+	JTAG_get_svf_stats(&stats);
+	if (stats.scans) {
+		printf("Scans: %lu (%lu zero-copy, %lu raw), %lu bytes shifted\n",
+			stats.scans, stats.zero_copy_scans, stats.raw_scans,
+			stats.scan_bytes);
+		printf("Bytes copied per scan: %lu (full assembly: %lu)\n",
+			stats.copy_bytes / stats.scans,
+			stats.legacy_copy_bytes / stats.scans);
+	}
+	if (stats.merged_scans)
+		printf("Chain scans serving several devices: %lu\n", stats.merged_scans);
+	if (stats.freq_switches)
+		printf("TCK rate changes: %lu\n", stats.freq_switches);
+	if (stats.waits)
+		printf("RUNTEST waits: %lu, overshoot avg %lu us, max %lu us\n",
+			stats.waits, stats.wait_overshoot_usec / stats.waits,
+			stats.max_wait_overshoot_usec);
+	if (stats.freq_fallbacks)
+		printf("TCK rate lowered %lu time(s) after TDO mismatches\n",
+			stats.freq_fallbacks);
+	if (!JTAG_get_link_stats(handler, &link) && link.requests)
+		printf("Requests: %lu, round trip %lu us (+/- %lu), timeout %lu ms, "
+			"%lu timeouts, %lu resent, %lu failed\n",
+			link.requests, link.srtt_usec, link.rttvar_usec, link.rto_msec,
+			link.timeouts, link.retries, link.failures);
 }
 
 int main(int argc, char **argv)
 {
-	char *svf_path = NULL;
+	char **svf_paths = NULL;
+	int num_svf = 0;
+	char **jtag_devs = NULL;
+	int num_devs = 0;
 	char *jtag_dev = NULL;
 	int c = 0;
 	int v, i;
@@ -38,10 +831,146 @@ int main(int argc, char **argv)
 	struct timeval start, end;
 	unsigned long diff;
 	JTAG_Handler *handler;
+	struct svf_session *session;
 	struct jtag_args args = {};
+	struct rusage usage;
+	size_t max_mem = 0;
+	char *journal = NULL;
+	bool resume = false;
+	bool skip_if_current = false;
+	unsigned long est_ms, saved_ms = 0;
+	int current = 0;
+	int rc = 0;
+	int status = EXIT_SUCCESS;
+	int freq_policy = SVF_FREQ_FIXED;
+	bool auto_freq = false;
+	char *freq_cache = DEFAULT_FREQ_CACHE;
+	bool adaptive_freq = false;
+	bool rt = false;
+	int rt_cpu = -1;
+	int rt_prio = DEFAULT_RT_PRIO;
+	bool chain = false;
+	bool discover_only = false;
+	char *chain_cache = DEFAULT_CHAIN_CACHE;
+	int device = -1;
+	struct jtag_chain topology;
+	struct jtag_padding pad;
+	char key[CHAIN_KEY_LEN];
+	char *manifest = NULL;
+	int threads = DEFAULT_JOB_THREADS;
+	int bus_jobs = DEFAULT_BUS_JOBS;
+	bool event_loop = false;
+	int net = 1;
+	struct target_opts opts;
 
-	while ((c = getopt(argc, argv, "d:m:e:n:l:f:s:g")) != -1) {
+	svf_paths = calloc(argc, sizeof(char *));
+	jtag_devs = calloc(argc, sizeof(char *));
+	if (!svf_paths || !jtag_devs)
+		return 1;
+
+	while ((c = getopt_long(argc, argv, "d:m:e:n:l:f:s:g", long_options, NULL)) != -1) {
 		switch (c) {
+		case OPT_MAX_MEM: {
+			if (parse_size(optarg, &max_mem)) {
+				fprintf(stderr, "invalid size for --max-mem: %s\n", optarg);
+				showUsage(argv);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		}
+		case OPT_JOURNAL: {
+			journal = optarg;
+			break;
+		}
+		case OPT_RESUME: {
+			resume = true;
+			break;
+		}
+		case OPT_SKIP_IF_CURRENT: {
+			skip_if_current = true;
+			break;
+		}
+		case OPT_FREQ_POLICY: {
+			if (!strcmp(optarg, "fixed"))
+				freq_policy = SVF_FREQ_FIXED;
+			else if (!strcmp(optarg, "follow"))
+				freq_policy = SVF_FREQ_FOLLOW;
+			else if (!strcmp(optarg, "dynamic"))
+				freq_policy = SVF_FREQ_DYNAMIC;
+			else {
+				fprintf(stderr, "unknown frequency policy %s\n", optarg);
+				goto exit;
+			}
+			break;
+		}
+		case OPT_AUTO_FREQ: {
+			auto_freq = true;
+			break;
+		}
+		case OPT_FREQ_CACHE: {
+			freq_cache = optarg;
+			break;
+		}
+		case OPT_ADAPTIVE_FREQ: {
+			adaptive_freq = true;
+			break;
+		}
+		case OPT_RT: {
+			rt = true;
+			break;
+		}
+		case OPT_RT_CPU: {
+			rt_cpu = atoi(optarg);
+			break;
+		}
+		case OPT_RT_PRIO: {
+			rt_prio = atoi(optarg);
+			break;
+		}
+		case OPT_CHAIN: {
+			chain = true;
+			break;
+		}
+		case OPT_DISCOVER: {
+			discover_only = true;
+			break;
+		}
+		case OPT_CHAIN_CACHE: {
+			chain_cache = optarg;
+			break;
+		}
+		case OPT_DEVICE: {
+			device = atoi(optarg);
+			break;
+		}
+		case OPT_JOBS: {
+			manifest = optarg;
+			break;
+		}
+		case OPT_THREADS: {
+			threads = atoi(optarg);
+			break;
+		}
+		case OPT_BUS_JOBS: {
+			bus_jobs = atoi(optarg);
+			break;
+		}
+		case OPT_EVENT_LOOP: {
+			event_loop = true;
+			break;
+		}
+		case OPT_MCTP_WINDOW: {
+			v = atoi(optarg);
+			if (v > 0)
+				jtag_args_add(&args, ARG_MCTP_WINDOW, v);
+			break;
+		}
+		case OPT_MCTP_MAX_MSG: {
+			v = atoi(optarg);
+			if (v >= 64)
+				jtag_args_add(&args, ARG_MCTP_MAX_MSG, v);
+			break;
+		}
 		case 'l': {
 			v = atoi(optarg);
 			if (v >= 0 && v < 3)
@@ -62,6 +991,7 @@ int main(int argc, char **argv)
 		case 'n': {
 			v = atoi(optarg);
 			jtag_args_add(&args, ARG_NET, v & 0xff);
+			net = v & 0xff;
 			break;
 		}
 		case 'f': {
@@ -77,13 +1007,11 @@ int main(int argc, char **argv)
 			break;
 		}
 		case 'd': {
-			jtag_dev = malloc(strlen(optarg) + 1);
-			strcpy(jtag_dev, optarg);
+			jtag_devs[num_devs++] = optarg;
 			break;
 		}
 		case 's': {
-			svf_path = malloc(strlen(optarg) + 1);
-			strcpy(svf_path, optarg);
+			svf_paths[num_svf++] = optarg;
 			break;
 		}
 		default:  // h, ?, and other
@@ -97,32 +1025,168 @@ int main(int argc, char **argv)
 		exit(EXIT_SUCCESS);
 	}
 
-	if (!svf_path || !jtag_dev) {
+	opts.args = &args;
+	opts.freq_policy = freq_policy;
+	opts.frequency = frequency;
+	opts.auto_freq = auto_freq;
+	opts.freq_cache = freq_cache;
+
+	if (manifest) {
+		if (num_devs || num_svf || chain || device >= 0 || journal || skip_if_current ||
+				adaptive_freq || single_step || rt || max_mem) {
+			fprintf(stderr, "--jobs takes its interfaces and files from the manifest and none of\n"
+				"--chain, --device, --journal, --skip-if-current, --adaptive-freq, --rt,\n"
+				"--max-mem or -g\n");
+			goto exit;
+		}
+		if (threads < 1 || bus_jobs < 1) {
+			fprintf(stderr, "--threads and --bus-jobs take at least 1\n");
+			goto exit;
+		}
+		rc = run_jobs(manifest, threads, bus_jobs, net, &opts);
+		if (rc)
+			status = EXIT_FAILURE;
+		goto exit;
+	}
+	if (discover_only && num_devs) {
+		rc = discover(jtag_devs, num_devs, &args, chain_cache);
+		goto exit;
+	}
+	if (!num_svf || !num_devs) {
 		showUsage(argv);
 		goto exit;
 	}
+	if (num_devs > 1) {
+		if (num_svf > 1 || chain || device >= 0 || journal || skip_if_current ||
+				adaptive_freq || single_step || rt || max_mem) {
+			fprintf(stderr, "several -d take one -s and none of --chain, --device, --journal,\n"
+				"--skip-if-current, --adaptive-freq, --rt, --max-mem or -g\n");
+			goto exit;
+		}
+		rc = fanout(jtag_devs, num_devs, svf_paths[0], &opts, event_loop);
+		if (rc)
+			status = EXIT_FAILURE;
+		goto exit;
+	}
+	jtag_dev = jtag_devs[0];
+	if (chain && device >= 0) {
+		fprintf(stderr, "--chain and --device exclude each other\n");
+		goto exit;
+	}
+	if (resume && !journal) {
+		fprintf(stderr, "--resume needs --journal\n");
+		goto exit;
+	}
+	if (journal && num_svf > 1) {
+		fprintf(stderr, "--journal takes a single svf file\n");
+		goto exit;
+	}
+	if (chain && (journal || skip_if_current || adaptive_freq || single_step)) {
+		fprintf(stderr, "--chain does not go with --journal, --skip-if-current, --adaptive-freq or -g\n");
+		goto exit;
+	}
 
-	handler = JTAG_open(jtag_dev, &args);
+	handler = open_intf(jtag_dev, &args);
 	if (!handler) {
 		fprintf(stderr, "Failed to open JTAG\n");
 		goto exit;
 	}
 	JTAG_reset_state(handler);
+	JTAG_set_svf_mem_limit(handler, max_mem);
+	JTAG_set_svf_journal(handler, journal, resume);
+	if (auto_freq) {
+		v = JTAG_autotune_frequency(handler, jtag_dev, freq_cache);
+		if (v > 0) {
+			frequency = v;
+			printf("TCK rate: %d Hz\n", frequency);
+		} else {
+			fprintf(stderr, "TCK autotune failed\n");
+		}
+	}
+	JTAG_set_svf_freq_policy(handler, freq_policy, frequency);
+	JTAG_set_svf_adaptive(handler, adaptive_freq);
+	if (device >= 0) {
+		JTAG_chain_key(jtag_dev, key, sizeof(key));
+		v = JTAG_chain_lookup(handler, chain_cache, key, &topology);
+		if (v == 0 && JTAG_chain_store(chain_cache, key, &topology))
+			fprintf(stderr, "cannot update %s\n", chain_cache);
+		if (v < 0 || JTAG_chain_padding(&topology, device, &pad)) {
+			fprintf(stderr, "Cannot address device %d of %s\n", device, jtag_dev);
+			JTAG_close(handler);
+			goto exit;
+		}
+		print_chain(jtag_dev, &topology, v);
+		printf("Device %d: HIR %d, TIR %d, HDR %d, TDR %d\n", device,
+			pad.hir, pad.tir, pad.hdr, pad.tdr);
+		JTAG_set_svf_padding(handler, &pad);
+	}
+
+	if (skip_if_current) {
+		/* one file proving the image is current skips them all */
+		for (i = 0; i < num_svf; i++) {
+			rc = JTAG_svf_is_current(handler, svf_paths[i], &est_ms);
+			if (rc < 0)
+				break;
+			current |= rc;
+			saved_ms += est_ms;
+		}
+		if (rc >= 0 && current) {
+			printf("Image is already current, skipped programming (about %lu ms saved)\n",
+				saved_ms);
+			JTAG_close(handler);
+			goto exit;
+		}
+		JTAG_reset_state(handler);
+	}
 
-	gettimeofday(&start,NULL);
-	JTAG_load_svf(handler, svf_path, single_step);
-	gettimeofday(&end,NULL);
-	diff = 1000 * (end.tv_sec-start.tv_sec)+ (end.tv_usec-start.tv_usec) / 1000;
-	printf("Programming time is %ld ms\n",diff);
+	session = JTAG_svf_session_create(handler);
+	if (!session) {
+		fprintf(stderr, "Failed to set up svf player\n");
+		JTAG_close(handler);
+		goto exit;
+	}
+	if (rt) {
+		if (rt_cpu < 0)
+			rt_cpu = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+		if (JTAG_rt_enter(rt_cpu, rt_prio) < 0)
+			fprintf(stderr, "Real-time mode not available\n");
+	}
+	if (chain) {
+		gettimeofday(&start,NULL);
+		rc = JTAG_svf_session_run_chain(session, svf_paths, num_svf);
+		gettimeofday(&end,NULL);
+		diff = 1000 * (end.tv_sec-start.tv_sec)+ (end.tv_usec-start.tv_usec) / 1000;
+		printf("Programming time is %ld ms\n",diff);
+		print_stats(handler);
+		if (rc)
+			fprintf(stderr, "chain programming failed\n");
+	}
+	for (i = 0; i < num_svf && !chain; i++) {
+		if (num_svf > 1)
+			printf("Loading %s\n", svf_paths[i]);
+		gettimeofday(&start,NULL);
+		rc = JTAG_svf_session_run(session, svf_paths[i], single_step);
+		gettimeofday(&end,NULL);
+		diff = 1000 * (end.tv_sec-start.tv_sec)+ (end.tv_usec-start.tv_usec) / 1000;
+		printf("Programming time is %ld ms\n",diff);
+		print_stats(handler);
+		if (rc) {
+			fprintf(stderr, "%s failed, skipping the remaining files\n", svf_paths[i]);
+			break;
+		}
+	}
+	if (rt)
+		JTAG_rt_exit();
+	JTAG_svf_session_destroy(session);
+	if (!getrusage(RUSAGE_SELF, &usage))
+		printf("Peak RSS: %ld KB\n", usage.ru_maxrss);
 	//printf("JTAG TCK freq=%d\n", JTAG_get_clock_frequency(handler));
 	//printf("total runtest time is %ld ms\n", total_runtest_time / 1000);
 
 	JTAG_close(handler);
 exit:
-	if (svf_path)
-		free(svf_path);
-	if (jtag_dev)
-		free(jtag_dev);
+	free(svf_paths);
+	free(jtag_devs);
 
-	return 0;
+	return status;
 }
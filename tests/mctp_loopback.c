@@ -0,0 +1,333 @@
+/* Copyright (c) 2023, Nuvoton Corporation */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include "../include/mctp.h"
+#include "mctp_loopback.h"
+
+#define CMD_JTAG_SET_STATE	1
+#define CMD_JTAG_TRANSFER	2
+#define CMD_JTAG_BITBANG	3
+#define CMD_JTAG_BATCH		4
+
+#define JTAG_SIR_XFER		0
+#define JTAG_READ_XFER		1
+#define JTAG_BATCH_TDO		0x01
+#define JTAG_STATUS_UNKNOWN	0x01
+
+#define LOOPBACK_EID		9
+#define LOOPBACK_TAGS		7
+#define LOOPBACK_MSG_MAX	(1 << 16)
+
+struct loopback_xfer {
+	uint8_t type;
+	uint8_t direction;
+	uint8_t from;
+	uint8_t endstate;
+	uint32_t padding;
+	uint32_t length;
+}__attribute__((packed));
+
+bool mctp_loopback_no_batch;
+int mctp_loopback_lose;
+int mctp_loopback_late;
+bool mctp_loopback_ir;
+struct mctp_loopback_stats mctp_loopback_stats;
+
+/* [0] the library's socket, [1] the endpoint's */
+static int loopback_fd[2] = { -1, -1 };
+static int loopback_tags;
+static uint8_t loopback_req[LOOPBACK_MSG_MAX];
+/* a response: [eid][tag][status][TDO] */
+static uint8_t loopback_rsp[LOOPBACK_MSG_MAX + 2];
+/* an answer held back until its tag is sent again */
+static uint8_t loopback_held[LOOPBACK_MSG_MAX + 2];
+static int loopback_held_len;
+/* requests and answers since mctp_loopback_lose and _late were set */
+static int loopback_lose, loopback_lose_seq;
+static int loopback_late, loopback_late_seq;
+static uint8_t loopback_ir_byte;
+
+/* is this the nth event since *n was set to every, counted in *seq? */
+static bool loopback_every(int every, int *n, int *seq)
+{
+	if (every != *n) {
+		*n = every;
+		*seq = 0;
+	}
+
+	return every && ++*seq % every == 0;
+}
+
+static bool loopback_fd_is(int fd)
+{
+	return fd >= 0 && fd == loopback_fd[0];
+}
+
+/* run one operation, appending its TDO to out; -1 if cmd is unknown */
+static int loopback_op(uint8_t cmd, const uint8_t *data, bool tdo, uint8_t *out, int *out_len)
+{
+	const struct loopback_xfer *xfer = (const struct loopback_xfer *)data;
+	const uint8_t *tdi = data + sizeof(*xfer);
+	uint32_t bits;
+	int bytes, i;
+
+	switch (cmd) {
+	case CMD_JTAG_SET_STATE:
+		return 7;
+	case CMD_JTAG_TRANSFER:
+		bytes = (xfer->length + 7) / 8;
+		if (tdo) {
+			for (i = 0; i < bytes; i++)
+				out[*out_len + i] = tdi[i] ^
+					(mctp_loopback_ir && xfer->type != JTAG_SIR_XFER ?
+					 loopback_ir_byte : 0);
+			*out_len += bytes;
+		}
+		if (xfer->type == JTAG_SIR_XFER && bytes)
+			loopback_ir_byte = tdi[0];
+		return sizeof(*xfer) + bytes;
+	case CMD_JTAG_BITBANG:
+		memcpy(&bits, data, sizeof(bits));
+		bytes = (bits + 7) / 8;
+		if (tdo) {
+			memcpy(out + *out_len, data + sizeof(bits) + bytes, bytes);
+			*out_len += bytes;
+		}
+		return sizeof(bits) + 2 * bytes;
+	}
+
+	return -1;
+}
+
+/* answer the request of len bytes in loopback_req, sent with tag */
+static void loopback_answer(int len, uint8_t tag)
+{
+	const struct loopback_xfer *xfer = (const struct loopback_xfer *)(loopback_req + 1);
+	uint8_t *status = &loopback_rsp[2];
+	const uint8_t *p = loopback_req + 1, *end = loopback_req + len;
+	int out_len = 0, n;
+
+	loopback_rsp[0] = LOOPBACK_EID;
+	loopback_rsp[1] = tag & MCTP_TAG_MASK;
+	*status = 0;
+	mctp_loopback_stats.messages++;
+	mctp_loopback_stats.bytes += len;
+
+	if (loopback_req[0] == CMD_JTAG_BATCH && !mctp_loopback_no_batch) {
+		mctp_loopback_stats.batches++;
+		while (p < end) {
+			mctp_loopback_stats.ops++;
+			n = loopback_op(p[0], p + 2, p[1] & JTAG_BATCH_TDO, status + 1, &out_len);
+			if (n < 0) {
+				*status = JTAG_STATUS_UNKNOWN;
+				out_len = 0;
+				break;
+			}
+			p += 2 + n;
+		}
+	} else if (loopback_req[0] == CMD_JTAG_TRANSFER) {
+		mctp_loopback_stats.ops++;
+		loopback_op(loopback_req[0], p, xfer->direction & JTAG_READ_XFER, status + 1,
+				&out_len);
+	} else if (loopback_req[0] == CMD_JTAG_SET_STATE ||
+			loopback_req[0] == CMD_JTAG_BITBANG) {
+		mctp_loopback_stats.ops++;
+		loopback_op(loopback_req[0], p, true, status + 1, &out_len);
+	} else {
+		*status = JTAG_STATUS_UNKNOWN;
+	}
+
+	if (loopback_every(mctp_loopback_late, &loopback_late, &loopback_late_seq) &&
+			!loopback_held_len) {
+		mctp_loopback_stats.late++;
+		memcpy(loopback_held, loopback_rsp, 3 + out_len);
+		loopback_held_len = 3 + out_len;
+		return;
+	}
+	send(loopback_fd[1], loopback_rsp, 3 + out_len, 0);
+}
+
+int socket(int domain, int type, int protocol)
+{
+	static int (*real)(int, int, int);
+
+	if (!real)
+		real = dlsym(RTLD_NEXT, "socket");
+	if (domain != AF_MCTP)
+		return real(domain, type, protocol);
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, loopback_fd) < 0)
+		return -1;
+	loopback_tags = 0;
+	loopback_held_len = 0;
+	loopback_lose = loopback_late = 0;
+	loopback_ir_byte = 0;
+
+	return loopback_fd[0];
+}
+
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+	static ssize_t (*real)(int, const struct msghdr *, int);
+	const struct sockaddr_mctp *addr = msg->msg_name;
+	size_t i, len = 0;
+
+	if (!real)
+		real = dlsym(RTLD_NEXT, "sendmsg");
+	if (!loopback_fd_is(fd))
+		return real(fd, msg, flags);
+	for (i = 0; i < msg->msg_iovlen; i++) {
+		if (len + msg->msg_iov[i].iov_len > sizeof(loopback_req)) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+		memcpy(loopback_req + len, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+		len += msg->msg_iov[i].iov_len;
+	}
+	if (addr->smctp_addr.s_addr != LOOPBACK_EID) {
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+	/* the retry of a held answer's request: the original answer comes first */
+	if (loopback_held_len && (loopback_held[1] & MCTP_TAG_MASK) ==
+			(addr->smctp_tag & MCTP_TAG_MASK)) {
+		send(loopback_fd[1], loopback_held, loopback_held_len, 0);
+		loopback_held_len = 0;
+	}
+	if (loopback_every(mctp_loopback_lose, &loopback_lose, &loopback_lose_seq)) {
+		mctp_loopback_stats.lost++;
+		return len;
+	}
+	loopback_answer(len, addr->smctp_tag);
+
+	return len;
+}
+
+ssize_t recvmsg(int fd, struct msghdr *msg, int flags)
+{
+	static ssize_t (*real)(int, struct msghdr *, int);
+	static uint8_t buf[sizeof(loopback_rsp)];
+	struct sockaddr_mctp *addr = msg->msg_name;
+	size_t i, off = 0, c;
+	ssize_t len;
+
+	if (!real)
+		real = dlsym(RTLD_NEXT, "recvmsg");
+	if (!loopback_fd_is(fd))
+		return real(fd, msg, flags);
+	len = recv(fd, buf, sizeof(buf), flags & MSG_DONTWAIT);
+	if (len < 2)
+		return len < 0 ? len : 0;
+	if (addr) {
+		memset(addr, 0, sizeof(*addr));
+		addr->smctp_family = AF_MCTP;
+		addr->smctp_addr.s_addr = buf[0];
+		addr->smctp_tag = buf[1];
+		msg->msg_namelen = sizeof(*addr);
+	}
+	len -= 2;
+	for (i = 0; i < msg->msg_iovlen && off < (size_t)len; i++) {
+		c = msg->msg_iov[i].iov_len;
+		if (c > len - off)
+			c = len - off;
+		memcpy(msg->msg_iov[i].iov_base, buf + 2 + off, c);
+		off += c;
+	}
+	msg->msg_flags = off < (size_t)len ? MSG_TRUNC : 0;
+
+	return (flags & MSG_TRUNC) ? len : (ssize_t)off;
+}
+
+/* the same for the library sending and receiving in one piece */
+ssize_t sendto(int fd, const void *buf, size_t len, int flags,
+		const struct sockaddr *dest, socklen_t addrlen)
+{
+	static ssize_t (*real)(int, const void *, size_t, int, const struct sockaddr *,
+			socklen_t);
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+	struct msghdr msg = {
+		.msg_name = (void *)dest,
+		.msg_namelen = addrlen,
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+
+	if (!real)
+		real = dlsym(RTLD_NEXT, "sendto");
+	if (!loopback_fd_is(fd))
+		return real(fd, buf, len, flags, dest, addrlen);
+
+	return sendmsg(fd, &msg, flags);
+}
+
+ssize_t recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *src,
+		socklen_t *addrlen)
+{
+	static ssize_t (*real)(int, void *, size_t, int, struct sockaddr *, socklen_t *);
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+	struct msghdr msg = {
+		.msg_name = src,
+		.msg_namelen = addrlen ? *addrlen : 0,
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	ssize_t rc;
+
+	if (!real)
+		real = dlsym(RTLD_NEXT, "recvfrom");
+	if (!loopback_fd_is(fd))
+		return real(fd, buf, len, flags, src, addrlen);
+	rc = recvmsg(fd, &msg, flags);
+	if (rc >= 0 && addrlen)
+		*addrlen = msg.msg_namelen;
+
+	return rc;
+}
+
+/* the library waiting for a response: it is there already, or lost */
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	static int (*real)(struct pollfd *, nfds_t, int);
+
+	if (!real)
+		real = dlsym(RTLD_NEXT, "poll");
+	if (nfds == 1 && loopback_fd_is(fds[0].fd) && timeout)
+		mctp_loopback_stats.waits++;
+
+	return real(fds, nfds, timeout);
+}
+
+/* the tags of the request window */
+int ioctl(int fd, unsigned long request, ...)
+{
+	static int (*real)(int, unsigned long, ...);
+	struct mctp_ioc_tag_ctl *ctl;
+	va_list ap;
+	void *arg;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+	if (!real)
+		real = dlsym(RTLD_NEXT, "ioctl");
+	if (!loopback_fd_is(fd))
+		return real(fd, request, arg);
+	ctl = arg;
+	if (request == SIOCMCTPALLOCTAG && loopback_tags < LOOPBACK_TAGS) {
+		ctl->tag = loopback_tags++ | MCTP_TAG_OWNER | MCTP_TAG_PREALLOC;
+		return 0;
+	}
+	if (request == SIOCMCTPDROPTAG)
+		return 0;
+	errno = ENOTTY;
+
+	return -1;
+}
@@ -0,0 +1,31 @@
+/* Copyright (c) 2023, Nuvoton Corporation */
+#ifndef __MCTP_LOOPBACK_H__
+#define __MCTP_LOOPBACK_H__
+#include <stdbool.h>
+
+/*
+ * An MCTP JTAG endpoint in the test process: AF_MCTP sockets opened by the
+ * library talk to it instead of the kernel.  It loops TDI back as TDO and
+ * answers every request at once, without allocating memory.  It can lose
+ * requests, and hold answers back until their request is sent again, so
+ * that the original answer comes after the timeout and the retry's after
+ * it.
+ */
+struct mctp_loopback_stats {
+	long messages;		/* requests received */
+	long ops;		/* operations in them, a batch counting its own */
+	long batches;		/* CMD_JTAG_BATCH requests answered */
+	long bytes;
+	long lost;		/* requests dropped without running them */
+	long late;		/* answers held back until a retry */
+	long waits;		/* times the library waited for a response */
+};
+
+extern bool mctp_loopback_no_batch;	/* reject CMD_JTAG_BATCH */
+/* counted from when they are set */
+extern int mctp_loopback_lose;		/* lose every nth request, 0: none */
+extern int mctp_loopback_late;		/* hold back every nth answer, 0: none */
+extern bool mctp_loopback_ir;		/* DR TDO is TDI xor the last IR byte */
+extern struct mctp_loopback_stats mctp_loopback_stats;
+
+#endif
@@ -0,0 +1,161 @@
+/* Copyright (c) 2023, Nuvoton Corporation */
+/*
+ * Lost requests and late answers: scans flagged as pure reads are sent
+ * again and still read what they would have read in order, other scans
+ * fail rather than run twice.  The loopback endpoint reads a DR scan as
+ * its TDI xor the last IR byte, so a DR scan that ran before the IR scan
+ * meant to precede it reads wrong.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/time.h>
+#include "../include/jtag.h"
+#include "mctp_loopback.h"
+
+#define LOSS_SCANS	40
+#define LOSS_IR		0x5a	/* every IR scan selects the same register */
+/* a loss costs a retransmit timeout off a sub-ms round trip, not a fixed hold */
+#define LOSS_MS		200
+
+static uint8_t loss_out[LOSS_SCANS][4];
+static uint8_t loss_in[LOSS_SCANS][4];
+
+/* an endpoint answering as it should, once it has answered a first scan */
+static JTAG_Handler *loss_open(bool batch)
+{
+	struct jtag_args args = { 0 };
+	JTAG_Handler *handler;
+	uint8_t ir = 0;
+
+	memset(&mctp_loopback_stats, 0, sizeof(mctp_loopback_stats));
+	mctp_loopback_no_batch = !batch;
+	mctp_loopback_lose = 0;
+	mctp_loopback_late = 0;
+	mctp_loopback_ir = true;
+	jtag_args_add(&args, ARG_EID, 9);
+	jtag_args_add(&args, ARG_LOG_LEVEL, LEV_ERROR);
+	handler = JTAG_open("mctp", &args);
+	if (!handler)
+		return NULL;
+	handler->defer_tdo = true;
+	/* batch support (two scans batch) and the round trip are known from here on */
+	if (JTAG_ir_scan(handler, 8, &ir, NULL, TAP_IDLE) < 0 ||
+			JTAG_ir_scan(handler, 8, &ir, NULL, TAP_IDLE) < 0 || JTAG_flush(handler)) {
+		JTAG_close(handler);
+		return NULL;
+	}
+
+	return handler;
+}
+
+/*
+ * An IR scan and a DR read, scans times, the first IR scan lost if
+ * lose_first; < 0 if one failed, else the DR reads that read wrong.
+ */
+static int loss_scans(JTAG_Handler *handler, int scans, bool lose_first)
+{
+	uint8_t ir = LOSS_IR;
+	int i, j, wrong = 0;
+
+	for (i = 0; i < scans; i++) {
+		for (j = 0; j < 4; j++)
+			loss_out[i][j] = i * 4 + j;
+		memset(loss_in[i], 0, sizeof(loss_in[i]));
+		if (lose_first && !i)
+			mctp_loopback_lose = 1;
+		if (JTAG_ir_scan(handler, 8, &ir, NULL, TAP_IDLE) < 0)
+			return -1;
+		if (lose_first && !i)
+			mctp_loopback_lose = 0;
+		if (JTAG_dr_scan(handler, 32, loss_out[i], loss_in[i], TAP_IDLE) < 0)
+			return -1;
+	}
+	if (JTAG_flush(handler))
+		return -1;
+	for (i = 0; i < scans; i++) {
+		for (j = 0; j < 4; j++) {
+			if (loss_in[i][j] != (loss_out[i][j] ^ LOSS_IR)) {
+				wrong++;
+				break;
+			}
+		}
+	}
+
+	return wrong;
+}
+
+/* play one case: 0 if it went as it should */
+static int loss_case(const char *name, bool batch, bool pure, int lose, int late,
+		bool lose_first)
+{
+	struct jtag_link_stats link = { 0 };
+	struct timeval start, end;
+	JTAG_Handler *handler;
+	long ms;
+	int rc;
+
+	handler = loss_open(batch);
+	if (!handler) {
+		fprintf(stderr, "%s: cannot open the loopback endpoint\n", name);
+		return -1;
+	}
+	handler->pure_reads = pure;
+	mctp_loopback_lose = lose;
+	mctp_loopback_late = late;
+	gettimeofday(&start, NULL);
+	rc = loss_scans(handler, LOSS_SCANS, lose_first);
+	gettimeofday(&end, NULL);
+	ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+	mctp_loopback_lose = 0;
+	mctp_loopback_late = 0;
+	JTAG_get_link_stats(handler, &link);
+	JTAG_close(handler);
+
+	printf("%s: %ld lost, %ld late, %lu resent, rc %d, %ld ms\n", name,
+			mctp_loopback_stats.lost, mctp_loopback_stats.late, link.retries, rc, ms);
+	if (!pure) {
+		if (rc >= 0) {
+			fprintf(stderr, "FAIL: %s: a lost scan that is not a pure read passed\n",
+					name);
+			return -1;
+		}
+		return 0;
+	}
+	if (rc) {
+		fprintf(stderr, "FAIL: %s: %s\n", name, rc < 0 ? "scans failed" :
+				"DR reads out of order");
+		return -1;
+	}
+	if (!mctp_loopback_stats.lost && !mctp_loopback_stats.late) {
+		fprintf(stderr, "FAIL: %s: nothing was lost\n", name);
+		return -1;
+	}
+	if (!link.retries) {
+		fprintf(stderr, "FAIL: %s: nothing was sent again\n", name);
+		return -1;
+	}
+	if (ms > (mctp_loopback_stats.lost + mctp_loopback_stats.late + 1) * LOSS_MS) {
+		fprintf(stderr, "FAIL: %s: %ld ms spent waiting out losses\n", name, ms);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	int rc = 0;
+
+	/* the reads behind a lost IR scan are answered, but with the old IR */
+	rc |= loss_case("lost IR scan", false, true, 0, 0, true);
+	rc |= loss_case("lost requests", false, true, 5, 0, false);
+	rc |= loss_case("lost batches", true, true, 7, 0, false);
+	/* the first answer comes with the retry, the retry's one is dropped */
+	rc |= loss_case("late answers", false, true, 0, 5, false);
+	rc |= loss_case("lost writes", false, false, 5, 0, false);
+
+	return rc ? 1 : 0;
+}
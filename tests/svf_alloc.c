@@ -0,0 +1,163 @@
+/* Copyright (c) 2023, Nuvoton Corporation */
+/*
+ * Programming must not allocate per command: play an SVF file over the
+ * loopback endpoint, then one five times as long, and check that both
+ * runs make the same number of malloc/free calls.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "../include/jtag.h"
+#include "mctp_loopback.h"
+
+#define SVF_BLOCKS	200
+#define SVF_LONG_BITS	2048
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static bool counting;
+static long allocs;
+
+void *malloc(size_t size)
+{
+	if (counting)
+		allocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	if (counting)
+		allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (counting)
+		allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	if (counting && ptr)
+		allocs++;
+	__libc_free(ptr);
+}
+
+/* bits of hex digits, the top one holding what is left over */
+static void write_hex(FILE *fp, int bits, unsigned int seed)
+{
+	static const char hex[] = "0123456789abcdef";
+	int digits = (bits + 3) / 4;
+	int top = bits - (digits - 1) * 4;
+	int i;
+
+	fputc(hex[seed & ((1 << top) - 1)], fp);
+	for (i = 1; i < digits; i++)
+		fputc(hex[(seed + i * 7) & 0xf], fp);
+}
+
+/* scans of several lengths, checked against the looped back TDI */
+static int write_svf(char *path, int blocks)
+{
+	static const int lengths[] = { 8, 32, 67, 512, SVF_LONG_BITS };
+	FILE *fp;
+	int fd, i, j, bits;
+
+	fd = mkstemp(path);
+	if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+		perror(path);
+		return -1;
+	}
+	fprintf(fp, "TRST OFF;\nENDIR IDLE;\nENDDR IDLE;\nSTATE RESET;\nSTATE IDLE;\n");
+	for (i = 0; i < blocks; i++) {
+		for (j = 0; j < (int)ARRAY_SIZE(lengths); j++) {
+			bits = lengths[j];
+			fprintf(fp, "SIR 8 TDI (%02x);\n", (i + j) & 0xff);
+			fprintf(fp, "SDR %d TDI (", bits);
+			write_hex(fp, bits, i + j);
+			fprintf(fp, ")");
+			if (j & 1) {
+				fprintf(fp, " TDO (");
+				write_hex(fp, bits, i + j);
+				fprintf(fp, ")");
+			}
+			fprintf(fp, ";\n");
+		}
+		fprintf(fp, "RUNTEST IDLE 16 TCK ENDSTATE IDLE;\n");
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+/* malloc/free calls of one run */
+static long run(struct svf_session *session, char *path)
+{
+	int rc;
+
+	allocs = 0;
+	counting = true;
+	rc = JTAG_svf_session_run(session, path, false);
+	counting = false;
+	if (rc != 0) {
+		fprintf(stderr, "%s: run failed (%d)\n", path, rc);
+		return -1;
+	}
+
+	return allocs;
+}
+
+int main(void)
+{
+	char short_path[] = "/tmp/svf_alloc_XXXXXX";
+	char long_path[] = "/tmp/svf_alloc_XXXXXX";
+	struct svf_session *session;
+	struct jtag_args args = { 0 };
+	JTAG_Handler *handler;
+	long n_short, n_long;
+	int rc = 1;
+
+	if (write_svf(short_path, SVF_BLOCKS) || write_svf(long_path, 5 * SVF_BLOCKS))
+		return 1;
+	jtag_args_add(&args, ARG_EID, 9);
+	jtag_args_add(&args, ARG_LOG_LEVEL, LEV_ERROR);
+	handler = JTAG_open("mctp", &args);
+	if (!handler)
+		goto out;
+	session = JTAG_svf_session_create(handler);
+	if (!session)
+		goto close;
+
+	/* the first run grows the buffers */
+	if (run(session, short_path) < 0)
+		goto destroy;
+	n_short = run(session, short_path);
+	n_long = run(session, long_path);
+	if (n_short < 0 || n_long < 0)
+		goto destroy;
+	printf("allocations: %ld for %d blocks, %ld for %d blocks (%ld messages)\n", n_short,
+			SVF_BLOCKS, n_long, 5 * SVF_BLOCKS, mctp_loopback_stats.messages);
+	if (n_long != n_short)
+		fprintf(stderr, "FAIL: %ld allocations per extra block\n",
+				(n_long - n_short) / (4 * SVF_BLOCKS));
+	else
+		rc = 0;
+
+destroy:
+	JTAG_svf_session_destroy(session);
+close:
+	JTAG_close(handler);
+out:
+	unlink(short_path);
+	unlink(long_path);
+
+	return rc;
+}
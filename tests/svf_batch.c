@@ -0,0 +1,103 @@
+/* Copyright (c) 2023, Nuvoton Corporation */
+/*
+ * Scans without TDO are packed into CMD_JTAG_BATCH messages: play the same
+ * SVF file over the loopback endpoint with and without batch support and
+ * compare the messages it takes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include "../include/jtag.h"
+#include "mctp_loopback.h"
+
+#define SVF_BLOCKS	100
+#define BATCH_MIN_OPS	3	/* operations per message batching must reach */
+
+/* IR/DR writes, a few short reads and TCKs between them */
+static int write_svf(char *path, int blocks)
+{
+	FILE *fp;
+	int fd, i;
+
+	fd = mkstemp(path);
+	if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+		perror(path);
+		return -1;
+	}
+	fprintf(fp, "TRST OFF;\nENDIR IDLE;\nENDDR IDLE;\nSTATE RESET;\nSTATE IDLE;\n");
+	for (i = 0; i < blocks; i++) {
+		fprintf(fp, "SIR 8 TDI (%02x);\n", i & 0xff);
+		fprintf(fp, "SDR 16 TDI (%04x);\n", i & 0xffff);
+		fprintf(fp, "SIR 8 TDI (%02x);\n", (i + 1) & 0xff);
+		fprintf(fp, "SDR 32 TDI (%08x);\n", i * 0x01010101);
+		if (i % 10 == 9) {
+			fprintf(fp, "SDR 8 TDI (%02x) TDO (%02x);\n", i & 0xff, i & 0xff);
+			fprintf(fp, "RUNTEST IDLE 100 TCK ENDSTATE IDLE;\n");
+		}
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+/* play path, counting what reached the endpoint */
+static int run(char *path, bool batch, struct mctp_loopback_stats *stats)
+{
+	struct svf_session *session;
+	struct jtag_args args = { 0 };
+	JTAG_Handler *handler;
+	int rc = -1;
+
+	mctp_loopback_no_batch = !batch;
+	memset(&mctp_loopback_stats, 0, sizeof(mctp_loopback_stats));
+	jtag_args_add(&args, ARG_EID, 9);
+	jtag_args_add(&args, ARG_LOG_LEVEL, LEV_ERROR);
+	handler = JTAG_open("mctp", &args);
+	if (!handler)
+		return -1;
+	session = JTAG_svf_session_create(handler);
+	if (session) {
+		rc = JTAG_svf_session_run(session, path, false);
+		JTAG_svf_session_destroy(session);
+	}
+	JTAG_close(handler);
+	*stats = mctp_loopback_stats;
+	if (rc != 0)
+		fprintf(stderr, "%s: run %s batching failed (%d)\n", path,
+				batch ? "with" : "without", rc);
+
+	return rc;
+}
+
+int main(void)
+{
+	char path[] = "/tmp/svf_batch_XXXXXX";
+	struct mctp_loopback_stats batched, single;
+	int rc = 1;
+
+	if (write_svf(path, SVF_BLOCKS))
+		return 1;
+	if (run(path, true, &batched) || run(path, false, &single))
+		goto out;
+	printf("batched: %ld messages, %ld operations, %ld batches\n", batched.messages,
+			batched.ops, batched.batches);
+	printf("single: %ld messages, %ld operations\n", single.messages, single.ops);
+
+	if (single.batches || single.ops != single.messages - 1)
+		fprintf(stderr, "FAIL: one operation per message expected without batches\n");
+	else if (batched.ops != single.ops)
+		fprintf(stderr, "FAIL: batching changed the operations\n");
+	else if (batched.messages * BATCH_MIN_OPS > batched.ops)
+		fprintf(stderr, "FAIL: fewer than %d operations per batched message\n",
+				BATCH_MIN_OPS);
+	else
+		rc = 0;
+
+out:
+	unlink(path);
+
+	return rc;
+}
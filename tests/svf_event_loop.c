@@ -0,0 +1,104 @@
+/* Copyright (c) 2023, Nuvoton Corporation */
+/*
+ * The event loop of svf_image_play_all() waits in epoll_wait() alone:
+ * play an SVF file that keeps the request window full over the loopback
+ * endpoint, and count the times the library waited for a response.  Only
+ * learning what the endpoint takes waits, so the file is played twice and
+ * the second time must not wait at all.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include "../include/jtag.h"
+#include "mctp_loopback.h"
+
+#define SVF_BLOCKS	100
+#define LONG_SCAN	20000	/* bits, more than one message takes */
+
+/* runs of writes the window fills up with, a read and a timed RUNTEST after each */
+static int write_svf(char *path, int blocks)
+{
+	FILE *fp;
+	int fd, i;
+
+	fd = mkstemp(path);
+	if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+		perror(path);
+		return -1;
+	}
+	fprintf(fp, "TRST OFF;\nENDIR IDLE;\nENDDR IDLE;\nSTATE RESET;\nSTATE IDLE;\n");
+	for (i = 0; i < blocks; i++) {
+		fprintf(fp, "SIR 8 TDI (%02x);\n", i & 0xff);
+		fprintf(fp, "SDR 16 TDI (%04x);\n", i & 0xffff);
+		fprintf(fp, "SDR 32 TDI (%08x);\n", i * 0x01010101);
+		if (i % 10 == 9) {
+			fprintf(fp, "SDR 8 TDI (%02x) TDO (%02x);\n", i & 0xff, i & 0xff);
+			fprintf(fp, "RUNTEST IDLE 100 TCK 1.0E-4 SEC;\n");
+		}
+	}
+	fprintf(fp, "SDR %d TDI (0) TDO (0);\n", LONG_SCAN);
+	fclose(fp);
+
+	return 0;
+}
+
+/* play the image on target, 0 if it passed without the library waiting */
+static int play(struct svf_image_target *target, const char *name)
+{
+	long waits = mctp_loopback_stats.waits;
+
+	JTAG_svf_image_play_all(target, 1);
+	waits = mctp_loopback_stats.waits - waits;
+	printf("%s: %ld messages in all, %ld waits\n", name, mctp_loopback_stats.messages, waits);
+	if (target->result.status) {
+		fprintf(stderr, "FAIL: %s: playing failed at line %d\n", name,
+				target->result.line);
+		return -1;
+	}
+
+	return waits ? 1 : 0;
+}
+
+int main(void)
+{
+	char path[] = "/tmp/svf_event_loop_XXXXXX";
+	struct svf_image_target target;
+	struct jtag_args args = { 0 };
+	struct svf_image *image;
+	int rc = 1;
+
+	if (write_svf(path, SVF_BLOCKS))
+		return 1;
+	image = JTAG_svf_image_load(path);
+	if (!image) {
+		fprintf(stderr, "%s: cannot load\n", path);
+		goto out;
+	}
+	memset(&mctp_loopback_stats, 0, sizeof(mctp_loopback_stats));
+	jtag_args_add(&args, ARG_EID, 9);
+	jtag_args_add(&args, ARG_LOG_LEVEL, LEV_ERROR);
+	memset(&target, 0, sizeof(target));
+	target.handler = JTAG_open("mctp", &args);
+	target.image = image;
+	target.name = "loopback";
+	if (!target.handler) {
+		fprintf(stderr, "cannot open the loopback endpoint\n");
+		goto out;
+	}
+	if (play(&target, "first") >= 0) {
+		rc = play(&target, "again");
+		if (rc > 0)
+			fprintf(stderr, "FAIL: the library waited for responses\n");
+	}
+	JTAG_close(target.handler);
+
+out:
+	if (image)
+		JTAG_svf_image_free(image);
+	unlink(path);
+
+	return rc;
+}